@@ -33,10 +33,16 @@ typedef struct BmpObject {
   uint8_t *data;
 } BmpObject;
 
+// Images of num_planes 1 are written as 8 bit grayscale, those of num_planes 3 as 24 bit BGR
 int write_bmp_cpu(const char *filename, uint32_t image_width, uint32_t image_height, uint32_t image_padding,
-                  uint32_t mcu_width, short *MCU_buffer);
+                  uint32_t mcu_width, uint32_t block_size, uint32_t num_planes, short *MCU_buffer);
 
+// The DPU writes one byte per colour component of each pixel
 int write_bmp_dpu(const char *filename, uint32_t image_width, uint32_t image_height, uint32_t image_padding,
-                  uint32_t mcu_width, short *MCU_buffer);
+                  uint32_t mcu_width, uint32_t block_size, uint32_t num_planes, uint8_t *MCU_buffer);
+
+// The DPU already laid the image out as padded BMP rows (OPTION_FLAG_RASTER_OUTPUT), so they are written as they are
+int write_bmp_dpu_rows(const char *filename, uint32_t image_width, uint32_t image_height, uint32_t image_padding,
+                       uint32_t num_planes, int bottom_up, uint8_t *rows);
 
 #endif // _BMP__H
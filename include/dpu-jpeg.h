@@ -10,17 +10,89 @@
 #define NR_TASKLETS 16
 #endif
 
+// Tasklets that entropy decode with OPTION_FLAG_PIPELINE, while the others convert the MCU rows they complete
+#ifndef PIPELINE_DECODE_TASKLETS
+#define PIPELINE_DECODE_TASKLETS (NR_TASKLETS - NR_TASKLETS / 4)
+#endif
+
+/**
+ * Per-tasklet WRAM buffers, `make -C src/dpu wram-budget` shows how they add up with the rest of WRAM
+ * A prefetch is a single DMA, so PREFETCH_SIZE can be at most 2048. The MCU cache layout and its synchronisation
+ * slots are tied to PREWRITE_SIZE, which holds CACHE_POSITIONS block positions of all 3 colour components
+ */
+#ifndef PREFETCH_SIZE
+#if NR_FILE_TASKLETS > 1
+#define PREFETCH_SIZE 256
+#else
+#define PREFETCH_SIZE 1024
+#endif
+#endif
+#define PREWRITE_SIZE 768
+#define CACHE_POSITIONS (PREWRITE_SIZE / 192)
+
+// One entry for each block of the cache, see extent_cache
+#define EXTENT_CACHE_SIZE (PREWRITE_SIZE >> 6)
+
+// Room for the part of a pixel row held by the cache, lined up with MRAM words and followed by the row padding
+#define RASTER_CACHE_SIZE (CACHE_POSITIONS * 8 * 3 + 16)
+
+/**
+ * Quantization and Huffman tables shared by all the tasklets, so that files with the same tables share one copy. A
+ * file uses at most 3 quantization tables and 4 Huffman tables, so by default there is room for the tables of every
+ * tasklet that decodes files of its own and none of them waits for another. Any more entries let that many more
+ * tables stay loaded for the next files
+ */
+#ifndef QUANT_TABLE_POOL_SIZE
+#define QUANT_TABLE_POOL_SIZE (NR_FILE_TASKLETS > 1 ? 3 * NR_FILE_TASKLETS : 4)
+#endif
+#ifndef HUFFMAN_TABLE_POOL_SIZE
+#define HUFFMAN_TABLE_POOL_SIZE (NR_FILE_TASKLETS > 1 ? 4 * NR_FILE_TASKLETS : 4)
+#endif
+#if QUANT_TABLE_POOL_SIZE < 3 || HUFFMAN_TABLE_POOL_SIZE < 4
+#error "The table pools must hold the tables of at least one file"
+#endif
+
+// Index of a table ID that is not used by the scan, or that acquire_tables has not loaded yet
+#define NO_TABLE 0xFF
+
 typedef struct JpegInfoDpu {
   uint32_t mcu_end_index[NR_TASKLETS];   // end index of each tasklet in the 2D MRAM MCU buffer
   uint32_t mcu_start_index[NR_TASKLETS]; // start index of each tasklet in the 2D MRAM MCU buffer
   int dc_offset[NR_TASKLETS - 1][3];     // offset to the 3 DC coefficients from tasklet i to tasklet i + 1
-  uint32_t rows_per_tasklet;
-  uint32_t sum_rgb[3];
+  uint32_t segment_first[NR_TASKLETS];     // first MCU of each tasklet's segment in its own MCU buffer
+  uint32_t segment_dest[NR_TASKLETS];      // MCU of the image where each tasklet's segment starts
+  int segment_dc_offset[NR_TASKLETS][3];   // correction to the DC coefficients of each tasklet's segment
+  uint32_t num_restarts[NR_TASKLETS];    // number of RST markers in each tasklet's share of the bitstream
+  uint32_t restart_offset[NR_TASKLETS];  // file offset of the first restart interval in each tasklet's share
+  uint32_t next_row;                     // first MCU row not yet claimed by a converting tasklet
+  volatile uint32_t decode_first[NR_TASKLETS]; // first MCU decoded by each tasklet for the pipelined kernel
+  volatile uint32_t decode_end[NR_TASKLETS];   // MCU after the last one decoded by each tasklet
+  volatile uint32_t decoded_mcu[NR_TASKLETS];  // MCU after the last one each tasklet has written to MRAM
 } JpegInfoDpu;
 
-void init_file_reader_index(JpegDecompressor *d);
+/**
+ * WRAM left for the stacks is split evenly between the tasklets, and the DPU program is built with the same stack size
+ * given to the runtime so that its data is checked against what is left. `make wram-budget` shows how it adds up
+ */
+#define WRAM_SIZE (64 * 1024)
+#ifndef STACK_SIZE_DEFAULT
+#define STACK_SIZE_DEFAULT 704
+#endif
+
+#define WRAM_DATA_SIZE                                                                                                 \
+  (sizeof(dpu_inputs_t) + NR_FILE_TASKLETS * (sizeof(dpu_output_t) + sizeof(JpegInfo)) + sizeof(JpegInfoDpu) +         \
+   NR_TASKLETS * sizeof(dpu_split_t) +                                                                                 \
+   sizeof(ColorTables) + QUANT_TABLE_POOL_SIZE * sizeof(QuantizationTable) +                                           \
+   HUFFMAN_TABLE_POOL_SIZE * sizeof(HuffmanTable) + HUFFMAN_CACHE_ENTRIES * sizeof(uint32_t) +                         \
+   NR_TASKLETS * (PREFETCH_SIZE + PREWRITE_SIZE * sizeof(short) + EXTENT_CACHE_SIZE + RASTER_CACHE_SIZE))
+
+void select_file(JpegDecompressor *d, uint32_t file);
+int read_host_splits(uint32_t file);
 void init_jpeg_decompressor(JpegDecompressor *d);
+void seek_file_index(JpegDecompressor *d, int file_index);
+void index_restart_markers(JpegDecompressor *d);
 uint8_t read_byte(JpegDecompressor *d);
+uint8_t *peek_cached_bytes(JpegDecompressor *d, int num_bytes);
 uint16_t read_short(JpegDecompressor *d);
 int is_eof(JpegDecompressor *d);
 void skip_bytes(JpegDecompressor *d, int num_bytes);
@@ -33,15 +105,30 @@ int process_SOFn(JpegDecompressor *d);
 int process_DHT(JpegDecompressor *d);
 int process_SOS(JpegDecompressor *d);
 
+int acquire_tables(JpegDecompressor *d);
+void release_tables(JpegInfo *info);
+
 void decode_bitstream(JpegDecompressor *d);
+void concat_adjust_mcus(JpegDecompressor *d);
+void decode_restart_intervals(JpegDecompressor *d);
+void decode_host_split(JpegDecompressor *d);
 void inverse_dct_convert(JpegDecompressor *d);
+void decode_pipelined(JpegDecompressor *d, int host_split);
+void decode_whole_file(JpegDecompressor *d);
 
 void crop(JpegDecompressor *d, int start_x, int start_y, int new_width, int new_height);
-void jpeg_scale(JpegDecompressor *d, int x_scale_factor, int y_scale_factor);
-void horizontal_flip(JpegDecompressor *d);
-void find_sum_rgb(JpegDecompressor *d);
 
-extern JpegInfo jpegInfo;
+extern JpegInfo jpegInfos[NR_FILE_TASKLETS];
+extern dpu_output_t output[NR_FILE_TASKLETS];
 extern JpegInfoDpu jpegInfoDpu;
+extern dpu_split_t host_splits[NR_TASKLETS];
+extern ColorTables color_tables;
+extern QuantizationTable quant_tables[QUANT_TABLE_POOL_SIZE];
+extern HuffmanTable huffman_tables[HUFFMAN_TABLE_POOL_SIZE];
+
+// Record of the file decoded with info, where its statistics add up while it is decoded
+static inline dpu_output_t *file_record(JpegInfo *info) {
+  return &output[info - jpegInfos];
+}
 
 #endif // _DPU_JPEG_H
\ No newline at end of file
@@ -10,6 +10,57 @@
 
 #define MAX_HUFFMAN_TABLES 2
 
+// Huffman codes up to this many bits are decoded with a single table lookup
+#ifndef HUFF_LOOKAHEAD
+#define HUFF_LOOKAHEAD 9
+#endif
+
+// Built Huffman tables kept to be reused by the next images whose DHT segments hold the same tables
+#ifndef HUFFMAN_CACHE_ENTRIES
+#define HUFFMAN_CACHE_ENTRIES 8
+#endif
+
+#ifndef NR_TASKLETS
+#define NR_TASKLETS 16
+#endif
+
+#ifndef MAX_FILES_PER_DPU
+#define MAX_FILES_PER_DPU 64
+#endif
+
+// How many tasklets can decode files of their own at the same time (OPTION_FLAG_FILE_PER_TASKLET)
+// Each of them needs its own JpegInfo in WRAM, the JPEG tables themselves are shared
+#ifndef NR_FILE_TASKLETS
+#if NR_TASKLETS < 4
+#define NR_FILE_TASKLETS NR_TASKLETS
+#else
+#define NR_FILE_TASKLETS 4
+#endif
+#endif
+
+#if NR_FILE_TASKLETS > NR_TASKLETS
+#error "NR_FILE_TASKLETS cannot be larger than NR_TASKLETS"
+#endif
+
+// Files up to this length are decoded one per tasklet, if NR_FILE_TASKLETS allows it
+#define SMALL_FILE_LENGTH (32 * 1024)
+
+// Bytes of MCU_buffer for the images of each tasklet that decodes files of its own
+#define FILE_TASKLET_REGION_SIZE ((MAX_DECODED_DATA_SIZE / NR_FILE_TASKLETS) & ~7)
+
+// Images can be reduced by up to 1 << MAX_SCALE_SHIFT while decoding, by computing fewer pixels for every block
+#define MAX_SCALE_SHIFT 3
+
+// Pixels left of a size pixels long side of an image reduced by 1 << shift
+#define SCALED_SIZE(size, shift) (((size) + (1 << (shift)) - 1) >> (shift))
+
+// Values taken by a block position (num_planes colour components of block_size x block_size pixels) in a decoded
+// image, rounded up so that block positions stay 8 byte aligned for DMA when every value is a byte
+#define BLOCK_POSITION_SIZE(block_size, num_planes) (((num_planes) * (block_size) * (block_size) + 7) & ~7)
+
+// Bytes of a row of pixels of num_planes bytes (BGR or gray) padded to a multiple of 4 bytes, as stored in a BMP file
+#define RASTER_ROW_STRIDE(width, num_planes) (((width) * (num_planes) + 3) & ~3)
+
 #define JPEG_VALID 0
 #define JPEG_INVALID_ERROR_CODE 1
 
@@ -17,6 +68,12 @@ enum
 {
 	OPTION_FLAG_HORIZONTAL_FLIP,
 	OPTION_FLAG_TEST_SCALABILITY,			// enable selection of a specific number of DPUs/input files
+	OPTION_FLAG_HOST_SPLIT,				// the host finds where each tasklet starts in each file (see dpu_split_t)
+	OPTION_FLAG_FILE_PER_TASKLET,			// every tasklet decodes whole files on its own (see NR_FILE_TASKLETS)
+	OPTION_FLAG_RASTER_OUTPUT,				// the DPU writes images as padded rows of BGR pixels, ready for a BMP file
+	OPTION_FLAG_BOTTOM_UP,					// with OPTION_FLAG_RASTER_OUTPUT, the last row of an image comes first
+	OPTION_FLAG_LUMA_ONLY,					// decode colour images to grayscale, without their chroma
+	OPTION_FLAG_PIPELINE,					// convert MCU rows once decoded, with restart intervals or host splits
 };
 
 /**
@@ -77,7 +134,13 @@ enum markers {
 typedef struct QuantizationTable {
   uint8_t exists;
 
-  uint32_t table[64];
+  // Qk from DQT. Once prescaled for full size blocks, every coefficient but the DC one is dequantized to
+  // (coefficient * table[k]) >> shift, which already includes the ANN scale of its row
+  uint16_t table[64];
+  uint8_t shift;
+  // A full size table whose prescaled values would not fit is kept as it is, and the ANN scale of the row is applied
+  // to every coefficient after dequantizing it instead
+  uint8_t scale_rows;
 } QuantizationTable;
 
 /**
@@ -85,11 +148,33 @@ typedef struct QuantizationTable {
  */
 typedef struct HuffmanTable {
   uint8_t exists;
+  uint8_t built; // whether the derived decoding tables below are up to date
 
   uint8_t huffval[256];  // HUFFVAL: actually sum(length[0] .. length[15])
   uint8_t valoffset[18]; // offset into huffval for codes of length k
-  uint32_t codes[256];
-} HuffmanTable;
+  uint32_t fingerprint;  // of the code counts and values, to look the table up in the cache of built tables
+
+  // derived decoding tables, built once all DHTs have been read, 16 bits are enough as codes are at most 16 bits long
+  uint16_t code_end[17]; // one past the largest code of length k, the first code of length k + 1 is twice this
+  uint16_t valptr[17];   // index into huffval of the first code of length k, minus that code, modulo 1 << 16
+  // (length << 8) | huffval for codes up to HUFF_LOOKAHEAD bits, 0 otherwise. The DPU reads tables into it with DMA
+  uint16_t lookup[1 << HUFF_LOOKAHEAD] __attribute__((aligned(8)));
+} __attribute__((aligned(8))) HuffmanTable;
+
+/**
+ * Cheap hash of the code counts and values of a Huffman table, never 0 so that it can mark empty cache entries
+ * Only finds the candidates, tables with the same fingerprint are still compared byte by byte
+ */
+static inline uint32_t huffman_fingerprint(const HuffmanTable *h_table) {
+  uint32_t hash = 0;
+  for (int i = 1; i <= 16; i++) {
+    hash = ((hash << 5) | (hash >> 27)) ^ h_table->valoffset[i];
+  }
+  for (int i = 0; i < h_table->valoffset[16]; i++) {
+    hash = ((hash << 5) | (hash >> 27)) ^ h_table->huffval[i];
+  }
+  return hash | 1;
+}
 
 /**
  * Struct to store Color Component information
@@ -114,11 +199,13 @@ typedef struct JpegDecompressor {
   uint32_t length; // total length of JPEG
 
   uint32_t tasklet_id;
+  struct JpegInfo *info; // JpegInfo of the file being read on the DPU, so that tasklets decoding files of their own
+                         // each find theirs without looking it up
   int file_index;
   uint32_t cache_index;
 
   // bit buffer
-  uint32_t bit_buffer;
+  uint64_t bit_buffer; // MSB aligned, refilled several bytes at a time
   uint32_t bits_left;
 } JpegDecompressor;
 
@@ -128,8 +215,19 @@ typedef struct JpegInfo {
   uint32_t length;           // total length of JPEG
   uint32_t size_per_tasklet; // number of bytes to decode per tasklet
 
-  // from DQT
-  QuantizationTable quant_tables[4];
+  // where the file and its decoded image are kept on the DPU
+  uint32_t file_start;          // offset of the file in file_buffer
+  uint32_t image_offset;        // offset of the image in MCU_buffer, in shorts
+  uint32_t coefficient_offset;  // offset of the first tasklet's share of MCU_buffer, in shorts
+  uint32_t tasklet_buffer_size; // shorts in each tasklet's share of MCU_buffer after coefficient_offset
+
+  // from DQT and DHT on the DPU, which only notes where each table is in file_buffer (0 if it is not defined) and
+  // reads the tables used by the scan into the tables shared by its tasklets once all the markers are read
+  uint32_t quant_table_offset[4];                       // of the 64 values, in zigzag order
+  uint32_t huffman_table_offset[2][MAX_HUFFMAN_TABLES]; // of the 16 code counts of each DC and AC table
+  uint8_t quant_table_precision[4];                     // Pq, 0 for 8 bit values, 16 bits otherwise
+  uint8_t quant_table_index[4];                         // shared table of each table ID, NO_TABLE if none
+  uint8_t huffman_table_index[2][MAX_HUFFMAN_TABLES];
 
   // from DRI
   uint16_t restart_interval;
@@ -140,10 +238,6 @@ typedef struct JpegInfo {
   uint8_t num_color_components;
   ColorComponentInfo color_components[3];
 
-  // from DHT
-  HuffmanTable dc_huffman_tables[MAX_HUFFMAN_TABLES];
-  HuffmanTable ac_huffman_tables[MAX_HUFFMAN_TABLES];
-
   // from SOS
   uint8_t ss; // Start of spectral selection
   uint8_t se; // End of spectral selection
@@ -154,6 +248,8 @@ typedef struct JpegInfo {
   uint32_t mcu_height;
   uint32_t mcu_width;
   uint32_t padding;
+  uint8_t scale_shift; // blocks are decoded to (8 >> scale_shift) x (8 >> scale_shift) pixels
+  uint8_t num_planes;  // colour components kept for every pixel: 3 (RGB) or 1 (gray, for grayscale or luma only)
 
   // used when horizontal or vertical sampling factors are not 1
   uint32_t mcu_height_real;   // mcu_height + padding, padding must be 0 or 1
@@ -162,7 +258,6 @@ typedef struct JpegInfo {
   uint32_t max_v_samp_factor; // maximum value of vertical sampling factors amongst all color components
 } JpegInfo;
 
-void jpeg_cpu_scale(uint64_t file_length, char *filename, char *buffer);
 
 /**
  * Helper array for filling in quantization table in zigzag order
@@ -172,21 +267,113 @@ static const uint8_t ZIGZAG_ORDER[] = {0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 3
                                        35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
                                        58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63};
 
+/**
+ * ANN scale of the first pass of the inverse DCT for each row of coefficients, in 1 << AAN_ROW_SCALE_BITS
+ * A coefficient x of row v enters the pass as (x * AAN_ROW_SCALE[v]) >> AAN_ROW_SCALE_BITS
+ */
+#define AAN_ROW_SCALE_BITS 5
+static const uint8_t AAN_ROW_SCALE[8] = {181, 251, 236, 213, 181, 142, 98, 50};
+
+/**
+ * Lookup tables of the YCbCr to RGB conversion, 3 KB shared by everything that converts pixels
+ * The chroma tables are indexed by CHROMA_INDEX of a chroma sample. Green adds cb_g and cr_g before shifting, so that
+ * it rounds like the combined product. The clamp table level shifts and saturates a luma sample plus the contribution
+ * of its chroma, indexed by the sum & CLAMP_TABLE_MASK, which is exact for sums within -512 .. 511
+ */
+#define CLAMP_TABLE_SIZE 1024
+#define CLAMP_TABLE_MASK (CLAMP_TABLE_SIZE - 1)
+#define CHROMA_INDEX(c) ((c) < -128 ? 0 : ((c) > 127 ? 255 : (c) + 128))
+typedef struct ColorTables {
+  int16_t cr_r[256]; // (45 * cr) >> 5
+  int16_t cb_b[256]; // (113 * cb) >> 6
+  int16_t cb_g[256]; // 11 * cb
+  int16_t cr_g[256]; // 23 * cr
+  uint8_t clamp[CLAMP_TABLE_SIZE];
+} ColorTables;
+
+/**
+ * Fill the entries first, first + step, first + 2 * step ... of the colour conversion tables, so that tasklets can
+ * share the work
+ */
+static inline void fill_color_tables(ColorTables *t, int first, int step) {
+  for (int i = first; i < 256; i += step) {
+    int c = i - 128;
+    t->cr_r[i] = (45 * c) >> 5;
+    t->cb_b[i] = (113 * c) >> 6;
+    t->cb_g[i] = 11 * c;
+    t->cr_g[i] = 23 * c;
+  }
+  for (int i = first; i < CLAMP_TABLE_SIZE; i += step) {
+    int x = (i < CLAMP_TABLE_SIZE / 2 ? i : i - CLAMP_TABLE_SIZE) + 128;
+    t->clamp[i] = x < 0 ? 0 : (x > 255 ? 255 : x);
+  }
+}
+
+/**
+ * Reduce an image as much as possible while keeping it at least scale_width pixels wide
+ * Returns the scale shift to decode it with, 0 (full size) if scale_width is 0
+ */
+static inline uint8_t select_scale_shift(uint32_t image_width, uint32_t scale_width) {
+  uint8_t shift = 0;
+  if (scale_width == 0) {
+    return 0;
+  }
+  while (shift < MAX_SCALE_SHIFT && SCALED_SIZE(image_width, shift + 1) >= scale_width) {
+    shift++;
+  }
+  return shift;
+}
+
+/**
+ * Where a tasklet starts decoding the Huffman coded bitstream, when it is split by the host
+ */
+typedef struct dpu_split_t
+{
+	uint32_t offset;		// file offset of the byte holding the first bit of the tasklet's first MCU
+	uint32_t mcu;			// index of the first MCU (in units of max_h_samp_factor x max_v_samp_factor blocks)
+	int16_t dc[3];			// DC predictor of each color component before that MCU
+	uint8_t consumed_bits;	// bits of the first byte that belong to the previous MCU
+	uint8_t padding;
+} dpu_split_t;
+
+/**
+ * Entry of the file table at the start of file_buffer, one for each file assigned to a DPU
+ */
+typedef struct dpu_file_t
+{
+	uint32_t offset;		// where the file starts in file_buffer
+	uint32_t length;
+	uint32_t split_found;	// whether the host found the split points of the file, with OPTION_FLAG_HOST_SPLIT
+	uint32_t padding;
+} dpu_file_t;
+
+// The file table is followed by NR_TASKLETS split points for each of its entries, and then by the files
+#define FILE_SPLITS_OFFSET (MAX_FILES_PER_DPU * sizeof(dpu_file_t))
+#define FILE_TABLE_LENGTH (FILE_SPLITS_OFFSET + MAX_FILES_PER_DPU * NR_TASKLETS * sizeof(dpu_split_t))
+
 typedef struct dpu_inputs_t
 {
-	uint32_t file_length;
-	uint32_t scale_width;
+	uint32_t file_length;			// total length of file_buffer, including the file table
+	uint32_t scale_width;			// reduce images by 1/2, 1/4 or 1/8 while keeping them this wide (0: full size)
 	uint32_t flags;					// see OPTION_FLAG_
-	uint32_t padding;
+	uint32_t file_count;			// number of entries in the file table
 } dpu_inputs_t __attribute__((aligned(8)));
 
+void jpeg_cpu_scale(uint64_t file_length, char *filename, char *buffer, uint32_t scale_width, uint32_t flags);
+int jpeg_cpu_split(uint64_t file_length, char *buffer, dpu_split_t *splits, uint32_t num_splits);
+
 typedef struct dpu_output_t
 {
 	uint16_t width;
 	uint16_t height;
 	uint32_t padding;
 	uint32_t mcu_width_real;
+	uint32_t block_size;	// pixels on each side of the blocks of the decoded image (8 unless it was reduced)
+	uint32_t row_stride;	// bytes from one row to the next of an image in raster order, 0 if it is made of blocks
+	uint32_t bottom_up;		// whether the rows of an image in raster order start with the last one
+	uint32_t num_planes;	// bytes of every pixel: 3 (BGR) or 1 (gray)
 	uint32_t length;		// total length of data buffer, in bytes
+	uint32_t offset;		// where the data buffer starts in MCU_buffer, in bytes
 #ifdef STATISTICS
 	uint32_t mcu_decode_tries; // how many times decode_mcu was called (including failed attempts)
 	uint32_t cycles_read_markers; // how many DPU cycles to read JPEG markers from the header
@@ -199,6 +386,6 @@ typedef struct dpu_output_t
 	uint32_t cycles_dc_adj;
 	uint32_t cycles_total;
 #endif // STATISTICS
-} dpu_output_t __attribute__((aligned(8)));
+} __attribute__((aligned(8))) dpu_output_t; // padded to a multiple of 8 bytes, so that arrays of records can be DMAed
 
 #endif // _JPEG_CPU_H
@@ -0,0 +1,94 @@
+# Generate include/jpeg-huffman-tables.h, the standard Huffman tables of Annex K.3 (used by libjpeg and most
+# encoders) with their decoding tables built the same way as generate_lookup in jpeg-cpu.c and dpu-jpeg-tables.c
+#
+# To use, from the root of the repository:
+# python3 scripts/gen_huffman_tables.py > include/jpeg-huffman-tables.h
+
+LOOKAHEADS = [8, 9]
+
+# (name, BITS: number of codes of each length 1 .. 16, HUFFVAL)
+TABLES = [
+   ('DC luminance', [0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0], list(range(12))),
+   ('AC luminance', [0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d], list(bytes.fromhex(
+      '01020300041105122131410613516107227114328191a1082342b1c11552d1f02433627282090a161718191a25262728292a3435'
+      '363738393a434445464748494a535455565758595a636465666768696a737475767778797a838485868788898a92939495969798'
+      '999aa2a3a4a5a6a7a8a9aab2b3b4b5b6b7b8b9bac2c3c4c5c6c7c8c9cad2d3d4d5d6d7d8d9dae1e2e3e4e5e6e7e8e9eaf1f2f3f4'
+      'f5f6f7f8f9fa'))),
+   ('DC chrominance', [0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0], list(range(12))),
+   ('AC chrominance', [0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77], list(bytes.fromhex(
+      '000102031104052131061241510761711322328108144291a1b1c109233352f0156272d10a162434e125f11718191a262728292a'
+      '35363738393a434445464748494a535455565758595a636465666768696a737475767778797a82838485868788898a9293949596'
+      '9798999aa2a3a4a5a6a7a8a9aab2b3b4b5b6b7b8b9bac2c3c4c5c6c7c8c9cad2d3d4d5d6d7d8d9dae2e3e4e5e6e7e8e9eaf2f3f4'
+      'f5f6f7f8f9fa'))),
+]
+
+
+def build(bits, huffval):
+   valoffset = [0] * 18
+   for length in range(1, 17):
+      valoffset[length] = valoffset[length - 1] + bits[length - 1]
+   code_end = [0] * 17
+   valptr = [0] * 17
+   lookups = {lookahead: [0] * (1 << lookahead) for lookahead in LOOKAHEADS}
+   code = 0
+   for length in range(1, 17):
+      first, last = valoffset[length - 1], valoffset[length]
+      valptr[length] = (first - code) & 0xFFFF
+      for j in range(first, last):
+         for lookahead, lookup in lookups.items():
+            if length <= lookahead:
+               shift = lookahead - length
+               for k in range(1 << shift):
+                  lookup[(code << shift) | k] = (length << 8) | huffval[j]
+         code += 1
+      code_end[length] = code
+      code <<= 1
+   return valoffset, code_end, valptr, lookups
+
+
+def values(numbers, per_line, indent, fmt='%d'):
+   lines = []
+   for i in range(0, len(numbers), per_line):
+      lines.append(indent + ', '.join(fmt % n for n in numbers[i:i + per_line]) + ',')
+   return '\n'.join(lines)
+
+
+print('// Generated by scripts/gen_huffman_tables.py, do not edit')
+print('#ifndef _JPEG_HUFFMAN_TABLES_H')
+print('#define _JPEG_HUFFMAN_TABLES_H')
+print()
+print('/**')
+print(' * The standard Huffman tables of Annex K.3, ready to decode with, for HUFF_LOOKAHEAD %s' %
+      ' or '.join(str(l) for l in LOOKAHEADS))
+print(' * Define STANDARD_HUFFMAN_STORAGE to where they should be kept before including this file, only once')
+print(' * DHT segments that are byte-identical to one of them are replaced by it instead of building their tables')
+print(' */')
+print('#if %s' % ' || '.join('HUFF_LOOKAHEAD == %d' % l for l in LOOKAHEADS))
+print('#define NUM_STANDARD_HUFFMAN_TABLES %d' % len(TABLES))
+print()
+print('STANDARD_HUFFMAN_STORAGE HuffmanTable standard_huffman_tables[NUM_STANDARD_HUFFMAN_TABLES] = {')
+for name, bits, huffval in TABLES:
+   valoffset, code_end, valptr, lookups = build(bits, huffval)
+   print('  // %s' % name)
+   print('  {')
+   print('    .exists = 1,')
+   print('    .built = 1,')
+   print('    .huffval =')
+   print('        {')
+   print(values(huffval, 20, '            '))
+   print('        },')
+   print('    .valoffset = {%s},' % ', '.join(str(n) for n in valoffset))
+   print('    .code_end = {%s},' % ', '.join(str(n) for n in code_end))
+   print('    .valptr = {%s},' % ', '.join(str(n) for n in valptr))
+   print('    .lookup =')
+   print('        {')
+   for i, lookahead in enumerate(LOOKAHEADS):
+      print('#%s HUFF_LOOKAHEAD == %d' % ('if' if i == 0 else 'elif', lookahead))
+      print(values(lookups[lookahead], 12, '            ', '0x%04x'))
+   print('#endif')
+   print('        },')
+   print('  },')
+print('};')
+print('#endif')
+print()
+print('#endif // _JPEG_HUFFMAN_TABLES_H')
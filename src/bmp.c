@@ -1,4 +1,5 @@
 #include "bmp.h"
+#include "jpeg-common.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,45 +18,61 @@ static char *form_bmp_filename(const char *filename, int is_dpu) {
   return filename_copy;
 }
 
-static void initialize_window_info_header(BmpObject *image, uint32_t image_width, uint32_t image_height) {
+// Images of a single plane are written with 8 bits per pixel and a palette of grays
+static void initialize_window_info_header(BmpObject *image, uint32_t image_width, uint32_t image_height,
+                                          uint32_t image_padding, uint32_t num_planes) {
   image->win_header.width = image_width;
   image->win_header.height = image_height;
 
   image->win_header.size = sizeof(WindowsInfoheader);
   image->win_header.planes = 1;
-  image->win_header.bits_per_pixel = 24;
+  image->win_header.bits_per_pixel = 8 * num_planes;
   image->win_header.compression = BI_RGB;
+  // Every row is padded to a multiple of 4 bytes
   image->win_header.length =
-      image->win_header.width * image->win_header.height * (image->win_header.bits_per_pixel >> 3);
+      (image->win_header.width * (image->win_header.bits_per_pixel >> 3) + image_padding) * image->win_header.height;
   image->win_header.hres = 1;
   image->win_header.vres = 1;
-  image->win_header.palette = 0;
+  image->win_header.palette = num_planes == 1 ? 256 : 0;
   image->win_header.important = 0;
 }
 
 static void initialize_bmp_header(BmpObject *image) {
   image->header.magic[0] = 'B';
   image->header.magic[1] = 'M';
-  image->header.data = sizeof(BmpHeader) + sizeof(WindowsInfoheader);
+  image->header.data = sizeof(BmpHeader) + sizeof(WindowsInfoheader) + image->win_header.palette * sizeof(uint32_t);
   image->header.size = image->header.data + image->win_header.length;
 }
 
-static void initialize_bmp_body(BmpObject *image, uint32_t image_padding, uint32_t mcu_width, short *MCU_buffer) {
-  uint8_t *ptr = (uint8_t *) malloc(image->win_header.height * (image->win_header.width * 3 + image_padding));
+// The DPU packs its output as bytes, the CPU keeps the shorts it converted in place
+static inline uint8_t image_sample(const void *MCU_buffer, uint32_t index, int is_dpu) {
+  return is_dpu ? ((const uint8_t *) MCU_buffer)[index] : ((const short *) MCU_buffer)[index];
+}
+
+// Blocks hold block_size x block_size pixels, 8 unless the image was reduced while decoding
+static void initialize_bmp_body(BmpObject *image, uint32_t image_padding, uint32_t mcu_width, uint32_t block_size,
+                                uint32_t num_planes, const void *MCU_buffer, int is_dpu) {
+  uint8_t *ptr = (uint8_t *) malloc(image->win_header.height * (image->win_header.width * num_planes + image_padding));
   image->data = ptr;
+  uint32_t block_pixels = block_size * block_size;
+  uint32_t position_size = BLOCK_POSITION_SIZE(block_size, num_planes);
 
   for (int y = image->win_header.height - 1; y >= 0; y--) {
-    uint32_t mcu_row = y / 8;
-    uint32_t pixel_row = y % 8;
+    uint32_t mcu_row = y / block_size;
+    uint32_t pixel_row = y % block_size;
 
     for (int x = 0; x < image->win_header.width; x++) {
-      uint32_t mcu_column = x / 8;
-      uint32_t pixel_column = x % 8;
+      uint32_t mcu_column = x / block_size;
+      uint32_t pixel_column = x % block_size;
       uint32_t mcu_index = mcu_row * mcu_width + mcu_column;
-      uint32_t pixel_index = pixel_row * 8 + pixel_column;
-      ptr[0] = MCU_buffer[(mcu_index * 3 + 2) * 64 + pixel_index];
-      ptr[1] = MCU_buffer[(mcu_index * 3 + 1) * 64 + pixel_index];
-      ptr[2] = MCU_buffer[(mcu_index * 3 + 0) * 64 + pixel_index];
+      uint32_t pixel = mcu_index * position_size + pixel_row * block_size + pixel_column;
+      if (num_planes == 1) {
+        *ptr++ = image_sample(MCU_buffer, pixel, is_dpu);
+        continue;
+      }
+      ptr[0] = image_sample(MCU_buffer, pixel + 2 * block_pixels, is_dpu);
+      ptr[1] = image_sample(MCU_buffer, pixel + block_pixels, is_dpu);
+      ptr[2] = image_sample(MCU_buffer, pixel, is_dpu);
       ptr += 3;
     }
 
@@ -76,6 +93,10 @@ static int write_bmp_to_file(const char *filename, BmpObject *picture) {
 
   fwrite(&picture->header, sizeof(BmpHeader), 1, output);
   fwrite(&picture->win_header, sizeof(WindowsInfoheader), 1, output);
+  for (uint32_t i = 0; i < picture->win_header.palette; i++) {
+    uint8_t gray[4] = {i, i, i, 0};
+    fwrite(gray, sizeof(gray), 1, output);
+  }
   fwrite(picture->data, 1, picture->win_header.length, output);
 
   fclose(output);
@@ -84,12 +105,12 @@ static int write_bmp_to_file(const char *filename, BmpObject *picture) {
 }
 
 static int write_bmp(const char *filename, uint32_t image_width, uint32_t image_height, uint32_t image_padding,
-                     uint32_t mcu_width, short *MCU_buffer, int is_dpu) {
+                     uint32_t mcu_width, uint32_t block_size, uint32_t num_planes, const void *MCU_buffer, int is_dpu) {
   BmpObject image;
 
-  initialize_window_info_header(&image, image_width, image_height);
+  initialize_window_info_header(&image, image_width, image_height, image_padding, num_planes);
   initialize_bmp_header(&image);
-  initialize_bmp_body(&image, image_padding, mcu_width, MCU_buffer);
+  initialize_bmp_body(&image, image_padding, mcu_width, block_size, num_planes, MCU_buffer, is_dpu);
 
   char *filename_dpu = form_bmp_filename(filename, is_dpu);
 
@@ -101,13 +122,35 @@ static int write_bmp(const char *filename, uint32_t image_width, uint32_t image_
 }
 
 int write_bmp_cpu(const char *filename, uint32_t image_width, uint32_t image_height, uint32_t image_padding,
-                  uint32_t mcu_width, short *MCU_buffer) {
-  return write_bmp(filename, image_width, image_height, image_padding, mcu_width, MCU_buffer, 0);
+                  uint32_t mcu_width, uint32_t block_size, uint32_t num_planes, short *MCU_buffer) {
+  return write_bmp(filename, image_width, image_height, image_padding, mcu_width, block_size, num_planes, MCU_buffer,
+                   0);
 }
 
 int write_bmp_dpu(const char *filename, uint32_t image_width, uint32_t image_height, uint32_t image_padding,
-                  uint32_t mcu_width, short *MCU_buffer) {
-  return write_bmp(filename, image_width, image_height, image_padding, mcu_width, MCU_buffer, 1);
+                  uint32_t mcu_width, uint32_t block_size, uint32_t num_planes, uint8_t *MCU_buffer) {
+  return write_bmp(filename, image_width, image_height, image_padding, mcu_width, block_size, num_planes, MCU_buffer,
+                   1);
+}
+
+int write_bmp_dpu_rows(const char *filename, uint32_t image_width, uint32_t image_height, uint32_t image_padding,
+                       uint32_t num_planes, int bottom_up, uint8_t *rows) {
+  BmpObject image;
+
+  initialize_window_info_header(&image, image_width, image_height, image_padding, num_planes);
+  // A negative height tells readers that the first row is the top one
+  if (!bottom_up) {
+    image.win_header.height = -image.win_header.height;
+  }
+  initialize_bmp_header(&image);
+  image.data = rows;
+
+  char *filename_dpu = form_bmp_filename(filename, 1);
+
+  int result = write_bmp_to_file(filename_dpu, &image);
+  free(filename_dpu);
+
+  return result;
 }
 
 /*
@@ -1,73 +1,554 @@
 #include <mram.h>
 #include <mutex.h>
+#include <sem.h>
 #include <stdio.h>
+#include <string.h>
 #include <perfcounter.h>
 
 #include "jpeg-common.h"
 #include "dpu-jpeg.h"
 
 __mram_noinit short MCU_buffer[NR_TASKLETS][MEGABYTE(16) / NR_TASKLETS];
-extern dpu_output_t output;
+extern dpu_inputs_t input;
 
-#define PREWRITE_SIZE 768
 __dma_aligned short MCU_buffer_cache[NR_TASKLETS][PREWRITE_SIZE];
+
+/**
+ * How far the coefficients of each block of the cache reach, one entry for every 64 shorts of the cache. decode_mcu
+ * records it and the inverse DCT uses it, and it makes the round trip through MRAM with the coefficients in
+ * block_extents, one record of 8 bytes for every block position of MCU_buffer with a byte for each colour component
+ */
+uint8_t extent_cache[NR_TASKLETS][EXTENT_CACHE_SIZE];
+__mram_noinit uint64_t block_extents[sizeof(MCU_buffer) / (64 * sizeof(short))];
+ColorTables color_tables;
 #define MCU_READ_WRITE_SIZE0 128
-#define MCU_READ_WRITE_SIZE1 384
 
-#define INDEX_OFFSET 64
-#define DC_COEFF_OFFSET 192
+// Synchronisation data lives in chroma slots that no block of a single decoded MCU uses, so that whole MCUs can be
+// decoded into the cache while it is recorded
+#define INDEX_OFFSET 256
+#define DC_COEFF_OFFSET 448
+
+// Chroma blocks of images decoded as luma only are decoded here, to keep the bitstream and DC predictors going, and
+// never kept. Single plane MCUs stay below INDEX_OFFSET
+#define DISCARD_OFFSET 640
+
+#define SYNCH_ENTRIES 128
+
+// Where the nonzero AC coefficients of a block lie: nowhere, all in the top left 4x4 (whose zigzag indices run up to
+// 24), or anywhere
+enum { EXTENT_DC, EXTENT_LOW, EXTENT_FULL };
+
+// Non-zero if any of the bytes in x is 0xFF
+#define HAS_FF_BYTE(x) ((~(x) - 0x0101010101010101ULL) & (x) & 0x8080808080808080ULL)
+
+// Longest Huffman code plus the longest coefficient that follows it, so a single refill covers a whole symbol
+#define MAX_SYMBOL_BITS (16 + 11)
+
+// The caller must make sure that the bit buffer holds at least num_bits (between 1 and 32)
+static inline uint32_t peek_bits(JpegDecompressor *d, int num_bits) {
+  return d->bit_buffer >> (64 - num_bits);
+}
+
+static inline void consume_bits(JpegDecompressor *d, int num_bits) {
+  d->bit_buffer <<= num_bits;
+  d->bits_left -= num_bits;
+}
 
-static int get_num_bits(JpegDecompressor *d, int num_bits);
+static void fill_bit_buffer(JpegDecompressor *d);
+static int bitstream_index(JpegDecompressor *d);
+static int receive_extend(JpegDecompressor *d, int num_bits);
 static uint8_t huff_decode(JpegDecompressor *d, HuffmanTable *h_table);
-static int decode_mcu(JpegDecompressor *d, int component_index, short *previous_dc);
+static int decode_mcu(JpegDecompressor *d, int component_index, int cache_index, short *previous_dc);
 
 static void synchronise_tasklets(JpegDecompressor *d, int row, int col, short *previous_dcs);
-static void concat_adjust_mcus(JpegDecompressor *d, int row, int col);
 
+static void inverse_dct_block(JpegDecompressor *d, int cache_index);
 static void inverse_dct_component(JpegDecompressor *d, int cache_index);
-static void ycbcr_to_rgb_pixel(JpegDecompressor *d, int cache_index, int v, int h);
+static void inverse_dct_component_4x4(JpegDecompressor *d, int cache_index);
+static void inverse_dct_component_2x2(JpegDecompressor *d, int cache_index);
+static void inverse_dct_8(short *values, int stride);
+static void inverse_dct_8_low(short *values, int stride);
+static int low_ac_coefficients(short *block);
+static void ycbcr_to_rgb_pixel(JpegDecompressor *d, int mcu_cache_index, int cache_index, int v, int h);
+static void luma_to_gray_pixel(JpegDecompressor *d, int cache_index);
+static int merged_upsample(JpegInfo *info);
+static void ycbcr_to_rgb_h2v2(JpegDecompressor *d, int mcu_cache_index);
+static void ycbcr_to_rgb_h2v1(JpegDecompressor *d, int mcu_cache_index);
+
+/**
+ * Share of MCU_buffer used by a tasklet for the coefficients of the image being decoded. Decoded images are kept one
+ * after the other at the start of MCU_buffer, so the tasklets split whatever space is left after the previous images
+ */
+static inline __mram_ptr short *mcu_buffer(JpegInfo *info, int tasklet_index) {
+  return &MCU_buffer[0][0] + info->coefficient_offset + tasklet_index * info->tasklet_buffer_size;
+}
+
+// Where the image being decoded is written once converted, one byte per colour component of each pixel
+static inline __mram_ptr uint8_t *image_buffer(JpegInfo *info) {
+  return (__mram_ptr uint8_t *) (&MCU_buffer[0][0] + info->image_offset);
+}
+
+// Bytes taken by a block position of the converted image
+static inline int image_position_size(JpegInfo *info) {
+  return BLOCK_POSITION_SIZE(8 >> info->scale_shift, info->num_planes);
+}
+
+// The cache of a tasklet, seen as bytes of the converted image
+static inline uint8_t *image_cache(JpegDecompressor *d) {
+  return (uint8_t *) MCU_buffer_cache[d->tasklet_id];
+}
+
+// Shorts taken by the coefficients of num_positions block positions, each holding num_planes blocks of 64
+static inline int position_index(JpegInfo *info, int num_positions) {
+  return info->num_planes == 1 ? num_positions << 6 : (num_positions << 7) + (num_positions << 6);
+}
+
+// Extent records of a tasklet's share of MCU_buffer, which take no more than one record for each 64 coefficients
+static inline __mram_ptr uint64_t *extent_buffer(JpegInfo *info, int tasklet_index) {
+  return &block_extents[(info->coefficient_offset + tasklet_index * info->tasklet_buffer_size) >> 6];
+}
+
+/**
+ * MCUs are staged in the cache laid out like MCU_buffer: each block position holds its colour components one after
+ * the other, the block positions of a block row follow each other, and block rows are cache_row_stride(info) shorts
+ * apart. Consecutive MCUs of an MCU row then only take one DMA per block row to move between MRAM and WRAM
+ */
+static inline int cache_row_stride(JpegInfo *info) {
+  int stride = position_index(info, CACHE_POSITIONS);
+  return info->max_v_samp_factor == 1 ? stride : stride >> 1;
+}
+
+static inline int block_cache_index(JpegInfo *info, int mcu_cache_index, int y, int x, int color_index) {
+  return mcu_cache_index + y * cache_row_stride(info) + position_index(info, x) + (color_index << 6);
+}
+
+// Where a block is decoded into the cache, colour components that are not kept all go to the same discarded block
+static inline int decode_cache_index(JpegInfo *info, int mcu_cache_index, int y, int x, int color_index) {
+  return color_index < info->num_planes ? block_cache_index(info, mcu_cache_index, y, x, color_index) : DISCARD_OFFSET;
+}
+
+// Number of consecutive MCUs of an MCU row that fit in the cache together
+static inline int mcus_per_batch(JpegInfo *info) {
+  int batch = CACHE_POSITIONS / (info->max_h_samp_factor * info->max_v_samp_factor);
+  return batch > 0 ? batch : 1;
+}
+
+// Read num_mcus consecutive MCUs, the first one with its top left block at (row, col), into the cache
+static void read_mcus(JpegDecompressor *d, int buffer_index, int row, int col, int mcu_cache_index, int num_mcus) {
+  JpegInfo *info = d->info;
+  int num_positions = num_mcus * info->max_h_samp_factor;
+  uint32_t size = position_index(info, num_positions) * sizeof(short);
+  __dma_aligned uint8_t records[CACHE_POSITIONS][8];
+
+  for (int y = 0; y < info->max_v_samp_factor; y++) {
+    int position = (row + y) * info->mcu_width_real + col;
+    int cache_index = block_cache_index(info, mcu_cache_index, y, 0, 0);
+    mram_read(&mcu_buffer(info, buffer_index)[position_index(info, position)],
+              &MCU_buffer_cache[d->tasklet_id][cache_index], size);
+
+    mram_read(&extent_buffer(info, buffer_index)[position], records, num_positions * sizeof(uint64_t));
+    uint8_t *extents = &extent_cache[d->tasklet_id][cache_index >> 6];
+    for (int i = 0; i < num_positions; i++) {
+      for (int color_index = 0; color_index < info->num_planes; color_index++) {
+        *extents++ = records[i][color_index];
+      }
+    }
+  }
+}
+
+// Write num_mcus consecutive MCUs from the cache, the first one with its top left block at (row, col)
+static void write_mcus(JpegDecompressor *d, int buffer_index, int row, int col, int mcu_cache_index, int num_mcus) {
+  JpegInfo *info = d->info;
+  int num_positions = num_mcus * info->max_h_samp_factor;
+  uint32_t size = position_index(info, num_positions) * sizeof(short);
+  __dma_aligned uint8_t records[CACHE_POSITIONS][8];
+
+  for (int y = 0; y < info->max_v_samp_factor; y++) {
+    int position = (row + y) * info->mcu_width_real + col;
+    int cache_index = block_cache_index(info, mcu_cache_index, y, 0, 0);
+    mram_write(&MCU_buffer_cache[d->tasklet_id][cache_index],
+               &mcu_buffer(info, buffer_index)[position_index(info, position)], size);
+
+    uint8_t *extents = &extent_cache[d->tasklet_id][cache_index >> 6];
+    for (int i = 0; i < num_positions; i++) {
+      for (int color_index = 0; color_index < info->num_planes; color_index++) {
+        records[i][color_index] = *extents++;
+      }
+    }
+    mram_write(records, &extent_buffer(info, buffer_index)[position], num_positions * sizeof(uint64_t));
+  }
+}
+
+/**
+ * Write num_mcus consecutive converted MCUs from the cache to the image, the first one with its top left block at
+ * (row, col). The converted values fit in a byte, so they are packed together as bytes before leaving WRAM. Reduced
+ * blocks only fill the start of their slot in the cache and are packed together on the way
+ */
+static void write_image_mcus(JpegDecompressor *d, int row, int col, int num_mcus) {
+  JpegInfo *info = d->info;
+  int block_size = 8 >> info->scale_shift;
+  int block_pixels = block_size * block_size;
+  int position_size = image_position_size(info);
+  int num_positions = num_mcus * info->max_h_samp_factor;
+
+  for (int y = 0; y < info->max_v_samp_factor; y++) {
+    short *cache = &MCU_buffer_cache[d->tasklet_id][block_cache_index(info, 0, y, 0, 0)];
+    uint8_t *packed = (uint8_t *) cache;
+
+    // Values only ever move towards the start of the cache, after they have been read, so this can be done in place
+    for (int position = 0; position < num_positions; position++) {
+      for (int color_index = 0; color_index < info->num_planes; color_index++) {
+        for (int i = 0; i < block_pixels; i++) {
+          packed[position * position_size + color_index * block_pixels + i] =
+              cache[position_index(info, position) + (color_index << 6) + i];
+        }
+      }
+    }
+
+    int image_index = ((row + y) * info->mcu_width_real + col) * position_size;
+    mram_write(packed, &image_buffer(info)[image_index], num_positions * position_size);
+  }
+}
+
+MUTEX_INIT(image_edge_lock);
+
+__dma_aligned uint8_t raster_cache[NR_TASKLETS][RASTER_CACHE_SIZE];
+
+// Copy the bytes of the image from `from` to `to`, which share the MRAM word at `word`, from the raster cache
+static void merge_image_word(JpegInfo *info, uint8_t *cache, uint32_t cache_start, uint32_t word, uint32_t from,
+                             uint32_t to) {
+  __dma_aligned uint8_t merged[8];
+
+  mutex_lock(image_edge_lock);
+  mram_read(&image_buffer(info)[word], merged, 8);
+  for (uint32_t i = from; i < to; i++) {
+    merged[i - word] = cache[i - cache_start];
+  }
+  mram_write(merged, &image_buffer(info)[word], 8);
+  mutex_unlock(image_edge_lock);
+}
+
+/**
+ * Write length bytes from the raster cache, where they start at offset % 8, to offset bytes into the image
+ * Rows are not a whole number of MRAM words, so the words at either end may be shared with another tasklet and are
+ * merged under a lock
+ */
+static void write_image_bytes(JpegDecompressor *d, uint32_t offset, uint32_t length) {
+  JpegInfo *info = d->info;
+  uint8_t *cache = raster_cache[d->tasklet_id];
+  uint32_t end = offset + length;
+  uint32_t cache_start = offset & ~7;
+  uint32_t first_word = (offset + 7) & ~7;
+  uint32_t last_word = end & ~7;
+
+  if (first_word > last_word) {
+    merge_image_word(info, cache, cache_start, cache_start, offset, end);
+    return;
+  }
+  if (offset < first_word) {
+    merge_image_word(info, cache, cache_start, cache_start, offset, first_word);
+  }
+  if (first_word < last_word) {
+    mram_write(&cache[first_word - cache_start], &image_buffer(info)[first_word], last_word - first_word);
+  }
+  if (last_word < end) {
+    merge_image_word(info, cache, cache_start, last_word, last_word, end);
+  }
+}
+
+/**
+ * Write num_mcus consecutive converted MCUs from the cache to an image in raster order, the first one with its top
+ * left block at (row, col). Every pixel row they cover gets its BGR or gray pixels, and its padding if they end the row
+ */
+static void write_image_rows(JpegDecompressor *d, int row, int col, int num_mcus) {
+  JpegInfo *info = d->info;
+  int block_size = 8 >> info->scale_shift;
+  uint32_t width = SCALED_SIZE(info->image_width, info->scale_shift);
+  uint32_t height = SCALED_SIZE(info->image_height, info->scale_shift);
+  uint32_t row_stride = RASTER_ROW_STRIDE(width, info->num_planes);
+  uint32_t first_x = col * block_size;
+  uint32_t end_x = (col + num_mcus * info->max_h_samp_factor) * block_size;
+  if (end_x > width) {
+    end_x = width;
+  }
+  if (first_x >= end_x) {
+    return;
+  }
+
+  for (int y = 0; y < info->max_v_samp_factor; y++) {
+    short *blocks = &MCU_buffer_cache[d->tasklet_id][block_cache_index(info, 0, y, 0, 0)];
+
+    for (int pixel_row = 0; pixel_row < block_size; pixel_row++) {
+      uint32_t image_row = (row + y) * block_size + pixel_row;
+      if (image_row >= height) {
+        return;
+      }
+      if (input.flags & (1 << OPTION_FLAG_BOTTOM_UP)) {
+        image_row = height - 1 - image_row;
+      }
+
+      uint32_t offset = image_row * row_stride + first_x * info->num_planes;
+      uint8_t *start = &raster_cache[d->tasklet_id][offset & 7];
+      uint8_t *pixel = start;
+      for (uint32_t x = first_x, position = 0; x < end_x; x += block_size, position++) {
+        short *rgb = &blocks[position_index(info, position) + pixel_row * block_size];
+        int num_pixels = end_x - x < block_size ? end_x - x : block_size;
+        if (info->num_planes == 1) {
+          for (int i = 0; i < num_pixels; i++) {
+            *pixel++ = rgb[i];
+          }
+          continue;
+        }
+        for (int i = 0; i < num_pixels; i++) {
+          pixel[0] = rgb[i + 128];
+          pixel[1] = rgb[i + 64];
+          pixel[2] = rgb[i];
+          pixel += 3;
+        }
+      }
+      if (end_x == width) {
+        for (uint32_t i = width * info->num_planes; i < row_stride; i++) {
+          *pixel++ = 0;
+        }
+      }
+
+      write_image_bytes(d, offset, pixel - start);
+    }
+  }
+}
 
 void decode_bitstream(JpegDecompressor *d) {
+  JpegInfo *info = d->info;
   short previous_dcs[3] = {0};
-  int restart_interval = jpegInfo.restart_interval * jpegInfo.max_h_samp_factor * jpegInfo.max_v_samp_factor;
+  int restart_interval = info->restart_interval * info->max_h_samp_factor * info->max_v_samp_factor;
   int synch_mcu_index = 0;
 
-  for (int row = 0; row < jpegInfo.mcu_height; row += jpegInfo.max_v_samp_factor) {
-    for (int col = 0; col < jpegInfo.mcu_width; col += jpegInfo.max_h_samp_factor) {
+  // Entries left over from the previous file must not be mistaken for this one's
+  memset(&MCU_buffer_cache[d->tasklet_id][INDEX_OFFSET], 0, SYNCH_ENTRIES * sizeof(short));
+
+  // Until it synchronises with the next tasklet, a tasklet's segment runs to the end of the image
+  jpegInfoDpu.mcu_end_index[d->tasklet_id] = position_index(info, info->mcu_height_real * info->mcu_width_real);
+
+  for (int row = 0; row < info->mcu_height; row += info->max_v_samp_factor) {
+    for (int col = 0; col < info->mcu_width; col += info->max_h_samp_factor) {
       if (is_eof(d)) {
         // goto sync0;
         synchronise_tasklets(d, row, col, previous_dcs);
         return;
       }
 
-      for (int color_index = 0; color_index < jpegInfo.num_color_components; color_index++) {
-        for (int y = 0; y < jpegInfo.color_components[color_index].v_samp_factor; y++) {
-          for (int x = 0; x < jpegInfo.color_components[color_index].h_samp_factor; x++) {
+      for (int color_index = 0; color_index < info->num_color_components; color_index++) {
+        for (int y = 0; y < info->color_components[color_index].v_samp_factor; y++) {
+          for (int x = 0; x < info->color_components[color_index].h_samp_factor; x++) {
             // Decode Huffman coded bitstream
-            while (decode_mcu(d, color_index, &previous_dcs[color_index]) != 0) {
+            int cache_index = decode_cache_index(info, 0, y, x, color_index);
+            while (decode_mcu(d, color_index, cache_index, &previous_dcs[color_index]) != 0) {
               // Keep decoding until valid MCU is decoded
             }
 
-            if (synch_mcu_index < 128) {
-              MCU_buffer_cache[d->tasklet_id][INDEX_OFFSET + synch_mcu_index] = d->file_index + d->cache_index;
-              MCU_buffer_cache[d->tasklet_id][DC_COEFF_OFFSET + synch_mcu_index] = MCU_buffer_cache[d->tasklet_id][0];
+            if (synch_mcu_index < SYNCH_ENTRIES) {
+              MCU_buffer_cache[d->tasklet_id][INDEX_OFFSET + synch_mcu_index] = bitstream_index(d);
+              MCU_buffer_cache[d->tasklet_id][DC_COEFF_OFFSET + synch_mcu_index] =
+                  MCU_buffer_cache[d->tasklet_id][cache_index];
               synch_mcu_index++;
             }
+          }
+        }
+      }
 
-            int mcu_index = (((row + y) * jpegInfo.mcu_width_real + (col + x)) * 3 + color_index) << 6;
-            mram_write(MCU_buffer_cache[d->tasklet_id], &MCU_buffer[d->tasklet_id][mcu_index], MCU_READ_WRITE_SIZE0);
+      write_mcus(d, d->tasklet_id, row, col, 0, 1);
+    }
+  }
+}
+
+/**
+ * Tasklets of the pipelined kernel that wait for the MCUs of a row sleep on mcus_published, and are all woken up to
+ * look again when a decoding tasklet publishes progress or clears info->valid. They look at the progress and count
+ * themselves under decoded_lock, so that a wake up cannot slip in between
+ */
+MUTEX_INIT(decoded_lock);
+SEMAPHORE_INIT(mcus_published, 0);
+static int num_converters_waiting;
+
+static void wake_converters() {
+  mutex_lock(decoded_lock);
+  int waiting = num_converters_waiting;
+  num_converters_waiting = 0;
+  mutex_unlock(decoded_lock);
+
+  for (int i = 0; i < waiting; i++) {
+    sem_give(&mcus_published);
+  }
+}
+
+/**
+ * Decode MCUs [mcu, end_mcu) with exact coordinates, writing them straight to their final position
+ * Counts in units of max_h_samp_factor x max_v_samp_factor blocks. Progress is only published for the pipelined
+ * kernel, the other kernels wait for the whole image behind a barrier and leave decoded_lock alone
+ */
+static void decode_mcu_range(JpegDecompressor *d, uint32_t mcu, uint32_t end_mcu, short *previous_dcs,
+                             int pipelined) {
+  JpegInfo *info = d->info;
+  uint32_t mcus_per_row = info->mcu_width_real / info->max_h_samp_factor;
+  uint32_t batch = mcus_per_batch(info);
+
+  while (mcu < end_mcu) {
+    // Decode as many MCUs of the current MCU row as fit in the cache, then write them out together
+    int row = (mcu / mcus_per_row) * info->max_v_samp_factor;
+    int col = (mcu % mcus_per_row) * info->max_h_samp_factor;
+    uint32_t num_mcus = mcus_per_row - mcu % mcus_per_row;
+    if (num_mcus > batch) {
+      num_mcus = batch;
+    }
+    if (num_mcus > end_mcu - mcu) {
+      num_mcus = end_mcu - mcu;
+    }
+
+    for (uint32_t i = 0; i < num_mcus; i++, mcu++) {
+      if (info->restart_interval != 0 && mcu % info->restart_interval == 0) {
+        previous_dcs[0] = 0;
+        previous_dcs[1] = 0;
+        previous_dcs[2] = 0;
+
+        // Skip the padding bits before the RST marker, the marker itself was dropped when the bit buffer was filled
+        consume_bits(d, d->bits_left % 8);
+      }
+
+      int mcu_cache_index = position_index(info, i * info->max_h_samp_factor);
+      for (int color_index = 0; color_index < info->num_color_components; color_index++) {
+        for (int y = 0; y < info->color_components[color_index].v_samp_factor; y++) {
+          for (int x = 0; x < info->color_components[color_index].h_samp_factor; x++) {
+            int cache_index = decode_cache_index(info, mcu_cache_index, y, x, color_index);
+            if (decode_mcu(d, color_index, cache_index, &previous_dcs[color_index]) != 0) {
+              info->valid = 0;
+              printf("Error: Invalid MCU\n");
+              if (pipelined) {
+                wake_converters();
+              }
+              return;
+            }
           }
         }
       }
     }
+
+    write_mcus(d, 0, row, col, 0, num_mcus);
+
+    // Once in MRAM, the MCUs can be converted by the pipelined kernel
+    if (pipelined) {
+      jpegInfoDpu.decoded_mcu[d->tasklet_id] = mcu;
+      wake_converters();
+    }
+  }
+}
+
+static uint32_t total_mcus(JpegInfo *info) {
+  return (info->mcu_width_real / info->max_h_samp_factor) *
+         (info->mcu_height_real / info->max_v_samp_factor);
+}
+
+/**
+ * Let the pipelined kernel know which MCUs this tasklet decodes, none of them decoded yet
+ * Every step leaves the range at least as wide and the progress no further than they are, so tasklets that look at it
+ * meanwhile never take an MCU for decoded before it is
+ */
+static void publish_decode_range(JpegDecompressor *d, uint32_t first_mcu, uint32_t end_mcu) {
+  jpegInfoDpu.decoded_mcu[d->tasklet_id] = first_mcu;
+  jpegInfoDpu.decode_first[d->tasklet_id] = first_mcu;
+  jpegInfoDpu.decode_end[d->tasklet_id] = end_mcu;
+  wake_converters();
+}
+
+/**
+ * Decode the restart intervals that start in the shares of the bitstream of tasklets [first_share, end_share)
+ * Every interval begins byte aligned with reset DC predictors, so MCUs are decoded exactly once and written straight
+ * to their final position. Requires index_restart_markers to have run on all tasklets
+ */
+static void decode_restart_shares(JpegDecompressor *d, int first_share, int end_share, int pipelined) {
+  JpegInfo *info = d->info;
+  // Tasklet 0 also owns the first interval, which is not preceded by a marker
+  uint32_t first_interval = 0;
+  for (int i = 0; i < first_share; i++) {
+    first_interval += jpegInfoDpu.num_restarts[i];
+  }
+  uint32_t end_interval = first_interval + 1;
+  for (int i = first_share; i < end_share; i++) {
+    end_interval += jpegInfoDpu.num_restarts[i];
+  }
+  if (first_share == 0) {
+    seek_file_index(d, info->image_data_start);
+  } else {
+    // The intervals start at the first marker found in any of the shares
+    int share = first_share;
+    while (share < end_share - 1 && jpegInfoDpu.num_restarts[share] == 0) {
+      share++;
+    }
+    seek_file_index(d, jpegInfoDpu.restart_offset[share]);
+    first_interval++;
+  }
+  d->length = info->length;
+
+  uint32_t end_mcu = end_interval * info->restart_interval;
+  if (end_mcu > total_mcus(info)) {
+    end_mcu = total_mcus(info);
+  }
+  uint32_t first_mcu = first_interval * info->restart_interval;
+  if (first_mcu > end_mcu) {
+    first_mcu = end_mcu;
+  }
+  if (pipelined) {
+    publish_decode_range(d, first_mcu, end_mcu);
+  }
+
+  short previous_dcs[3] = {0};
+  decode_mcu_range(d, first_mcu, end_mcu, previous_dcs, pipelined);
+}
+
+void decode_restart_intervals(JpegDecompressor *d) {
+  decode_restart_shares(d, d->tasklet_id, d->tasklet_id + 1, 0);
+}
+
+/**
+ * Decode the MCUs between the split points [first_split, end_split) found by the host and the split after them
+ * Like restart intervals, every MCU is decoded exactly once and no synchronisation is needed
+ */
+static void decode_host_splits(JpegDecompressor *d, int first_split, int end_split, int pipelined) {
+  JpegInfo *info = d->info;
+  uint32_t end_mcu = end_split == NR_TASKLETS ? total_mcus(info) : host_splits[end_split].mcu;
+  if (pipelined) {
+    publish_decode_range(d, host_splits[first_split].mcu < end_mcu ? host_splits[first_split].mcu : end_mcu, end_mcu);
+  }
+
+  for (int i = first_split; i < end_split; i++) {
+    dpu_split_t *split = &host_splits[i];
+    uint32_t split_end = i == NR_TASKLETS - 1 ? total_mcus(info) : host_splits[i + 1].mcu;
+    if (split->mcu >= split_end) {
+      continue;
+    }
+
+    seek_file_index(d, info->file_start + split->offset);
+    d->length = info->length;
+    fill_bit_buffer(d);
+    consume_bits(d, split->consumed_bits);
+
+    short previous_dcs[3] = {split->dc[0], split->dc[1], split->dc[2]};
+    decode_mcu_range(d, split->mcu, split_end, previous_dcs, pipelined);
+    if (!info->valid) {
+      return;
+    }
   }
 }
 
+void decode_host_split(JpegDecompressor *d) {
+  decode_host_splits(d, d->tasklet_id, d->tasklet_id + 1, 0);
+}
+
 static void synchronise_tasklets(JpegDecompressor *d, int row, int col, short *previous_dcs) {
+  JpegInfo *info = d->info;
   // Tasklet i has to overflow to MCUs decoded by Tasklet i + 1 for synchronisation
   // The last tasklet cannot overflow, so it returns first
-  int current_mcu_index = (row * jpegInfo.mcu_width_real + col) * 192;
-  if (current_mcu_index > 16776960 / NR_TASKLETS) {
+  int current_mcu_index = position_index(info, row * info->mcu_width_real + col);
+  if (current_mcu_index > info->tasklet_buffer_size) {
     printf("Warning: Tasklet %d exceeded buffer size limit, output image is most likely malformed\n", d->tasklet_id);
   }
 
@@ -81,36 +562,37 @@ static void synchronise_tasklets(JpegDecompressor *d, int row, int col, short *p
   // the file offset between the 2 tasklets
   int next_tasklet_mcu_blocks_elapsed = 0;
   int num_synched_mcu_blocks = 0;
-  int minimum_synched_mcu_blocks = jpegInfo.max_h_samp_factor * jpegInfo.max_v_samp_factor + 2;
+  int minimum_synched_mcu_blocks = info->max_h_samp_factor * info->max_v_samp_factor + 2;
 
-  for (; row < jpegInfo.mcu_height; row += jpegInfo.max_v_samp_factor) {
-    for (; col < jpegInfo.mcu_width; col += jpegInfo.max_h_samp_factor) {
+  for (; row < info->mcu_height; row += info->max_v_samp_factor) {
+    for (; col < info->mcu_width; col += info->max_h_samp_factor) {
       if (num_synched_mcu_blocks >= minimum_synched_mcu_blocks + 1) {
-        jpegInfoDpu.mcu_end_index[d->tasklet_id] = (row * jpegInfo.mcu_width_real + col) * 192;
+        jpegInfoDpu.mcu_end_index[d->tasklet_id] = position_index(info, row * info->mcu_width_real + col);
         int blocks_elapsed =
-            (next_tasklet_mcu_blocks_elapsed / minimum_synched_mcu_blocks) * jpegInfo.max_h_samp_factor;
-        jpegInfoDpu.mcu_start_index[d->tasklet_id + 1] = blocks_elapsed * 192;
-        // goto sync1;
-        concat_adjust_mcus(d, row, col);
+            (next_tasklet_mcu_blocks_elapsed / minimum_synched_mcu_blocks) * info->max_h_samp_factor;
+        jpegInfoDpu.mcu_start_index[d->tasklet_id + 1] = position_index(info, blocks_elapsed);
         return;
       }
 
-      for (int color_index = 0; color_index < jpegInfo.num_color_components; color_index++) {
-        for (int y = 0; y < jpegInfo.color_components[color_index].v_samp_factor; y++) {
-          for (int x = 0; x < jpegInfo.color_components[color_index].h_samp_factor; x++) {
-            if (decode_mcu(d, color_index, &previous_dcs[color_index]) != 0) {
-              jpegInfo.valid = 0;
+      for (int color_index = 0; color_index < info->num_color_components; color_index++) {
+        for (int y = 0; y < info->color_components[color_index].v_samp_factor; y++) {
+          for (int x = 0; x < info->color_components[color_index].h_samp_factor; x++) {
+            int cache_index = decode_cache_index(info, 0, y, x, color_index);
+            if (decode_mcu(d, color_index, cache_index, &previous_dcs[color_index]) != 0) {
+              info->valid = 0;
               printf("Error: Invalid MCU\n");
               return;
             }
 
-            short current_tasklet_file_index = d->file_index + d->cache_index;
+            if (next_tasklet_mcu_blocks_elapsed >= SYNCH_ENTRIES) {
+              // Ran past the blocks recorded by tasklet i + 1, keep decoding up to the end of the image on our own
+              continue;
+            }
+
+            short current_tasklet_file_index = bitstream_index(d);
             short next_tasklet_file_index =
                 MCU_buffer_cache[d->tasklet_id + 1][INDEX_OFFSET + next_tasklet_mcu_blocks_elapsed];
 
-            int mcu_index = (((row + y) * jpegInfo.mcu_width_real + (col + x)) * 3 + color_index) << 6;
-            mram_write(MCU_buffer_cache[d->tasklet_id], &MCU_buffer[d->tasklet_id][mcu_index], MCU_READ_WRITE_SIZE0);
-
             if (current_tasklet_file_index < next_tasklet_file_index) {
               // Tasklet i needs to decode more blocks
               num_synched_mcu_blocks = 0;
@@ -119,7 +601,8 @@ static void synchronise_tasklets(JpegDecompressor *d, int row, int col, short *p
               num_synched_mcu_blocks = 0;
               next_tasklet_mcu_blocks_elapsed++;
 
-              while (current_tasklet_file_index > next_tasklet_file_index) {
+              while (current_tasklet_file_index > next_tasklet_file_index &&
+                     next_tasklet_mcu_blocks_elapsed < SYNCH_ENTRIES) {
                 next_tasklet_file_index =
                     MCU_buffer_cache[d->tasklet_id + 1][INDEX_OFFSET + next_tasklet_mcu_blocks_elapsed];
                 next_tasklet_mcu_blocks_elapsed++;
@@ -127,13 +610,13 @@ static void synchronise_tasklets(JpegDecompressor *d, int row, int col, short *p
 
               if (current_tasklet_file_index == next_tasklet_file_index) {
                 jpegInfoDpu.dc_offset[d->tasklet_id][color_index] =
-                    MCU_buffer_cache[d->tasklet_id][0] -
+                    MCU_buffer_cache[d->tasklet_id][cache_index] -
                     MCU_buffer_cache[d->tasklet_id + 1][DC_COEFF_OFFSET + next_tasklet_mcu_blocks_elapsed];
                 num_synched_mcu_blocks++;
               }
             } else {
               jpegInfoDpu.dc_offset[d->tasklet_id][color_index] =
-                  MCU_buffer_cache[d->tasklet_id][0] -
+                  MCU_buffer_cache[d->tasklet_id][cache_index] -
                   MCU_buffer_cache[d->tasklet_id + 1][DC_COEFF_OFFSET + next_tasklet_mcu_blocks_elapsed];
 
               num_synched_mcu_blocks++;
@@ -142,73 +625,152 @@ static void synchronise_tasklets(JpegDecompressor *d, int row, int col, short *p
           }
         }
       }
+
+      write_mcus(d, d->tasklet_id, row, col, 0, 1);
     }
     col = 0;
   }
 }
 
-static void concat_adjust_mcus(JpegDecompressor *d, int row, int col) {
-  // Tasklet 0 does a one pass through all MCUs to adjust DC coefficients
-  if (d->tasklet_id != 0) {
-    return;
-  }
+// Number of MCUs (in units of max_h_samp_factor x max_v_samp_factor blocks) before the block at mcu_index
+static uint32_t mcu_number(JpegInfo *info, uint32_t mcu_index) {
+  uint32_t mcus_per_row = info->mcu_width_real / info->max_h_samp_factor;
+  uint32_t position = mcu_index / position_index(info, 1);
+  uint32_t row = position / info->mcu_width_real;
+  uint32_t col = position % info->mcu_width_real;
+  return (row / info->max_v_samp_factor) * mcus_per_row + col / info->max_h_samp_factor;
+}
 
-	uint32_t start_dc_adj = perfcounter_get();
-  int tasklet_index = 1;
-  int start_index = jpegInfoDpu.mcu_start_index[tasklet_index] / 192;
-  int tasklet_row = start_index / jpegInfo.mcu_width_real;
-  int tasklet_col = start_index % jpegInfo.mcu_width_real;
-  int dc_offset[3] = {jpegInfoDpu.dc_offset[0][0], jpegInfoDpu.dc_offset[0][1], jpegInfoDpu.dc_offset[0][2]};
+// First and last short touched in a tasklet's MCU buffer by MCUs [first, end)
+static void mcu_span(JpegInfo *info, uint32_t tasklet, uint32_t first, uint32_t end, uint32_t *low, uint32_t *high) {
+  uint32_t mcus_per_row = info->mcu_width_real / info->max_h_samp_factor;
+  uint32_t tasklet_base = tasklet * info->tasklet_buffer_size;
+  *low = tasklet_base + position_index(info, (first / mcus_per_row) * info->max_v_samp_factor * info->mcu_width_real);
+  *high = tasklet_base +
+          position_index(info, ((end - 1) / mcus_per_row + 1) * info->max_v_samp_factor * info->mcu_width_real);
+}
 
-  for (; row < jpegInfo.mcu_height; row += jpegInfo.max_v_samp_factor) {
-    for (; col < jpegInfo.mcu_width; col += jpegInfo.max_h_samp_factor, tasklet_col += jpegInfo.max_h_samp_factor) {
-      if (tasklet_col >= jpegInfo.mcu_width) {
-        tasklet_col = 0;
-        tasklet_row += jpegInfo.max_v_samp_factor;
-      }
-      if ((tasklet_row * jpegInfo.mcu_width_real + tasklet_col) * 192 >= jpegInfoDpu.mcu_end_index[tasklet_index]) {
-        tasklet_index++;
-        start_index = jpegInfoDpu.mcu_start_index[tasklet_index] / 192;
-        tasklet_row = start_index / jpegInfo.mcu_width_real;
-        tasklet_col = start_index % jpegInfo.mcu_width_real;
-        dc_offset[0] += jpegInfoDpu.dc_offset[tasklet_index - 1][0];
-        dc_offset[1] += jpegInfoDpu.dc_offset[tasklet_index - 1][1];
-        dc_offset[2] += jpegInfoDpu.dc_offset[tasklet_index - 1][2];
+/**
+ * Copy the synchronised MCUs of tasklet_index into place in MCU_buffer[0], adjusting their DC coefficients
+ * by the accumulated offset of all previous tasklets
+ */
+static void adjust_segment(JpegDecompressor *d, int tasklet_index, uint32_t first, uint32_t end, uint32_t dest,
+                           int *dc_offset) {
+  JpegInfo *info = d->info;
+  uint32_t mcus_per_row = info->mcu_width_real / info->max_h_samp_factor;
+
+  for (uint32_t mcu = first; mcu < end; mcu++, dest++) {
+    int tasklet_row = (mcu / mcus_per_row) * info->max_v_samp_factor;
+    int tasklet_col = (mcu % mcus_per_row) * info->max_h_samp_factor;
+    int row = (dest / mcus_per_row) * info->max_v_samp_factor;
+    int col = (dest % mcus_per_row) * info->max_h_samp_factor;
+
+    read_mcus(d, tasklet_index, tasklet_row, tasklet_col, 0, 1);
+    for (int color_index = 0; color_index < info->num_planes; color_index++) {
+      for (int y = 0; y < info->color_components[color_index].v_samp_factor; y++) {
+        for (int x = 0; x < info->color_components[color_index].h_samp_factor; x++) {
+          MCU_buffer_cache[d->tasklet_id][block_cache_index(info, 0, y, x, color_index)] += dc_offset[color_index];
+        }
       }
+    }
+    write_mcus(d, 0, row, col, 0, 1);
+  }
+}
 
-      for (int color_index = 0; color_index < jpegInfo.num_color_components; color_index++) {
-        for (int y = 0; y < jpegInfo.color_components[color_index].v_samp_factor; y++) {
-          for (int x = 0; x < jpegInfo.color_components[color_index].h_samp_factor; x++) {
-            int mcu_index = (((tasklet_row + y) * jpegInfo.mcu_width_real + (tasklet_col + x)) * 3 + color_index) << 6;
-            mram_read(&MCU_buffer[tasklet_index][mcu_index], MCU_buffer_cache[0], MCU_READ_WRITE_SIZE0);
+/**
+ * Work out where the segment decoded by each tasklet belongs in the image and how to fix its DC coefficients
+ * inverse_dct_convert then reads every segment straight from the tasklet's MCU buffer. When the image is so large that
+ * the converted image would be written over a segment before it is read, tasklet 0 copies the segments into place in
+ * MCU_buffer[0] one after the other instead
+ * Requires every tasklet to have finished synchronise_tasklets
+ */
+void concat_adjust_mcus(JpegDecompressor *d) {
+  JpegInfo *info = d->info;
+  if (d->tasklet_id != 0) {
+    return;
+  }
 
-            MCU_buffer_cache[0][0] += dc_offset[color_index];
+#ifdef STATISTICS
+  uint32_t start_dc_adj = perfcounter_get();
+#endif // STATISTICS
 
-            mcu_index = (((row + y) * jpegInfo.mcu_width_real + (col + x)) * 3 + color_index) << 6;
-            mram_write(MCU_buffer_cache[0], &MCU_buffer[0][mcu_index], MCU_READ_WRITE_SIZE0);
-          }
-        }
+  uint32_t total_mcus = (info->mcu_width_real / info->max_h_samp_factor) *
+                        (info->mcu_height_real / info->max_v_samp_factor);
+  uint32_t first[NR_TASKLETS];
+  uint32_t end[NR_TASKLETS];
+  uint32_t dest[NR_TASKLETS];
+
+  // Tasklet 0 decoded the start of the image in place, every other segment follows on from the previous one
+  // mcu_start_index is the number of MCUs skipped by the next tasklet, times max_h_samp_factor blocks
+  first[0] = 0;
+  end[0] = mcu_number(info, jpegInfoDpu.mcu_end_index[0]);
+  dest[0] = 0;
+  int overlap = 0;
+  for (int i = 1; i < NR_TASKLETS; i++) {
+    first[i] = jpegInfoDpu.mcu_start_index[i] / position_index(info, 1) / info->max_h_samp_factor;
+    end[i] = mcu_number(info, jpegInfoDpu.mcu_end_index[i]);
+    dest[i] = dest[i - 1] + end[i - 1] - first[i - 1];
+    if (dest[i] >= total_mcus || end[i] <= first[i]) {
+      end[i] = first[i];
+      continue;
+    }
+    if (dest[i] + end[i] - first[i] > total_mcus) {
+      end[i] = first[i] + total_mcus - dest[i];
+    }
+
+    uint32_t dest_low, dest_high;
+    mcu_span(info, 0, dest[i], dest[i] + end[i] - first[i], &dest_low, &dest_high);
+    for (int j = 1; j <= i; j++) {
+      uint32_t low, high;
+      if (end[j] > first[j]) {
+        mcu_span(info, j, first[j], end[j], &low, &high);
+        overlap |= dest_low < high && low < dest_high;
       }
     }
-    col = 0;
   }
+
+  int dc_offset[3] = {0, 0, 0};
+  for (int i = 1; i < NR_TASKLETS; i++) {
+    dc_offset[0] += jpegInfoDpu.dc_offset[i - 1][0];
+    dc_offset[1] += jpegInfoDpu.dc_offset[i - 1][1];
+    dc_offset[2] += jpegInfoDpu.dc_offset[i - 1][2];
+
+    if (overlap) {
+      adjust_segment(d, i, first[i], end[i], dest[i], dc_offset);
+    } else {
+      // Empty segments still get their place, so that convert_mcu_rows walks past them to the segments after them
+      jpegInfoDpu.segment_first[i] = first[i];
+      jpegInfoDpu.segment_dest[i] = dest[i];
+      jpegInfoDpu.segment_dc_offset[i][0] = dc_offset[0];
+      jpegInfoDpu.segment_dc_offset[i][1] = dc_offset[1];
+      jpegInfoDpu.segment_dc_offset[i][2] = dc_offset[2];
+    }
+  }
+
 #ifdef STATISTICS
-	output.cycles_dc_adj = perfcounter_get() - start_dc_adj;
+  file_record(info)->cycles_dc_adj = perfcounter_get() - start_dc_adj;
 #endif // STATISTICS
 }
 
-static int decode_mcu(JpegDecompressor *d, int component_index, short *previous_dc) {
-  QuantizationTable *q_table = &jpegInfo.quant_tables[jpegInfo.color_components[component_index].quant_table_id];
-  HuffmanTable *dc_table = &jpegInfo.dc_huffman_tables[jpegInfo.color_components[component_index].dc_huffman_table_id];
-  HuffmanTable *ac_table = &jpegInfo.ac_huffman_tables[jpegInfo.color_components[component_index].ac_huffman_table_id];
+static int decode_mcu(JpegDecompressor *d, int component_index, int cache_index, short *previous_dc) {
+  JpegInfo *info = d->info;
+  ColorComponentInfo *component = &info->color_components[component_index];
+  QuantizationTable *q_table = &quant_tables[info->quant_table_index[component->quant_table_id]];
+  HuffmanTable *dc_table = &huffman_tables[info->huffman_table_index[0][component->dc_huffman_table_id]];
+  HuffmanTable *ac_table = &huffman_tables[info->huffman_table_index[1][component->ac_huffman_table_id]];
+  short *block = &MCU_buffer_cache[d->tasklet_id][cache_index];
+  int positions = 0;
 
 #ifdef STATISTICS
 // add mutex
-	output.mcu_decode_tries++;
+	file_record(info)->mcu_decode_tries++;
 	uint32_t start = perfcounter_get();
 #endif // STATISTICS
 
   // Get DC value for this MCU block
+  if (d->bits_left < MAX_SYMBOL_BITS) {
+    fill_bit_buffer(d);
+  }
   uint8_t dc_length = huff_decode(d, dc_table);
   if (dc_length == (uint8_t) -1) {
     printf("Error: Invalid DC code\n");
@@ -219,24 +781,23 @@ static int decode_mcu(JpegDecompressor *d, int component_index, short *previous_
     return -1;
   }
 
-  int coeff = get_num_bits(d, dc_length);
-  if (dc_length != 0 && coeff < (1 << (dc_length - 1))) {
-    // Convert to negative coefficient
-    coeff -= (1 << dc_length) - 1;
-  }
-  MCU_buffer_cache[d->tasklet_id][0] = coeff + *previous_dc;
-  *previous_dc = MCU_buffer_cache[d->tasklet_id][0];
+  int coeff = receive_extend(d, dc_length);
+  block[0] = coeff + *previous_dc;
+  *previous_dc = block[0];
 #ifdef STATISTICS
 	uint32_t decode = perfcounter_get();
-	output.cycles_mcu_decode += decode - start;
+	file_record(info)->cycles_mcu_decode += decode - start;
 #endif // STATISTICS
 
   // Dequantization
-  MCU_buffer_cache[d->tasklet_id][0] *= q_table->table[0];
+  block[0] *= q_table->table[0];
 
   // Get the AC values for this MCU block
   int i = 1;
   while (i < 64) {
+    if (d->bits_left < MAX_SYMBOL_BITS) {
+      fill_bit_buffer(d);
+    }
     uint8_t ac_length = huff_decode(d, ac_table);
     if (ac_length == (uint8_t) -1) {
       printf("Error: Invalid AC code\n");
@@ -246,7 +807,7 @@ static int decode_mcu(JpegDecompressor *d, int component_index, short *previous_
     // Got 0x00, fill remaining MCU block with 0s
     if (ac_length == 0x00) {
       while (i < 64) {
-        MCU_buffer_cache[d->tasklet_id][ZIGZAG_ORDER[i++]] = 0;
+        block[ZIGZAG_ORDER[i++]] = 0;
       }
       break;
     }
@@ -266,7 +827,7 @@ static int decode_mcu(JpegDecompressor *d, int component_index, short *previous_
       return -1;
     }
     for (int j = 0; j < num_zeroes; j++) {
-      MCU_buffer_cache[d->tasklet_id][ZIGZAG_ORDER[i++]] = 0;
+      block[ZIGZAG_ORDER[i++]] = 0;
     }
 
     if (coeff_length > 10) {
@@ -274,49 +835,83 @@ static int decode_mcu(JpegDecompressor *d, int component_index, short *previous_
       return -1;
     }
     if (coeff_length != 0) {
-      coeff = get_num_bits(d, coeff_length);
-      if (coeff < (1 << (coeff_length - 1))) {
-        // Convert to negative coefficient
-        coeff -= (1 << coeff_length) - 1;
+      coeff = receive_extend(d, coeff_length);
+      // Write coefficient to buffer as well as perform dequantization, along with the ANN scale of its row
+      if (q_table->scale_rows) {
+        int64_t value = coeff * q_table->table[ZIGZAG_ORDER[i]];
+        block[ZIGZAG_ORDER[i]] = (value * AAN_ROW_SCALE[ZIGZAG_ORDER[i] >> 3]) >> AAN_ROW_SCALE_BITS;
+      } else {
+        block[ZIGZAG_ORDER[i]] = (coeff * q_table->table[ZIGZAG_ORDER[i]]) >> q_table->shift;
       }
-      // Write coefficient to buffer as well as perform dequantization
-      MCU_buffer_cache[d->tasklet_id][ZIGZAG_ORDER[i]] = coeff * q_table->table[ZIGZAG_ORDER[i]];
+      positions |= ZIGZAG_ORDER[i];
       i++;
     }
   }
 
+  // A coefficient lies outside the top left 4x4 when its row or its column is 4 or more, bit 5 or bit 2 of its index
+  extent_cache[d->tasklet_id][cache_index >> 6] =
+      positions == 0 ? EXTENT_DC : (positions & ((4 << 3) | 4)) != 0 ? EXTENT_FULL : EXTENT_LOW;
+
 #ifdef STATISTICS
-	output.cycles_mcu_dequant += perfcounter_get() - decode;
+	file_record(info)->cycles_mcu_dequant += perfcounter_get() - decode;
 #endif // STATISTICS
 
   return 0;
 }
 
+// The caller must make sure that the bit buffer holds at least 16 bits
 static uint8_t huff_decode(JpegDecompressor *d, HuffmanTable *h_table) {
-  uint32_t code = 0;
-
-  for (int i = 0; i < 16; i++) {
-    int bit = get_num_bits(d, 1);
-    code = (code << 1) | bit;
-    for (int j = h_table->valoffset[i]; j < h_table->valoffset[i + 1]; j++) {
-      if (code == h_table->codes[j]) {
-        return h_table->huffval[j];
-      }
+  // Fast path: peek HUFF_LOOKAHEAD bits and resolve short codes with one lookup
+  uint16_t entry = h_table->lookup[peek_bits(d, HUFF_LOOKAHEAD)];
+  if (entry != 0) {
+    consume_bits(d, entry >> 8);
+    return entry & 0xFF;
+  }
+
+  // Slow path: walk the canonical code lengths beyond the lookahead window
+  int length = HUFF_LOOKAHEAD + 1;
+  uint32_t code = peek_bits(d, length);
+  while (code >= h_table->code_end[length]) {
+    if (length == 16) {
+      // No valid code, skip the 16 bits searched like a bit-by-bit decoder would
+      consume_bits(d, 16);
+      return -1;
     }
+    length++;
+    code = peek_bits(d, length);
   }
 
-  return -1;
+  consume_bits(d, length);
+  return h_table->huffval[(uint16_t) (h_table->valptr[length] + code)];
 }
 
-static int get_num_bits(JpegDecompressor *d, int num_bits) {
-  int bits = 0;
-  if (num_bits == 0) {
-    return bits;
+static void fill_bit_buffer(JpegDecompressor *d) {
+  int num_bytes = (64 - d->bits_left) >> 3;
+  if (num_bytes == 0) {
+    return;
   }
 
+  // Fast path: take every byte that fits into the buffer straight from the prefetch cache, unless one of them
+  // needs unstuffing
+  uint8_t *bytes = peek_cached_bytes(d, num_bytes);
+  if (bytes != NULL) {
+    uint64_t word = 0;
+    for (int i = 0; i < num_bytes; i++) {
+      word = (word << 8) | bytes[i];
+    }
+
+    if (!HAS_FF_BYTE(word)) {
+      d->bit_buffer |= word << (64 - (num_bytes << 3) - d->bits_left);
+      d->bits_left += num_bytes << 3;
+      d->cache_index += num_bytes;
+      return;
+    }
+  }
+
+  // Slow path: 0xFF in the refill window (stuffed byte or marker), or the prefetch cache needs reloading
   uint8_t temp_byte;
-  uint32_t actual_byte;
-  while (d->bits_left < num_bits) {
+  uint64_t actual_byte;
+  while (d->bits_left <= 64 - 8) {
     // Read a byte and decode it, if it is 0xFF
     temp_byte = read_byte(d);
     actual_byte = temp_byte;
@@ -337,258 +932,613 @@ static int get_num_bits(JpegDecompressor *d, int num_bits) {
     }
 
     // Add the new bits to the buffer (MSB aligned)
-    d->bit_buffer |= actual_byte << (32 - 8 - d->bits_left);
+    d->bit_buffer |= actual_byte << (64 - 8 - d->bits_left);
     d->bits_left += 8;
   }
+}
 
-  bits = d->bit_buffer >> (32 - num_bits);
-  d->bit_buffer <<= num_bits;
-  d->bits_left -= num_bits;
-  return bits;
+// File index of the next unconsumed bit. Whole bytes that were only read ahead into the bit buffer are not counted,
+// so that tasklets at the same position in the bitstream compare equal during synchronisation
+static int bitstream_index(JpegDecompressor *d) {
+  return d->file_index + d->cache_index - (d->bits_left >> 3);
 }
 
-void inverse_dct_convert(JpegDecompressor *d) {
-  int row = jpegInfoDpu.rows_per_tasklet * d->tasklet_id;
-  int end_row = jpegInfoDpu.rows_per_tasklet * (d->tasklet_id + 1);
-  if (row % 2 != 0) {
-    row++;
-  }
-  if (end_row % 2 != 0) {
-    end_row++;
+// Read a coefficient of num_bits from the bit buffer and convert it to a signed value
+static int receive_extend(JpegDecompressor *d, int num_bits) {
+  if (num_bits == 0) {
+    return 0;
   }
-  if (d->tasklet_id == NR_TASKLETS - 1) {
-    end_row = jpegInfo.mcu_height;
+
+  int coeff = peek_bits(d, num_bits);
+  consume_bits(d, num_bits);
+  if (coeff < (1 << (num_bits - 1))) {
+    // Convert to negative coefficient
+    coeff -= (1 << num_bits) - 1;
   }
+  return coeff;
+}
 
-  for (; row < end_row; row += jpegInfo.max_v_samp_factor) {
-    for (int col = 0; col < jpegInfo.mcu_width; col += jpegInfo.max_h_samp_factor) {
-      for (int color_index = 0; color_index < jpegInfo.num_color_components; color_index++) {
-        for (int y = 0; y < jpegInfo.color_components[color_index].v_samp_factor; y++) {
-          for (int x = 0; x < jpegInfo.color_components[color_index].h_samp_factor; x++) {
-            int mcu_index = (((row + y) * jpegInfo.mcu_width_real + (col + x)) * 3 + color_index) << 6;
-            int cache_index = ((y << 8) + (y << 7)) + ((x << 7) + (x << 6)) + (color_index << 6);
-            mram_read(&MCU_buffer[0][mcu_index], &MCU_buffer_cache[d->tasklet_id][cache_index], MCU_READ_WRITE_SIZE0);
+/**
+ * Inverse DCT and colour conversion of the MCU rows [row, end_row)
+ * With in_place set, the coefficients were decoded straight to their final position, otherwise they are read from the
+ * segments found by concat_adjust_mcus
+ */
+static void convert_mcu_rows(JpegDecompressor *d, int row, int end_row, int in_place) {
+  JpegInfo *info = d->info;
+  int max_h = info->max_h_samp_factor;
+  int max_v = info->max_v_samp_factor;
+  uint32_t mcus_per_row = info->mcu_width_real / max_h;
+  int mcus_in_row = (info->mcu_width + max_h - 1) / max_h;
+  int batch = mcus_per_batch(info);
+  int merged = merged_upsample(info);
+  int segment = 0;
+  int segments[CACHE_POSITIONS];
+
+  for (; row < end_row; row += max_v) {
+    for (int m = 0; m < mcus_in_row; m += batch) {
+      int col = m * max_h;
+      int num_mcus = mcus_in_row - m < batch ? mcus_in_row - m : batch;
+
+      // Read the coefficients from wherever the tasklet that decoded them left them, one DMA per block row for every
+      // run of MCUs that are also consecutive there
+      uint32_t first_mcu = (row / max_v) * mcus_per_row + m;
+      int run = 0;
+      int run_row = 0;
+      int run_col = 0;
+      for (int i = 0; i < num_mcus; i++) {
+        uint32_t mcu = first_mcu + i;
+        uint32_t source = mcu;
+        if (!in_place) {
+          while (segment + 1 < NR_TASKLETS && jpegInfoDpu.segment_dest[segment + 1] <= mcu) {
+            segment++;
+          }
+          source = jpegInfoDpu.segment_first[segment] + mcu - jpegInfoDpu.segment_dest[segment];
+        }
+        int source_row = (source / mcus_per_row) * max_v;
+        int source_col = (source % mcus_per_row) * max_h;
+
+        if (run != 0 && (segment != segments[i - 1] || source_row != run_row || source_col != run_col + run * max_h)) {
+          read_mcus(d, segments[i - 1], run_row, run_col, position_index(info, (i - run) * max_h), run);
+          run = 0;
+        }
+        if (run == 0) {
+          run_row = source_row;
+          run_col = source_col;
+        }
+        run++;
+        segments[i] = segment;
+      }
+      read_mcus(d, segments[num_mcus - 1], run_row, run_col, position_index(info, (num_mcus - run) * max_h), run);
+
+      for (int i = 0; i < num_mcus; i++) {
+        int mcu_cache_index = position_index(info, i * max_h);
+        for (int color_index = 0; color_index < info->num_planes; color_index++) {
+          for (int y = 0; y < info->color_components[color_index].v_samp_factor; y++) {
+            for (int x = 0; x < info->color_components[color_index].h_samp_factor; x++) {
+              int cache_index = block_cache_index(info, mcu_cache_index, y, x, color_index);
+              if (!in_place) {
+                MCU_buffer_cache[d->tasklet_id][cache_index] += jpegInfoDpu.segment_dc_offset[segments[i]][color_index];
+              }
 
 #ifdef STATISTICS
-				uint32_t start_idct = perfcounter_get();
+					uint32_t start_idct = perfcounter_get();
 #endif // STATISTICS
 
-            // Compute inverse DCT with ANN algorithm
-            inverse_dct_component(d, cache_index);
+              inverse_dct_block(d, cache_index);
 
 #ifdef STATISTICS
-				output.cycles_idct += perfcounter_get() - start_idct;
+					file_record(info)->cycles_idct += perfcounter_get() - start_idct;
 #endif // STATISTICS
+            }
           }
         }
-      }
-
-      // Convert from YCbCr to RGB
-      for (int y = jpegInfo.max_v_samp_factor - 1; y >= 0; y--) {
-        for (int x = jpegInfo.max_h_samp_factor - 1; x >= 0; x--) {
-          // MCU to index is (current row + vertical sampling) * total number of MCUs in a row of the JPEG
-          // + (current col + horizontal sampling)
-          int mcu_index = (((row + y) * jpegInfo.mcu_width_real + (col + x)) * 3) << 6;
-          int cache_index = ((y << 8) + (y << 7)) + ((x << 7) + (x << 6));
 
 #ifdef STATISTICS
 				uint32_t start_cc = perfcounter_get();
 #endif // STATISTICS
 
-          ycbcr_to_rgb_pixel(d, cache_index, y, x);
+        // Convert from YCbCr to RGB, or only level shift the luma of a single plane image
+        if (merged && max_v == 2) {
+          ycbcr_to_rgb_h2v2(d, mcu_cache_index);
+        } else if (merged) {
+          ycbcr_to_rgb_h2v1(d, mcu_cache_index);
+        } else {
+          for (int y = max_v - 1; y >= 0; y--) {
+            for (int x = max_h - 1; x >= 0; x--) {
+              if (info->num_planes == 1) {
+                luma_to_gray_pixel(d, block_cache_index(info, mcu_cache_index, y, x, 0));
+              } else {
+                ycbcr_to_rgb_pixel(d, mcu_cache_index, block_cache_index(info, mcu_cache_index, y, x, 0), y, x);
+              }
+            }
+          }
+        }
 
 #ifdef STATISTICS
-				output.cycles_cc += perfcounter_get() - start_cc;
+				file_record(info)->cycles_cc += perfcounter_get() - start_cc;
 #endif //STATISTICS
+      }
 
-          mram_write(&MCU_buffer_cache[d->tasklet_id][cache_index], &MCU_buffer[0][mcu_index], MCU_READ_WRITE_SIZE1);
-        }
+      if (input.flags & (1 << OPTION_FLAG_RASTER_OUTPUT)) {
+        write_image_rows(d, row, col, num_mcus);
+      } else {
+        write_image_mcus(d, row, col, num_mcus);
       }
     }
   }
 }
 
+MUTEX_INIT(row_lock);
+
+/**
+ * Claim the next group of max_v_samp_factor MCU rows for this tasklet to convert and return its first row, which is
+ * past the end of the image once every row has been claimed
+ * Tasklets that are done early keep claiming rows, so an image whose height does not divide evenly between them is
+ * not left to one of them
+ */
+static int claim_rows(JpegInfo *info) {
+  mutex_lock(row_lock);
+  int row = jpegInfoDpu.next_row;
+  jpegInfoDpu.next_row += info->max_v_samp_factor;
+  mutex_unlock(row_lock);
+  return row;
+}
+
+void inverse_dct_convert(JpegDecompressor *d) {
+  JpegInfo *info = d->info;
+  int max_v = info->max_v_samp_factor;
+
+  for (int row = claim_rows(info); row < info->mcu_height; row = claim_rows(info)) {
+    convert_mcu_rows(d, row, row + max_v, 0);
+  }
+}
+
+// Whether every MCU in [first_mcu, end_mcu) has been decoded by the tasklets that decode for the pipelined kernel
+static int mcus_decoded(uint32_t first_mcu, uint32_t end_mcu) {
+  for (int i = 0; i < PIPELINE_DECODE_TASKLETS; i++) {
+    uint32_t end = jpegInfoDpu.decode_end[i] < end_mcu ? jpegInfoDpu.decode_end[i] : end_mcu;
+    if (jpegInfoDpu.decode_first[i] < end && first_mcu < end && jpegInfoDpu.decoded_mcu[i] < end) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// info->valid as last cleared by any tasklet, read again on every call while waiting on the others
+static inline int still_valid(JpegInfo *info) {
+  return ((volatile JpegInfo *) info)->valid;
+}
+
+// Sleep until every MCU in [first_mcu, end_mcu) is decoded, or until the image is found to be invalid
+static void wait_for_mcus(JpegInfo *info, uint32_t first_mcu, uint32_t end_mcu) {
+  mutex_lock(decoded_lock);
+  while (!mcus_decoded(first_mcu, end_mcu) && still_valid(info)) {
+    num_converters_waiting++;
+    mutex_unlock(decoded_lock);
+    sem_take(&mcus_published);
+    mutex_lock(decoded_lock);
+  }
+  mutex_unlock(decoded_lock);
+}
+
+/**
+ * Inverse DCT and colour conversion of the pipelined kernel: claim MCU rows in order and convert each one as soon as
+ * all of its MCUs are decoded, instead of waiting for the whole image behind a barrier
+ */
+static void convert_decoded_rows(JpegDecompressor *d) {
+  JpegInfo *info = d->info;
+  int max_v = info->max_v_samp_factor;
+  uint32_t mcus_per_row = info->mcu_width_real / info->max_h_samp_factor;
+
+  for (int row = claim_rows(info); row < info->mcu_height; row = claim_rows(info)) {
+    uint32_t first_mcu = (row / max_v) * mcus_per_row;
+    wait_for_mcus(info, first_mcu, first_mcu + mcus_per_row);
+    if (!still_valid(info)) {
+      return;
+    }
+    convert_mcu_rows(d, row, row + max_v, 1);
+  }
+}
+
+/**
+ * Pipelined kernel for images whose MCUs are decoded exactly once, with restart intervals or split by the host
+ * The first PIPELINE_DECODE_TASKLETS tasklets entropy decode a contiguous range of MCUs each, the shares of the others
+ * included, and publish how far they got. The other tasklets convert MCU rows as they are completed, joined by the
+ * decoding tasklets once they are done
+ */
+void decode_pipelined(JpegDecompressor *d, int host_split) {
+  if (d->tasklet_id < PIPELINE_DECODE_TASKLETS) {
+    int first_share = d->tasklet_id * NR_TASKLETS / PIPELINE_DECODE_TASKLETS;
+    int end_share = (d->tasklet_id + 1) * NR_TASKLETS / PIPELINE_DECODE_TASKLETS;
+    if (host_split) {
+      decode_host_splits(d, first_share, end_share, 1);
+    } else {
+      decode_restart_shares(d, first_share, end_share, 1);
+    }
+  }
+
+  convert_decoded_rows(d);
+}
+
+/**
+ * Decode, inverse DCT and colour convert a whole file with this tasklet alone
+ * The MCUs are decoded in order, so they go straight to their final position
+ */
+void decode_whole_file(JpegDecompressor *d) {
+  JpegInfo *info = d->info;
+  seek_file_index(d, info->image_data_start);
+  d->length = info->length;
+
+  short previous_dcs[3] = {0};
+  decode_mcu_range(d, 0, total_mcus(info), previous_dcs, 0);
+
+  if (info->valid) {
+    convert_mcu_rows(d, 0, info->mcu_height, 1);
+  }
+}
+
+// Fixed point constants of the reduced inverse DCTs, scaled by 1 << IDCT_CONST_BITS
+#define IDCT_CONST_BITS 13
+#define IDCT_PASS1_BITS 2 // extra precision kept between the two passes
+#define FIX_0_353553391 2896 // cos(pi / 4) / 2
+#define FIX_0_461939766 3784 // cos(pi / 8) / 2
+#define FIX_0_191341716 1567 // cos(3 * pi / 8) / 2
+
+#ifdef IDCT_SHIFT_ADD
+// The DPU only multiplies 8 bit operands in hardware and emulates 32 bit multiplications in software, so the inverse
+// DCT constants are applied as shifts and adds instead. The products are exactly the same
+static inline int mul_25(int x) {
+  return (x << 4) + (x << 3) + x;
+}
+
+static inline int mul_49(int x) {
+  return (x << 5) + (x << 4) + x;
+}
+
+static inline int mul_59(int x) {
+  return (x << 6) - (x << 2) - x;
+}
+
+static inline int mul_71(int x) {
+  return (x << 6) + (x << 3) - x;
+}
+
+static inline int mul_181(int x) {
+  return (x << 7) + (x << 5) + (x << 4) + (x << 2) + x;
+}
+
+static inline int mul_213(int x) {
+  return (x << 8) - (x << 5) - (x << 3) - (x << 1) - x;
+}
+
+static inline int mul_251(int x) {
+  return (x << 8) - (x << 2) - x;
+}
+
+static inline int mul_277(int x) {
+  return (x << 8) + (x << 4) + (x << 2) + x;
+}
+
+static inline int mul_669(int x) {
+  return (x << 9) + (x << 7) + (x << 5) - (x << 2) + x;
+}
+
+static inline int mul_fix_0_353553391(int x) {
+  return mul_181(x) << 4;
+}
+
+static inline int mul_fix_0_461939766(int x) {
+  return (x << 12) - (x << 8) - (x << 6) + (x << 3);
+}
+
+static inline int mul_fix_0_191341716(int x) {
+  return (x << 10) + (x << 9) + (x << 5) - x;
+}
+#else
+#define mul_25(x) ((x) * 25)
+#define mul_49(x) ((x) * 49)
+#define mul_59(x) ((x) * 59)
+#define mul_71(x) ((x) * 71)
+#define mul_181(x) ((x) * 181)
+#define mul_213(x) ((x) * 213)
+#define mul_251(x) ((x) * 251)
+#define mul_277(x) ((x) * 277)
+#define mul_669(x) ((x) * 669)
+#define mul_fix_0_353553391(x) ((x) * FIX_0_353553391)
+#define mul_fix_0_461939766(x) ((x) * FIX_0_461939766)
+#define mul_fix_0_191341716(x) ((x) * FIX_0_191341716)
+#endif // IDCT_SHIFT_ADD
+
+/**
+ * Inverse DCT of a block to (8 >> scale_shift) x (8 >> scale_shift) pixels, which replace the first coefficients
+ * Reduced blocks only need the matching low frequency coefficients, evaluated at the centre of each group of pixels
+ */
+static void inverse_dct_block(JpegDecompressor *d, int cache_index) {
+  JpegInfo *info = d->info;
+  switch (info->scale_shift) {
+    case 0:
+      // Compute inverse DCT with ANN algorithm
+      inverse_dct_component(d, cache_index);
+      break;
+    case 1:
+      inverse_dct_component_4x4(d, cache_index);
+      break;
+    case 2:
+      inverse_dct_component_2x2(d, cache_index);
+      break;
+    default:
+      // Only the DC coefficient is left, it is 8 times the average of the block
+      MCU_buffer_cache[d->tasklet_id][cache_index] = (MCU_buffer_cache[d->tasklet_id][cache_index] + 4) >> 3;
+      break;
+  }
+}
+
+static void inverse_dct_component_4x4(JpegDecompressor *d, int cache_index) {
+  short *block = &MCU_buffer_cache[d->tasklet_id][cache_index];
+
+  if (low_ac_coefficients(block) == 0) {
+    // Only the DC coefficient, every pixel gets the same value
+    int column = mul_fix_0_353553391(block[0]) >> (IDCT_CONST_BITS - IDCT_PASS1_BITS);
+    short pixel = (mul_fix_0_353553391(column) + (1 << (IDCT_CONST_BITS + IDCT_PASS1_BITS - 1))) >>
+                  (IDCT_CONST_BITS + IDCT_PASS1_BITS);
+    for (int i = 0; i < 16; i++) {
+      block[i] = pixel;
+    }
+    return;
+  }
+
+  // Columns, the results stay where the coefficients were
+  for (int i = 0; i < 4; i++) {
+    int e0 = mul_fix_0_353553391(block[(0 << 3) + i] + block[(2 << 3) + i]);
+    int e1 = mul_fix_0_353553391(block[(0 << 3) + i] - block[(2 << 3) + i]);
+    int o0 = mul_fix_0_461939766(block[(1 << 3) + i]) + mul_fix_0_191341716(block[(3 << 3) + i]);
+    int o1 = mul_fix_0_191341716(block[(1 << 3) + i]) - mul_fix_0_461939766(block[(3 << 3) + i]);
+
+    block[(0 << 3) + i] = (e0 + o0) >> (IDCT_CONST_BITS - IDCT_PASS1_BITS);
+    block[(1 << 3) + i] = (e1 + o1) >> (IDCT_CONST_BITS - IDCT_PASS1_BITS);
+    block[(2 << 3) + i] = (e1 - o1) >> (IDCT_CONST_BITS - IDCT_PASS1_BITS);
+    block[(3 << 3) + i] = (e0 - o0) >> (IDCT_CONST_BITS - IDCT_PASS1_BITS);
+  }
+
+  // Rows, packed 4 pixels to a row. Row i is read before it is written and never overlaps the rows after it
+  int round = 1 << (IDCT_CONST_BITS + IDCT_PASS1_BITS - 1);
+  for (int i = 0; i < 4; i++) {
+    int e0 = mul_fix_0_353553391(block[(i << 3) + 0] + block[(i << 3) + 2]) + round;
+    int e1 = mul_fix_0_353553391(block[(i << 3) + 0] - block[(i << 3) + 2]) + round;
+    int o0 = mul_fix_0_461939766(block[(i << 3) + 1]) + mul_fix_0_191341716(block[(i << 3) + 3]);
+    int o1 = mul_fix_0_191341716(block[(i << 3) + 1]) - mul_fix_0_461939766(block[(i << 3) + 3]);
+
+    block[(i << 2) + 0] = (e0 + o0) >> (IDCT_CONST_BITS + IDCT_PASS1_BITS);
+    block[(i << 2) + 1] = (e1 + o1) >> (IDCT_CONST_BITS + IDCT_PASS1_BITS);
+    block[(i << 2) + 2] = (e1 - o1) >> (IDCT_CONST_BITS + IDCT_PASS1_BITS);
+    block[(i << 2) + 3] = (e0 - o0) >> (IDCT_CONST_BITS + IDCT_PASS1_BITS);
+  }
+}
+
+static void inverse_dct_component_2x2(JpegDecompressor *d, int cache_index) {
+  short *block = &MCU_buffer_cache[d->tasklet_id][cache_index];
+
+  // Both passes at once, the 4 results replace the 4 coefficients they come from. (cos(pi / 4) / 2)^2 is exactly 1 / 8
+  int c00 = block[0];
+  int c01 = block[1];
+  int c10 = block[8];
+  int c11 = block[9];
+
+  block[0] = (c00 + c01 + c10 + c11 + 4) >> 3;
+  block[1] = (c00 - c01 + c10 - c11 + 4) >> 3;
+  block[2] = (c00 + c01 - c10 - c11 + 4) >> 3;
+  block[3] = (c00 - c01 - c10 + c11 + 4) >> 3;
+}
+
+/**
+ * Butterflies of one pass of the ANN inverse DCT, from its 8 scaled inputs g0 to g7 to values[0], values[stride], ...,
+ * values[7 * stride]
+ * Intermediate values are bit shifted to the left to preserve precision and then bit shifted to the right at the end
+ */
+static inline void inverse_dct_butterflies(short *values, int stride, int g0, int g1, int g2, int g3, int g4, int g5,
+                                           int g6, int g7) {
+  int f4 = g4 - g7;
+  int f5 = g5 + g6;
+  int f6 = g5 - g6;
+  int f7 = g4 + g7;
+
+  int e2 = g2 - g3;
+  int e3 = g2 + g3;
+  int e5 = f5 - f7;
+  int e7 = f5 + f7;
+  int e8 = f4 + f6;
+
+  // Higher accuracy
+  int d2 = mul_181(e2) >> 7;
+  int d4 = mul_277(f4) >> 8;
+  int d5 = mul_181(e5) >> 7;
+  int d6 = mul_669(f6) >> 8;
+  int d8 = mul_49(e8) >> 6;
+
+  // Lower accuracy
+  // int d2 = (e2 * 90) >> 6;
+  // int d4 = (f4 * 69) >> 6;
+  // int d5 = (e5 * 90) >> 6;
+  // int d6 = (f6 * 167) >> 6;
+  // int d8 = (e8 * 49) >> 6;
+
+  int c0 = g0 + g1;
+  int c1 = g0 - g1;
+  int c2 = d2 - e3;
+  int c4 = d4 + d8;
+  int c5 = d5 + e7;
+  int c6 = d6 - d8;
+  int c8 = c5 - c6;
+
+  int b0 = c0 + e3;
+  int b1 = c1 + c2;
+  int b2 = c1 - c2;
+  int b3 = c0 - e3;
+  int b4 = c4 - c8;
+  int b6 = c6 - e7;
+
+  values[0 * stride] = (b0 + e7) >> 4;
+  values[1 * stride] = (b1 + b6) >> 4;
+  values[2 * stride] = (b2 + c8) >> 4;
+  values[3 * stride] = (b3 + b4) >> 4;
+  values[4 * stride] = (b3 - b4) >> 4;
+  values[5 * stride] = (b2 - c8) >> 4;
+  values[6 * stride] = (b1 - b6) >> 4;
+  values[7 * stride] = (b0 - e7) >> 4;
+}
+
+// inverse_dct_butterflies when only g0, g2, g5 and g7 can be nonzero, the terms of the others drop out
+static inline void inverse_dct_butterflies_low(short *values, int stride, int g0, int g2, int g5, int g7) {
+  int e5 = g5 - g7;
+  int e7 = g5 + g7;
+
+  int d2 = mul_181(g2) >> 7;
+  int d4 = mul_277(-g7) >> 8;
+  int d5 = mul_181(e5) >> 7;
+  int d6 = mul_669(g5) >> 8;
+  int d8 = mul_49(e5) >> 6;
+
+  int c2 = d2 - g2;
+  int c4 = d4 + d8;
+  int c6 = d6 - d8;
+  int c8 = d5 + e7 - c6;
+
+  int b0 = g0 + g2;
+  int b1 = g0 + c2;
+  int b2 = g0 - c2;
+  int b3 = g0 - g2;
+  int b4 = c4 - c8;
+  int b6 = c6 - e7;
+
+  values[0 * stride] = (b0 + e7) >> 4;
+  values[1 * stride] = (b1 + b6) >> 4;
+  values[2 * stride] = (b2 + c8) >> 4;
+  values[3 * stride] = (b3 + b4) >> 4;
+  values[4 * stride] = (b3 - b4) >> 4;
+  values[5 * stride] = (b2 - c8) >> 4;
+  values[6 * stride] = (b1 - b6) >> 4;
+  values[7 * stride] = (b0 - e7) >> 4;
+}
+
+// One pass of the ANN inverse DCT over values[0], values[stride], ..., values[7 * stride] in place, scaling them first
+static void inverse_dct_8(short *values, int stride) {
+  // Higher accuracy
+  int g0 = mul_181(values[0 * stride]) >> 5;
+  int g1 = mul_181(values[4 * stride]) >> 5;
+  int g2 = mul_59(values[2 * stride]) >> 3;
+  int g3 = mul_49(values[6 * stride]) >> 4;
+  int g4 = mul_71(values[5 * stride]) >> 4;
+  int g5 = mul_251(values[1 * stride]) >> 5;
+  int g6 = mul_25(values[7 * stride]) >> 4;
+  int g7 = mul_213(values[3 * stride]) >> 5;
+
+  // Lower accuracy
+  // int g0 = (values[0 * stride] * 22) >> 2;
+  // int g1 = (values[4 * stride] * 22) >> 2;
+  // int g2 = (values[2 * stride] * 30) >> 2;
+  // int g3 = (values[6 * stride] * 12) >> 2;
+  // int g4 = (values[5 * stride] * 18) >> 2;
+  // int g5 = (values[1 * stride] * 31) >> 2;
+  // int g6 = (values[7 * stride] * 6) >> 2;
+  // int g7 = (values[3 * stride] * 27) >> 2;
+
+  inverse_dct_butterflies(values, stride, g0, g1, g2, g3, g4, g5, g6, g7);
+}
+
+// inverse_dct_8 when only the first 4 values can be nonzero
+static void inverse_dct_8_low(short *values, int stride) {
+  int g0 = mul_181(values[0 * stride]) >> 5;
+  int g2 = mul_59(values[2 * stride]) >> 3;
+  int g5 = mul_251(values[1 * stride]) >> 5;
+  int g7 = mul_213(values[3 * stride]) >> 5;
+
+  inverse_dct_butterflies_low(values, stride, g0, g2, g5, g7);
+}
+
+// Bitwise or of the AC coefficients in the top left 4x4 of a block, zero when none of them is set
+static int low_ac_coefficients(short *block) {
+  int ac = block[1] | block[2] | block[3];
+  for (int y = 1; y < 4; y++) {
+    ac |= block[(y << 3) + 0] | block[(y << 3) + 1] | block[(y << 3) + 2] | block[(y << 3) + 3];
+  }
+  return ac;
+}
+
+/**
+ * Inverse DCT of a full size block in place
+ * decode_mcu already scaled the AC coefficients for the column pass while dequantizing them, see kept_quant_value, and
+ * recorded where they lie. A block with only its DC coefficient is flat, and a block whose coefficients all lie in its
+ * top left 4x4 only needs 4 columns transformed and the cheaper inverse_dct_8_low for its rows. Columns without AC
+ * coefficients transform to their scaled DC. All of these give the same pixels as the full transform
+ */
 static void inverse_dct_component(JpegDecompressor *d, int cache_index) {
-  // ANN algorithm, intermediate values are bit shifted to the left to preserve precision
-  // and then bit shifted to the right at the end
-  for (int i = 0; i < 8; i++) {
-    // Higher accuracy
-    int g0 = (MCU_buffer_cache[d->tasklet_id][cache_index + (0 << 3) + i] * 181) >> 5;
-    int g1 = (MCU_buffer_cache[d->tasklet_id][cache_index + (4 << 3) + i] * 181) >> 5;
-    int g2 = (MCU_buffer_cache[d->tasklet_id][cache_index + (2 << 3) + i] * 59) >> 3;
-    int g3 = (MCU_buffer_cache[d->tasklet_id][cache_index + (6 << 3) + i] * 49) >> 4;
-    int g4 = (MCU_buffer_cache[d->tasklet_id][cache_index + (5 << 3) + i] * 71) >> 4;
-    int g5 = (MCU_buffer_cache[d->tasklet_id][cache_index + (1 << 3) + i] * 251) >> 5;
-    int g6 = (MCU_buffer_cache[d->tasklet_id][cache_index + (7 << 3) + i] * 25) >> 4;
-    int g7 = (MCU_buffer_cache[d->tasklet_id][cache_index + (3 << 3) + i] * 213) >> 5;
-
-    // Lower accuracy
-    // int g0 = (MCU_buffer_cache[d->tasklet_id][cache_index + (0 << 3) + i] * 22) >> 2;
-    // int g1 = (MCU_buffer_cache[d->tasklet_id][cache_index + (4 << 3) + i] * 22) >> 2;
-    // int g2 = (MCU_buffer_cache[d->tasklet_id][cache_index + (2 << 3) + i] * 30) >> 2;
-    // int g3 = (MCU_buffer_cache[d->tasklet_id][cache_index + (6 << 3) + i] * 12) >> 2;
-    // int g4 = (MCU_buffer_cache[d->tasklet_id][cache_index + (5 << 3) + i] * 18) >> 2;
-    // int g5 = (MCU_buffer_cache[d->tasklet_id][cache_index + (1 << 3) + i] * 31) >> 2;
-    // int g6 = (MCU_buffer_cache[d->tasklet_id][cache_index + (7 << 3) + i] * 6) >> 2;
-    // int g7 = (MCU_buffer_cache[d->tasklet_id][cache_index + (3 << 3) + i] * 27) >> 2;
-
-    int f4 = g4 - g7;
-    int f5 = g5 + g6;
-    int f6 = g5 - g6;
-    int f7 = g4 + g7;
-
-    int e2 = g2 - g3;
-    int e3 = g2 + g3;
-    int e5 = f5 - f7;
-    int e7 = f5 + f7;
-    int e8 = f4 + f6;
-
-    // Higher accuracy
-    int d2 = (e2 * 181) >> 7;
-    int d4 = (f4 * 277) >> 8;
-    int d5 = (e5 * 181) >> 7;
-    int d6 = (f6 * 669) >> 8;
-    int d8 = (e8 * 49) >> 6;
-
-    // Lower accuracy
-    // int d2 = (e2 * 90) >> 6;
-    // int d4 = (f4 * 69) >> 6;
-    // int d5 = (e5 * 90) >> 6;
-    // int d6 = (f6 * 167) >> 6;
-    // int d8 = (e8 * 49) >> 6;
-
-    int c0 = g0 + g1;
-    int c1 = g0 - g1;
-    int c2 = d2 - e3;
-    int c4 = d4 + d8;
-    int c5 = d5 + e7;
-    int c6 = d6 - d8;
-    int c8 = c5 - c6;
-
-    int b0 = c0 + e3;
-    int b1 = c1 + c2;
-    int b2 = c1 - c2;
-    int b3 = c0 - e3;
-    int b4 = c4 - c8;
-    int b6 = c6 - e7;
-
-    MCU_buffer_cache[d->tasklet_id][cache_index + (0 << 3) + i] = (b0 + e7) >> 4;
-    MCU_buffer_cache[d->tasklet_id][cache_index + (1 << 3) + i] = (b1 + b6) >> 4;
-    MCU_buffer_cache[d->tasklet_id][cache_index + (2 << 3) + i] = (b2 + c8) >> 4;
-    MCU_buffer_cache[d->tasklet_id][cache_index + (3 << 3) + i] = (b3 + b4) >> 4;
-    MCU_buffer_cache[d->tasklet_id][cache_index + (4 << 3) + i] = (b3 - b4) >> 4;
-    MCU_buffer_cache[d->tasklet_id][cache_index + (5 << 3) + i] = (b2 - c8) >> 4;
-    MCU_buffer_cache[d->tasklet_id][cache_index + (6 << 3) + i] = (b1 - b6) >> 4;
-    MCU_buffer_cache[d->tasklet_id][cache_index + (7 << 3) + i] = (b0 - e7) >> 4;
+  short *block = &MCU_buffer_cache[d->tasklet_id][cache_index];
+  int extent = extent_cache[d->tasklet_id][cache_index >> 6];
+
+  block[0] = mul_181(block[0]) >> 5;
+  if (extent == EXTENT_DC) {
+    short column = block[0] >> 4;
+    short pixel = (mul_181(column) >> 5) >> 4;
+    for (int i = 0; i < 64; i++) {
+      block[i] = pixel;
+    }
+    return;
+  }
+
+  int low = extent == EXTENT_LOW;
+  int columns = low ? 4 : 8;
+  for (int i = 0; i < columns; i++) {
+    int ac = block[(1 << 3) + i] | block[(2 << 3) + i] | block[(3 << 3) + i];
+    if (!low) {
+      ac |= block[(4 << 3) + i] | block[(5 << 3) + i] | block[(6 << 3) + i] | block[(7 << 3) + i];
+    }
+
+    if (ac == 0) {
+      short column = block[i] >> 4;
+      for (int j = 0; j < 8; j++) {
+        block[(j << 3) + i] = column;
+      }
+    } else if (low) {
+      inverse_dct_butterflies_low(&block[i], 8, block[i], block[(2 << 3) + i], block[(1 << 3) + i],
+                                  block[(3 << 3) + i]);
+    } else {
+      inverse_dct_butterflies(&block[i], 8, block[i], block[(4 << 3) + i], block[(2 << 3) + i], block[(6 << 3) + i],
+                              block[(5 << 3) + i], block[(1 << 3) + i], block[(7 << 3) + i], block[(3 << 3) + i]);
+    }
   }
 
   for (int i = 0; i < 8; i++) {
-    // Higher accuracy
-    int g0 = (MCU_buffer_cache[d->tasklet_id][cache_index + (i << 3) + 0] * 181) >> 5;
-    int g1 = (MCU_buffer_cache[d->tasklet_id][cache_index + (i << 3) + 4] * 181) >> 5;
-    int g2 = (MCU_buffer_cache[d->tasklet_id][cache_index + (i << 3) + 2] * 59) >> 3;
-    int g3 = (MCU_buffer_cache[d->tasklet_id][cache_index + (i << 3) + 6] * 49) >> 4;
-    int g4 = (MCU_buffer_cache[d->tasklet_id][cache_index + (i << 3) + 5] * 71) >> 4;
-    int g5 = (MCU_buffer_cache[d->tasklet_id][cache_index + (i << 3) + 1] * 251) >> 5;
-    int g6 = (MCU_buffer_cache[d->tasklet_id][cache_index + (i << 3) + 7] * 25) >> 4;
-    int g7 = (MCU_buffer_cache[d->tasklet_id][cache_index + (i << 3) + 3] * 213) >> 5;
-
-    // Lower accuracy
-    // int g0 = (MCU_buffer_cache[d->tasklet_id][cache_index + (i << 3) + 0] * 22) >> 2;
-    // int g1 = (MCU_buffer_cache[d->tasklet_id][cache_index + (i << 3) + 4] * 22) >> 2;
-    // int g2 = (MCU_buffer_cache[d->tasklet_id][cache_index + (i << 3) + 2] * 30) >> 2;
-    // int g3 = (MCU_buffer_cache[d->tasklet_id][cache_index + (i << 3) + 6] * 12) >> 2;
-    // int g4 = (MCU_buffer_cache[d->tasklet_id][cache_index + (i << 3) + 5] * 18) >> 2;
-    // int g5 = (MCU_buffer_cache[d->tasklet_id][cache_index + (i << 3) + 1] * 31) >> 2;
-    // int g6 = (MCU_buffer_cache[d->tasklet_id][cache_index + (i << 3) + 7] * 6) >> 2;
-    // int g7 = (MCU_buffer_cache[d->tasklet_id][cache_index + (i << 3) + 3] * 27) >> 2;
-
-    int f4 = g4 - g7;
-    int f5 = g5 + g6;
-    int f6 = g5 - g6;
-    int f7 = g4 + g7;
-
-    int e2 = g2 - g3;
-    int e3 = g2 + g3;
-    int e5 = f5 - f7;
-    int e7 = f5 + f7;
-    int e8 = f4 + f6;
-
-    // Higher accuracy
-    int d2 = (e2 * 181) >> 7;
-    int d4 = (f4 * 277) >> 8;
-    int d5 = (e5 * 181) >> 7;
-    int d6 = (f6 * 669) >> 8;
-    int d8 = (e8 * 49) >> 6;
-
-    // Lower accuracy
-    // int d2 = (e2 * 90) >> 6;
-    // int d4 = (f4 * 69) >> 6;
-    // int d5 = (e5 * 90) >> 6;
-    // int d6 = (f6 * 167) >> 6;
-    // int d8 = (e8 * 49) >> 6;
-
-    int c0 = g0 + g1;
-    int c1 = g0 - g1;
-    int c2 = d2 - e3;
-    int c4 = d4 + d8;
-    int c5 = d5 + e7;
-    int c6 = d6 - d8;
-    int c8 = c5 - c6;
-
-    int b0 = c0 + e3;
-    int b1 = c1 + c2;
-    int b2 = c1 - c2;
-    int b3 = c0 - e3;
-    int b4 = c4 - c8;
-    int b6 = c6 - e7;
-
-    MCU_buffer_cache[d->tasklet_id][cache_index + (i << 3) + 0] = (b0 + e7) >> 4;
-    MCU_buffer_cache[d->tasklet_id][cache_index + (i << 3) + 1] = (b1 + b6) >> 4;
-    MCU_buffer_cache[d->tasklet_id][cache_index + (i << 3) + 2] = (b2 + c8) >> 4;
-    MCU_buffer_cache[d->tasklet_id][cache_index + (i << 3) + 3] = (b3 + b4) >> 4;
-    MCU_buffer_cache[d->tasklet_id][cache_index + (i << 3) + 4] = (b3 - b4) >> 4;
-    MCU_buffer_cache[d->tasklet_id][cache_index + (i << 3) + 5] = (b2 - c8) >> 4;
-    MCU_buffer_cache[d->tasklet_id][cache_index + (i << 3) + 6] = (b1 - b6) >> 4;
-    MCU_buffer_cache[d->tasklet_id][cache_index + (i << 3) + 7] = (b0 - e7) >> 4;
+    if (low) {
+      inverse_dct_8_low(&block[i << 3], 1);
+    } else {
+      inverse_dct_8(&block[i << 3], 1);
+    }
   }
 }
 
 // https://en.wikipedia.org/wiki/YUV Y'UV444 to RGB888 conversion
-static void ycbcr_to_rgb_pixel(JpegDecompressor *d, int cache_index, int v, int h) {
-  int max_v = jpegInfo.max_v_samp_factor;
-  int max_h = jpegInfo.max_h_samp_factor;
+static void ycbcr_to_rgb_pixel(JpegDecompressor *d, int mcu_cache_index, int cache_index, int v, int h) {
+  JpegInfo *info = d->info;
+  int max_v = info->max_v_samp_factor;
+  int max_h = info->max_h_samp_factor;
+  int shift = 3 - info->scale_shift;
+  int block_size = 1 << shift;
 
   // Iterating from bottom right to top left because otherwise the pixel data will get overwritten
-  for (int y = 7; y >= 0; y--) {
-    for (int x = 7; x >= 0; x--) {
-      int pixel = cache_index + (y << 3) + x;
-      int cbcr_pixel_row = y / max_v + 4 * v;
-      int cbcr_pixel_col = x / max_h + 4 * h;
-      int cbcr_pixel = (cbcr_pixel_row << 3) + cbcr_pixel_col + 64;
-
-      short r =
-          MCU_buffer_cache[d->tasklet_id][pixel] + ((45 * MCU_buffer_cache[d->tasklet_id][64 + cbcr_pixel]) >> 5) + 128;
-      short g =
-          MCU_buffer_cache[d->tasklet_id][pixel] -
-          ((11 * MCU_buffer_cache[d->tasklet_id][cbcr_pixel] + 23 * MCU_buffer_cache[d->tasklet_id][64 + cbcr_pixel]) >>
-           5) +
-          128;
-      short b =
-          MCU_buffer_cache[d->tasklet_id][pixel] + ((113 * MCU_buffer_cache[d->tasklet_id][cbcr_pixel]) >> 6) + 128;
-
-      if (r < 0)
-        r = 0;
-      if (r > 255)
-        r = 255;
-      if (g < 0)
-        g = 0;
-      if (g > 255)
-        g = 255;
-      if (b < 0)
-        b = 0;
-      if (b > 255)
-        b = 255;
+  for (int y = block_size - 1; y >= 0; y--) {
+    for (int x = block_size - 1; x >= 0; x--) {
+      int pixel = cache_index + (y << shift) + x;
+      int cbcr_pixel_row = (y + (v << shift)) / max_v;
+      int cbcr_pixel_col = (x + (h << shift)) / max_h;
+      int cbcr_pixel = mcu_cache_index + (cbcr_pixel_row << shift) + cbcr_pixel_col + 64;
+
+      int luma = MCU_buffer_cache[d->tasklet_id][pixel];
+      int cb = CHROMA_INDEX(MCU_buffer_cache[d->tasklet_id][cbcr_pixel]);
+      int cr = CHROMA_INDEX(MCU_buffer_cache[d->tasklet_id][64 + cbcr_pixel]);
+      uint8_t r = color_tables.clamp[(luma + color_tables.cr_r[cr]) & CLAMP_TABLE_MASK];
+      uint8_t g =
+          color_tables.clamp[(luma - ((color_tables.cb_g[cb] + color_tables.cr_g[cr]) >> 5)) & CLAMP_TABLE_MASK];
+      uint8_t b = color_tables.clamp[(luma + color_tables.cb_b[cb]) & CLAMP_TABLE_MASK];
 
       MCU_buffer_cache[d->tasklet_id][pixel] = r;
       MCU_buffer_cache[d->tasklet_id][64 + pixel] = g;
@@ -597,156 +1547,132 @@ static void ycbcr_to_rgb_pixel(JpegDecompressor *d, int cache_index, int v, int
   }
 }
 
-// Start position and cropped width, height must be 8 pixel aligned
-void crop(JpegDecompressor *d, int start_x, int start_y, int new_width, int new_height) {
-  // TODO: think about whether it is possible to use multiple tasklets
-  int new_mcu_height = (new_height + 7) >> 3;
-  int new_mcu_width = (new_width + 7) >> 3;
-  int start_row = start_y >> 3;
-  int start_col = start_x >> 3;
+/**
+ * Whether the chroma is subsampled 2x2 (h2v2) or 2x1 (h2v1) and each chroma sample covers at least one whole group of
+ * luma pixels, so that upsampling can be merged into the colour conversion
+ */
+static int merged_upsample(JpegInfo *info) {
+  int max_v = info->max_v_samp_factor;
+
+  return info->num_planes == 3 && info->scale_shift < 3 && info->max_h_samp_factor == 2 && max_v <= 2 &&
+         info->color_components[0].h_samp_factor == 2 && info->color_components[0].v_samp_factor == max_v &&
+         info->color_components[1].h_samp_factor == 1 && info->color_components[1].v_samp_factor == 1 &&
+         info->color_components[2].h_samp_factor == 1 && info->color_components[2].v_samp_factor == 1;
+}
 
-  for (int row = 0; row < new_mcu_height; row++) {
-    for (int col = 0; col < new_mcu_width; col++) {
-      int mcu_index = (((row + start_row) * jpegInfo.mcu_width_real + (col + start_col)) * 3) << 6;
-      int new_mcu_index = ((row * new_mcu_width + col) * 3) << 6;
-      mram_read(&MCU_buffer[0][mcu_index], &MCU_buffer_cache[d->tasklet_id][0], MCU_READ_WRITE_SIZE1);
-      mram_write(&MCU_buffer_cache[d->tasklet_id][0], &MCU_buffer[0][new_mcu_index], MCU_READ_WRITE_SIZE1);
-    }
-  }
-
-  jpegInfo.image_width = new_width;
-  jpegInfo.image_height = new_height;
-  jpegInfo.mcu_width_real = new_mcu_width;
-  jpegInfo.mcu_height_real = new_mcu_height;
-}
-
-// Only scales by multiples of 2
-void jpeg_scale(JpegDecompressor *d, int x_scale_factor, int y_scale_factor) {
-  // TODO: implement multiple tasklets
-  int x_shift = 1, y_shift = 1;
-  while ((1 << x_shift) < x_scale_factor) {
-    x_shift++;
-  }
-  while ((1 << y_shift) < y_scale_factor) {
-    y_shift++;
-  }
-  int temp0 = 8 >> y_shift;
-  int temp1 = 8 >> x_shift;
-
-  for (int row = 0; row < jpegInfo.mcu_height_real; row++) {
-    for (int col = 0; col < jpegInfo.mcu_width_real; col++) {
-      for (int color_index = 0; color_index < jpegInfo.num_color_components; color_index++) {
-        int mcu_index = ((row * jpegInfo.mcu_width_real + col) * 3 + color_index) << 6;
-        mram_read(&MCU_buffer[0][mcu_index], &MCU_buffer_cache[d->tasklet_id][0], MCU_READ_WRITE_SIZE0);
-        for (int y = 0; y < temp0; y++) {
-          for (int x = 0; x < temp1; x++) {
-            int sum = 0;
-            for (int i = 0; i < y_scale_factor; i++) {
-              for (int j = 0; j < x_scale_factor; j++) {
-                sum += MCU_buffer_cache[d->tasklet_id][(((y << y_shift) + i) << 3) + (x << x_shift) + j];
-              }
-            }
-            MCU_buffer_cache[d->tasklet_id][(y << 3) + x] = sum >> (x_shift + y_shift);
-          }
-        }
-        mram_write(&MCU_buffer_cache[d->tasklet_id][0], &MCU_buffer[0][mcu_index], MCU_READ_WRITE_SIZE0);
-      }
-    }
-  }
+// Add the contributions of its chroma to a luma pixel and write the clamped RGB components in its place
+static inline void merge_rgb_pixel(short *pixel, int r_offset, int g_offset, int b_offset) {
+  int luma = pixel[0];
 
-  int new_mcu_width = jpegInfo.mcu_width_real >> x_shift;
-  int new_mcu_height = jpegInfo.mcu_height_real >> y_shift;
+  pixel[0] = color_tables.clamp[(luma + r_offset) & CLAMP_TABLE_MASK];
+  pixel[64] = color_tables.clamp[(luma + g_offset) & CLAMP_TABLE_MASK];
+  pixel[128] = color_tables.clamp[(luma + b_offset) & CLAMP_TABLE_MASK];
+}
 
-  for (int row = 0; row < new_mcu_height; row++) {
-    for (int col = 0; col < new_mcu_width; col++) {
-      for (int color_index = 0; color_index < jpegInfo.num_color_components; color_index++) {
-        int mcu_index = ((row * new_mcu_width + col) * 3 + color_index) << 6;
-        int general_portion_index = (((row << y_shift) * jpegInfo.mcu_width_real + (col << x_shift)) * 3 + color_index)
-                                    << 6;
-
-        for (int i = 0; i < y_scale_factor; i++) {
-          for (int j = 0; j < x_scale_factor; j++) {
-            int exact_portion_index = general_portion_index + (((i * jpegInfo.mcu_width_real + j) * 3) << 6);
-            mram_read(&MCU_buffer[0][exact_portion_index], &MCU_buffer_cache[d->tasklet_id][64], MCU_READ_WRITE_SIZE0);
-
-            for (int y = 0; y < temp0; y++) {
-              for (int x = 0; x < temp1; x++) {
-                MCU_buffer_cache[d->tasklet_id][((y + i * temp0) << 3) + (x + j * temp1)] =
-                    MCU_buffer_cache[d->tasklet_id][64 + y * 8 + x];
-              }
-            }
-          }
+/**
+ * Colour conversion of an h2v2 MCU, its 2x2 luma blocks sharing one block of each chroma component
+ * Every chroma sample is converted once and added to the 2x2 luma pixels it covers. The first block overwrites the
+ * chroma with its green and blue, so it goes last and from bottom right to top left, like ycbcr_to_rgb_pixel
+ */
+static void ycbcr_to_rgb_h2v2(JpegDecompressor *d, int mcu_cache_index) {
+  JpegInfo *info = d->info;
+  short *cache = MCU_buffer_cache[d->tasklet_id];
+  short *cb = &cache[mcu_cache_index + 64];
+  short *cr = &cache[mcu_cache_index + 128];
+  int shift = 3 - info->scale_shift;
+  int block_size = 1 << shift;
+  int half = block_size >> 1;
+
+  for (int v = 1; v >= 0; v--) {
+    for (int h = 1; h >= 0; h--) {
+      short *luma = &cache[block_cache_index(info, mcu_cache_index, v, h, 0)];
+      for (int y = half - 1; y >= 0; y--) {
+        int cbcr_row = ((y + v * half) << shift) + h * half;
+        short *top = &luma[(y << 1) << shift];
+        short *bottom = top + block_size;
+        for (int x = half - 1; x >= 0; x--) {
+          int cb_value = CHROMA_INDEX(cb[cbcr_row + x]);
+          int cr_value = CHROMA_INDEX(cr[cbcr_row + x]);
+          int r_offset = color_tables.cr_r[cr_value];
+          int g_offset = -((color_tables.cb_g[cb_value] + color_tables.cr_g[cr_value]) >> 5);
+          int b_offset = color_tables.cb_b[cb_value];
+
+          merge_rgb_pixel(&bottom[(x << 1) + 1], r_offset, g_offset, b_offset);
+          merge_rgb_pixel(&bottom[x << 1], r_offset, g_offset, b_offset);
+          merge_rgb_pixel(&top[(x << 1) + 1], r_offset, g_offset, b_offset);
+          merge_rgb_pixel(&top[x << 1], r_offset, g_offset, b_offset);
         }
-
-        mram_write(&MCU_buffer_cache[d->tasklet_id][0], &MCU_buffer[0][mcu_index], MCU_READ_WRITE_SIZE0);
       }
     }
   }
-
-  jpegInfo.image_width = jpegInfo.image_width >> x_shift;
-  jpegInfo.image_height = jpegInfo.image_height >> y_shift;
-  jpegInfo.mcu_width_real = new_mcu_width;
-  jpegInfo.mcu_height_real = new_mcu_height;
 }
 
-void horizontal_flip(JpegDecompressor *d) {
-  int row = jpegInfoDpu.rows_per_tasklet * d->tasklet_id;
-  int end_row = jpegInfoDpu.rows_per_tasklet * (d->tasklet_id + 1);
-  if (d->tasklet_id == NR_TASKLETS - 1) {
-    end_row = jpegInfo.mcu_height;
-  }
-
-  for (; row < end_row; row++) {
-    for (int col = 0; col < jpegInfo.mcu_width_real / 2; col++) {
-      int mcu_index = ((row * jpegInfo.mcu_width_real + col) * 3) << 6;
-      int target_mcu_index = mcu_index + (((jpegInfo.mcu_width_real - (col << 1) - 1) * 3) << 6);
-      mram_read(&MCU_buffer[0][mcu_index], &MCU_buffer_cache[d->tasklet_id][0], MCU_READ_WRITE_SIZE1);
-      mram_read(&MCU_buffer[0][target_mcu_index], &MCU_buffer_cache[d->tasklet_id][192], MCU_READ_WRITE_SIZE1);
-
-      for (int color_index = 0; color_index < jpegInfo.num_color_components; color_index++) {
-        for (int y = 0; y < 8; y++) {
-          for (int x = 0; x < 8; x++) {
-            int left_index = (y << 3) + x + (color_index << 6);
-            int right_index = 192 + (y << 3) + (7 - x) + (color_index << 6);
-            short temp0 = MCU_buffer_cache[d->tasklet_id][left_index];
-            MCU_buffer_cache[d->tasklet_id][left_index] = MCU_buffer_cache[d->tasklet_id][right_index];
-            MCU_buffer_cache[d->tasklet_id][right_index] = temp0;
-          }
-        }
+/**
+ * Colour conversion of an h2v1 MCU, its 2 luma blocks side by side sharing one block of each chroma component
+ * Every chroma sample is converted once and added to the 2 luma pixels it covers
+ */
+static void ycbcr_to_rgb_h2v1(JpegDecompressor *d, int mcu_cache_index) {
+  JpegInfo *info = d->info;
+  short *cache = MCU_buffer_cache[d->tasklet_id];
+  short *cb = &cache[mcu_cache_index + 64];
+  short *cr = &cache[mcu_cache_index + 128];
+  int shift = 3 - info->scale_shift;
+  int block_size = 1 << shift;
+  int half = block_size >> 1;
+
+  for (int h = 1; h >= 0; h--) {
+    short *luma = &cache[block_cache_index(info, mcu_cache_index, 0, h, 0)];
+    for (int y = block_size - 1; y >= 0; y--) {
+      int cbcr_row = (y << shift) + h * half;
+      short *row = &luma[y << shift];
+      for (int x = half - 1; x >= 0; x--) {
+        int cb_value = CHROMA_INDEX(cb[cbcr_row + x]);
+        int cr_value = CHROMA_INDEX(cr[cbcr_row + x]);
+        int r_offset = color_tables.cr_r[cr_value];
+        int g_offset = -((color_tables.cb_g[cb_value] + color_tables.cr_g[cr_value]) >> 5);
+        int b_offset = color_tables.cb_b[cb_value];
+
+        merge_rgb_pixel(&row[(x << 1) + 1], r_offset, g_offset, b_offset);
+        merge_rgb_pixel(&row[x << 1], r_offset, g_offset, b_offset);
       }
-
-      mram_write(&MCU_buffer_cache[d->tasklet_id][0], &MCU_buffer[0][mcu_index], MCU_READ_WRITE_SIZE1);
-      mram_write(&MCU_buffer_cache[d->tasklet_id][192], &MCU_buffer[0][target_mcu_index], MCU_READ_WRITE_SIZE1);
     }
   }
 }
 
-MUTEX_INIT(sum_rgb_lock);
+// A gray pixel is its luma, level shifted and clamped like the colour components of an RGB pixel
+static void luma_to_gray_pixel(JpegDecompressor *d, int cache_index) {
+  JpegInfo *info = d->info;
+  int block_pixels = 64 >> (2 * info->scale_shift);
 
-void find_sum_rgb(JpegDecompressor *d) {
-  int row = jpegInfoDpu.rows_per_tasklet * d->tasklet_id;
-  int end_row = jpegInfoDpu.rows_per_tasklet * (d->tasklet_id + 1);
-  if (d->tasklet_id == NR_TASKLETS - 1) {
-    end_row = jpegInfo.mcu_height;
+  for (int i = 0; i < block_pixels; i++) {
+    int luma = MCU_buffer_cache[d->tasklet_id][cache_index + i];
+    MCU_buffer_cache[d->tasklet_id][cache_index + i] = color_tables.clamp[luma & CLAMP_TABLE_MASK];
   }
+}
 
-  uint32_t sum_rgb[3] = {0, 0, 0};
+// Start position and cropped width, height must be 8 pixel aligned, in pixels of the full size image
+void crop(JpegDecompressor *d, int start_x, int start_y, int new_width, int new_height) {
+  JpegInfo *info = d->info;
+  // TODO: think about whether it is possible to use multiple tasklets
+  int new_mcu_height = (new_height + 7) >> 3;
+  int new_mcu_width = (new_width + 7) >> 3;
+  int start_row = start_y >> 3;
+  int start_col = start_x >> 3;
+  int position_size = image_position_size(info);
 
-  for (; row < end_row; row++) {
-    for (int col = 0; col < jpegInfo.mcu_width_real; col++) {
-      int mcu_index = ((row * jpegInfo.mcu_width_real + col) * 3) << 6;
-      mram_read(&MCU_buffer[0][mcu_index], &MCU_buffer_cache[d->tasklet_id][0], MCU_READ_WRITE_SIZE1);
-      for (int color_index = 0; color_index < jpegInfo.num_color_components; color_index++) {
-        for (int i = 0; i < 64; i++) {
-          sum_rgb[color_index] += MCU_buffer_cache[d->tasklet_id][(color_index << 6) + i];
-        }
-      }
+  // The cropped part of a row is contiguous both before and after cropping, so copy it a full cache at a time
+  for (int row = 0; row < new_mcu_height; row++) {
+    for (int col = 0; col < new_mcu_width; col += CACHE_POSITIONS) {
+      int num_positions = new_mcu_width - col < CACHE_POSITIONS ? new_mcu_width - col : CACHE_POSITIONS;
+      int mcu_index = ((row + start_row) * info->mcu_width_real + (col + start_col)) * position_size;
+      int new_mcu_index = (row * new_mcu_width + col) * position_size;
+      mram_read(&image_buffer(info)[mcu_index], image_cache(d), num_positions * position_size);
+      mram_write(image_cache(d), &image_buffer(info)[new_mcu_index], num_positions * position_size);
     }
   }
 
-  mutex_lock(sum_rgb_lock);
-  for (int color_index = 0; color_index < jpegInfo.num_color_components; color_index++) {
-    jpegInfoDpu.sum_rgb[color_index] += sum_rgb[color_index];
-  }
-  mutex_unlock(sum_rgb_lock);
+  info->image_width = new_width;
+  info->image_height = new_height;
+  info->mcu_width_real = new_mcu_width;
+  info->mcu_height_real = new_mcu_height;
 }
@@ -29,12 +29,13 @@ int check_start_of_image(JpegDecompressor *d) {
  * @param d JpegDecompressor struct that holds all information about the JPEG currently being decoded
  */
 int read_next_marker(JpegDecompressor *d) {
+  JpegInfo *info = d->info;
   int marker = skip_to_next_marker(d);
   int process_result;
 
   switch (marker) {
     case -1:
-      jpegInfo.valid = 0;
+      info->valid = 0;
       printf("Error: Read past EOF\n");
       break;
 
@@ -62,7 +63,9 @@ int read_next_marker(JpegDecompressor *d) {
       break;
 
     case M_SOS:
-      process_result = process_SOS(d);
+      if (process_SOS(d) != JPEG_VALID) {
+        info->valid = 0;
+      }
       return 0;
 
     case M_COM:
@@ -74,13 +77,13 @@ int read_next_marker(JpegDecompressor *d) {
       break;
 
     default:
-      jpegInfo.valid = 0;
+      info->valid = 0;
       printf("Error: Unhandled marker: FF %X\n", marker);
       break;
   }
 
   if (process_result != JPEG_VALID) {
-    jpegInfo.valid = 0;
+    info->valid = 0;
   }
 
   return 1;
@@ -6,29 +6,104 @@
 
 __mram_noinit char file_buffer[MAX_INPUT_LENGTH];
 
-#define PREFETCH_SIZE 1024
 __dma_aligned char file_buffer_cache[NR_TASKLETS][PREFETCH_SIZE];
 
-void init_file_reader_index(JpegDecompressor *d) {
-  d->file_index = -PREFETCH_SIZE;
-  d->cache_index = PREFETCH_SIZE;
+// Split points of the file decoded by all the tasklets, when the host found them
+__dma_aligned dpu_split_t host_splits[NR_TASKLETS];
+
+/**
+ * Look up a file in the file table at the start of file_buffer and move the reader to its first byte
+ */
+void select_file(JpegDecompressor *d, uint32_t file) {
+  JpegInfo *info = d->info;
+  __dma_aligned dpu_file_t entry;
+  mram_read(&file_buffer[file * sizeof(dpu_file_t)], &entry, sizeof(dpu_file_t));
+
+  info->file_start = entry.offset;
+  info->length = entry.offset + entry.length;
+  d->length = info->length;
+  seek_file_index(d, entry.offset);
+}
+
+/**
+ * Read the split points the host found for a file into host_splits
+ * Returns 0 if it found none, and the tasklets have to find where to start decoding by themselves
+ */
+int read_host_splits(uint32_t file) {
+  __dma_aligned dpu_file_t entry;
+  mram_read(&file_buffer[file * sizeof(dpu_file_t)], &entry, sizeof(dpu_file_t));
+  if (entry.split_found) {
+    mram_read(&file_buffer[FILE_SPLITS_OFFSET + file * sizeof(host_splits)], host_splits, sizeof(host_splits));
+  }
+  return entry.split_found;
 }
 
 void init_jpeg_decompressor(JpegDecompressor *d) {
-  int file_index = jpegInfo.image_data_start + jpegInfo.size_per_tasklet * d->tasklet_id;
+  JpegInfo *info = d->info;
+  seek_file_index(d, info->image_data_start + info->size_per_tasklet * d->tasklet_id);
+  d->length = info->image_data_start + info->size_per_tasklet * (d->tasklet_id + 1);
+  if (d->length > info->length) {
+    d->length = info->length;
+  }
+}
+
+/**
+ * Move the reader to file_index and empty the bit buffer
+ * The prefetch cache is reloaded on the next read
+ */
+void seek_file_index(JpegDecompressor *d, int file_index) {
   // Calculating offset so that mram_read is 8 byte aligned
   int offset = file_index % 8;
   d->file_index = file_index - offset - PREFETCH_SIZE;
   d->cache_index = offset + PREFETCH_SIZE;
-  d->length = jpegInfo.image_data_start + jpegInfo.size_per_tasklet * (d->tasklet_id + 1);
-  if (d->length > jpegInfo.length) {
-    d->length = jpegInfo.length;
-  }
 
   d->bit_buffer = 0;
   d->bits_left = 0;
 }
 
+/**
+ * Scan this tasklet's share of the bitstream for RST markers
+ * Records how many were found and the file offset of the restart interval following the first one
+ */
+void index_restart_markers(JpegDecompressor *d) {
+  uint32_t num_restarts = 0;
+  uint32_t first_offset = 0;
+
+  init_jpeg_decompressor(d);
+
+  // A marker belongs to the tasklet whose share holds its first 0xFF, even if its fill bytes or its code are past the
+  // end. The next share can then start inside the same marker, on its code as in FF | D3 or on one of its fill bytes
+  // as in FF FF | FF D3, and must not count it again. The byte before such a share is 0xFF, and the rest of the marker
+  // up to and including its code is skipped
+  uint32_t share_start = d->file_index + d->cache_index;
+  if (share_start > d->info->image_data_start) {
+    seek_file_index(d, share_start - 1);
+    if (read_byte(d) == 0xFF) {
+      while (!is_eof(d) && read_byte(d) == 0xFF) {
+        // Belongs to the previous share
+      }
+    }
+  }
+
+  while (!is_eof(d)) {
+    uint8_t byte = read_byte(d);
+
+    while (byte == 0xFF) {
+      // FF may be padded with FFs, read as many FFs as necessary
+      byte = read_byte(d);
+      if (byte >= M_RST_FIRST && byte <= M_RST_LAST) {
+        if (num_restarts == 0) {
+          first_offset = d->file_index + d->cache_index;
+        }
+        num_restarts++;
+      }
+    }
+  }
+
+  jpegInfoDpu.num_restarts[d->tasklet_id] = num_restarts;
+  jpegInfoDpu.restart_offset[d->tasklet_id] = first_offset;
+}
+
 uint8_t read_byte(JpegDecompressor *d) {
   if (d->cache_index >= PREFETCH_SIZE) {
     d->file_index += PREFETCH_SIZE;
@@ -40,6 +115,17 @@ uint8_t read_byte(JpegDecompressor *d) {
   return byte;
 }
 
+/**
+ * Peek at the next num_bytes of the file without consuming them
+ * Returns NULL if they are not all in the prefetch cache yet
+ */
+uint8_t *peek_cached_bytes(JpegDecompressor *d, int num_bytes) {
+  if (d->cache_index + num_bytes > PREFETCH_SIZE) {
+    return NULL;
+  }
+  return (uint8_t *) &file_buffer_cache[d->tasklet_id][d->cache_index];
+}
+
 uint16_t read_short(JpegDecompressor *d) {
   uint8_t byte1 = read_byte(d);
   uint8_t byte2 = read_byte(d);
@@ -49,7 +135,8 @@ uint16_t read_short(JpegDecompressor *d) {
 }
 
 int is_eof(JpegDecompressor *d) {
-  return ((d->file_index + d->cache_index) >= d->length);
+  // Whole bytes sitting in the bit buffer have been read ahead but not decoded yet
+  return ((d->file_index + d->cache_index - (d->bits_left >> 3)) >= d->length);
 }
 
 void skip_bytes(JpegDecompressor *d, int num_bytes) {
@@ -0,0 +1,556 @@
+#include <mram.h>
+#include <mutex.h>
+#include <sem.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dpu-jpeg.h"
+
+#define STANDARD_HUFFMAN_STORAGE __mram
+#include "jpeg-huffman-tables.h"
+
+// Index of a table that is used by the scan and still has to be loaded, between find_tables and take_tables
+#define LOAD_TABLE (NO_TABLE - 1)
+
+// Returned by take_tables when there is no room for the tables of a file until another file gives its tables back
+#define TABLES_BUSY (-1)
+
+/**
+ * Quantization and Huffman tables of the files being decoded, shared by all the tasklets
+ * An entry is used by as many files as its count of users. It keeps its table once they are done, until the entry is
+ * needed for another table, so that files with the same tables as a previous file neither read nor build them again
+ */
+QuantizationTable quant_tables[QUANT_TABLE_POOL_SIZE];
+HuffmanTable huffman_tables[HUFFMAN_TABLE_POOL_SIZE];
+static uint8_t quant_table_users[QUANT_TABLE_POOL_SIZE];
+static uint8_t huffman_table_users[HUFFMAN_TABLE_POOL_SIZE];
+static uint8_t quant_table_next; // entry looked at first for the next table to load, so the oldest one goes first
+static uint8_t huffman_table_next;
+
+// Built Huffman tables of the previous images, which outlive their entry in the pool
+__mram_noinit HuffmanTable huffman_cache[HUFFMAN_CACHE_ENTRIES];
+uint32_t huffman_cache_keys[HUFFMAN_CACHE_ENTRIES]; // fingerprint of each entry, 0 if it is empty
+static uint8_t huffman_cache_next;                  // entry replaced by the next table cached
+
+/**
+ * Held while entries of the pools are taken, published or given back. The tables of a file are compared with the
+ * entries and loaded into the entries it took without holding it, since both read the file from MRAM. Files that find
+ * no room for their tables wait for tables_released, which is given to every one of them whenever a file gives its
+ * tables back
+ */
+MUTEX_INIT(table_lock);
+SEMAPHORE_INIT(tables_released, 0);
+static int num_waiting;
+
+// Bumped to an odd number when an entry is taken for another table, and to an even one once that table is published,
+// so that a file that compared the entry meanwhile finds out
+static uint16_t quant_table_generation[QUANT_TABLE_POOL_SIZE];
+static uint16_t huffman_table_generation[HUFFMAN_TABLE_POOL_SIZE];
+
+// Held while the MRAM cache of built Huffman tables is looked up or written
+MUTEX_INIT(huffman_cache_lock);
+
+/**
+ * The entries a file compared its tables with, as they were under table_lock, and the tables it then had to load
+ * Entries that held no published table then are not compared
+ */
+typedef struct TableClaim {
+  uint16_t quant_generation[QUANT_TABLE_POOL_SIZE]; // generation of each entry, odd if it is not compared
+  uint16_t huffman_generation[HUFFMAN_TABLE_POOL_SIZE];
+  uint8_t load_quant;   // bit table_id for each quantization table that is loaded into the entry the file took
+  uint8_t load_huffman; // bit ac_table * MAX_HUFFMAN_TABLES + table_id for each Huffman table
+} TableClaim;
+
+static int check_tables(JpegInfo *info);
+static void note_generations(TableClaim *claim);
+static void find_tables(JpegDecompressor *d, TableClaim *claim);
+static int take_tables(JpegInfo *info, TableClaim *claim);
+static int load_tables(JpegDecompressor *d, TableClaim *claim);
+static void publish_tables(JpegInfo *info, TableClaim *claim);
+static void give_back_tables(JpegInfo *info);
+
+/**
+ * Take the shared tables used by the scan of the file being read, once all its markers are read and its scale is
+ * known. Tables already loaded for another file are shared with it, the others are read from where DQT and DHT found
+ * them. Waits for other files to give back their tables if there is no room left for them
+ */
+int acquire_tables(JpegDecompressor *d) {
+  JpegInfo *info = d->info;
+  int error = check_tables(info);
+  if (error) {
+    return error;
+  }
+
+  TableClaim claim;
+  mutex_lock(table_lock);
+  do {
+    note_generations(&claim);
+    mutex_unlock(table_lock);
+    find_tables(d, &claim);
+
+    mutex_lock(table_lock);
+    error = take_tables(info, &claim);
+    if (error == TABLES_BUSY) {
+      num_waiting++;
+      mutex_unlock(table_lock);
+      sem_take(&tables_released);
+      mutex_lock(table_lock);
+    }
+  } while (error == TABLES_BUSY);
+  mutex_unlock(table_lock);
+
+  error = load_tables(d, &claim);
+  if (error) {
+    release_tables(info);
+    return error;
+  }
+
+  mutex_lock(table_lock);
+  publish_tables(info, &claim);
+  mutex_unlock(table_lock);
+
+  return JPEG_VALID;
+}
+
+// Give back the shared tables of the file, once it is decoded or found to be invalid
+void release_tables(JpegInfo *info) {
+  mutex_lock(table_lock);
+  give_back_tables(info);
+  int waiting = num_waiting;
+  num_waiting = 0;
+  mutex_unlock(table_lock);
+
+  for (int i = 0; i < waiting; i++) {
+    sem_give(&tables_released);
+  }
+}
+
+// Every table used by the scan must have been defined, before the file waits for room for them
+static int check_tables(JpegInfo *info) {
+  for (int i = 0; i < info->num_color_components; i++) {
+    ColorComponentInfo *component = &info->color_components[i];
+    if (component->quant_table_id > 3 || info->quant_table_offset[component->quant_table_id] == 0) {
+      printf("Error: Invalid SOF - quantization table %d is not defined\n", component->quant_table_id);
+      return JPEG_INVALID_ERROR_CODE;
+    }
+    if (component->dc_huffman_table_id >= MAX_HUFFMAN_TABLES ||
+        info->huffman_table_offset[0][component->dc_huffman_table_id] == 0) {
+      printf("Error: Invalid SOS - DC Huffman table %d is not defined\n", component->dc_huffman_table_id);
+      return JPEG_INVALID_ERROR_CODE;
+    }
+    if (component->ac_huffman_table_id >= MAX_HUFFMAN_TABLES ||
+        info->huffman_table_offset[1][component->ac_huffman_table_id] == 0) {
+      printf("Error: Invalid SOS - AC Huffman table %d is not defined\n", component->ac_huffman_table_id);
+      return JPEG_INVALID_ERROR_CODE;
+    }
+  }
+  return JPEG_VALID;
+}
+
+// Next value of a quantization table, as DQT defines it
+static uint32_t read_quant_value(JpegDecompressor *d, int table_id) {
+  return d->info->quant_table_precision[table_id] == 0 ? read_byte(d) : read_short(d); // Qk
+}
+
+/**
+ * Value k of a quantization table as q_table keeps it: prescaled when the image is decoded at full size, so that
+ * decode_mcu dequantizes a coefficient and applies the ANN scale of the first pass of the inverse DCT with a single
+ * multiplication. The DC coefficient is left as it is, since it is still corrected by the DC offsets found when the
+ * tasklets synchronise
+ */
+static uint32_t kept_quant_value(QuantizationTable *q_table, uint32_t value, int k) {
+  return q_table->shift != 0 && k != 0 ? value * AAN_ROW_SCALE[k >> 3] : value;
+}
+
+static int same_quant_table(JpegDecompressor *d, int table_id, QuantizationTable *q_table) {
+  JpegInfo *info = d->info;
+  int full_size = q_table->shift != 0 || q_table->scale_rows;
+  if (!q_table->exists || full_size != (info->scale_shift == 0)) {
+    return 0;
+  }
+
+  seek_file_index(d, info->quant_table_offset[table_id]);
+  for (int i = 0; i < 64; i++) {
+    uint32_t value = read_quant_value(d, table_id);
+    if (kept_quant_value(q_table, value, ZIGZAG_ORDER[i]) != q_table->table[ZIGZAG_ORDER[i]]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// The values of a Huffman table are the same as the ones of table h_table, whose code counts are the same
+static int same_huffman_values(JpegDecompressor *d, uint32_t offset, HuffmanTable *h_table) {
+  seek_file_index(d, offset + 16);
+  for (int i = 0; i < h_table->valoffset[16]; i++) {
+    if (read_byte(d) != h_table->huffval[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Keep the generation of every entry that holds a table to compare with, and an odd one for the others. Requires
+// table_lock
+static void note_generations(TableClaim *claim) {
+  for (int entry = 0; entry < QUANT_TABLE_POOL_SIZE; entry++) {
+    uint16_t generation = quant_table_generation[entry];
+    claim->quant_generation[entry] = quant_tables[entry].exists && !(generation & 1) ? generation : 1;
+  }
+  for (int entry = 0; entry < HUFFMAN_TABLE_POOL_SIZE; entry++) {
+    uint16_t generation = huffman_table_generation[entry];
+    claim->huffman_generation[entry] = huffman_tables[entry].exists && !(generation & 1) ? generation : 1;
+  }
+}
+
+// Look for an entry that held quantization table table_id of the file when the generations were noted
+static int find_quant_table(JpegDecompressor *d, int table_id, TableClaim *claim) {
+  for (int entry = 0; entry < QUANT_TABLE_POOL_SIZE; entry++) {
+    if (!(claim->quant_generation[entry] & 1) && same_quant_table(d, table_id, &quant_tables[entry])) {
+      return entry;
+    }
+  }
+  return LOAD_TABLE;
+}
+
+// Same as find_quant_table for the DC (ac_table 0) or AC (ac_table 1) Huffman table table_id of the file
+static int find_huffman_table(JpegDecompressor *d, int ac_table, int table_id, TableClaim *claim) {
+  JpegInfo *info = d->info;
+
+  // The code counts rule out most tables without reading their values
+  uint8_t valoffset[17];
+  uint32_t offset = info->huffman_table_offset[ac_table][table_id];
+  seek_file_index(d, offset);
+  valoffset[0] = 0;
+  for (int i = 1; i <= 16; i++) {
+    valoffset[i] = valoffset[i - 1] + read_byte(d); // Li
+  }
+
+  for (int entry = 0; entry < HUFFMAN_TABLE_POOL_SIZE; entry++) {
+    HuffmanTable *h_table = &huffman_tables[entry];
+    if (!(claim->huffman_generation[entry] & 1) && memcmp(h_table->valoffset, valoffset, sizeof(valoffset)) == 0 &&
+        same_huffman_values(d, offset, h_table)) {
+      return entry;
+    }
+  }
+  return LOAD_TABLE;
+}
+
+/**
+ * Compare every table used by the scan of the file with the entries of the pools, without holding table_lock
+ * Leaves the entry holding each table in the table indexes of the file, or LOAD_TABLE
+ */
+static void find_tables(JpegDecompressor *d, TableClaim *claim) {
+  JpegInfo *info = d->info;
+  for (int i = 0; i < info->num_color_components; i++) {
+    ColorComponentInfo *component = &info->color_components[i];
+    uint8_t *index = &info->quant_table_index[component->quant_table_id];
+    if (*index == NO_TABLE) {
+      *index = find_quant_table(d, component->quant_table_id, claim);
+    }
+    index = &info->huffman_table_index[0][component->dc_huffman_table_id];
+    if (*index == NO_TABLE) {
+      *index = find_huffman_table(d, 0, component->dc_huffman_table_id, claim);
+    }
+    index = &info->huffman_table_index[1][component->ac_huffman_table_id];
+    if (*index == NO_TABLE) {
+      *index = find_huffman_table(d, 1, component->ac_huffman_table_id, claim);
+    }
+  }
+}
+
+static int free_entries(uint8_t *users, int num_entries) {
+  int count = 0;
+  for (int entry = 0; entry < num_entries; entry++) {
+    count += users[entry] == 0;
+  }
+  return count;
+}
+
+// Take the next entry that no file uses, starting from *next, and bump its generation to an odd one until it is loaded
+static int take_free_entry(uint8_t *users, uint16_t *generations, int num_entries, uint8_t *next) {
+  for (int i = 0; i < num_entries; i++) {
+    int entry = (*next + i) % num_entries;
+    if (users[entry] == 0) {
+      users[entry]++;
+      generations[entry] = (generations[entry] + 1) | 1;
+      *next = (entry + 1) % num_entries;
+      return entry;
+    }
+  }
+  return NO_TABLE;
+}
+
+/**
+ * Share the entries found for the tables of the file, unless they were taken for other tables since, and take a free
+ * entry for each of the other tables. All in one go, so that files that wait for room never hold entries that others
+ * wait for. Requires table_lock
+ */
+static int take_tables(JpegInfo *info, TableClaim *claim) {
+  int missing_quant = 0;
+  int missing_huffman = 0;
+  for (int table_id = 0; table_id < 4; table_id++) {
+    uint8_t *index = &info->quant_table_index[table_id];
+    if (*index < QUANT_TABLE_POOL_SIZE) {
+      if (quant_table_generation[*index] == claim->quant_generation[*index]) {
+        quant_table_users[*index]++;
+      } else {
+        *index = LOAD_TABLE;
+      }
+    }
+    missing_quant += *index == LOAD_TABLE;
+  }
+  for (int ac_table = 0; ac_table < 2; ac_table++) {
+    for (int table_id = 0; table_id < MAX_HUFFMAN_TABLES; table_id++) {
+      uint8_t *index = &info->huffman_table_index[ac_table][table_id];
+      if (*index < HUFFMAN_TABLE_POOL_SIZE) {
+        if (huffman_table_generation[*index] == claim->huffman_generation[*index]) {
+          huffman_table_users[*index]++;
+        } else {
+          *index = LOAD_TABLE;
+        }
+      }
+      missing_huffman += *index == LOAD_TABLE;
+    }
+  }
+
+  if (free_entries(quant_table_users, QUANT_TABLE_POOL_SIZE) < missing_quant ||
+      free_entries(huffman_table_users, HUFFMAN_TABLE_POOL_SIZE) < missing_huffman) {
+    give_back_tables(info);
+    return TABLES_BUSY;
+  }
+
+  claim->load_quant = 0;
+  claim->load_huffman = 0;
+  for (int table_id = 0; table_id < 4; table_id++) {
+    uint8_t *index = &info->quant_table_index[table_id];
+    if (*index == LOAD_TABLE) {
+      *index = take_free_entry(quant_table_users, quant_table_generation, QUANT_TABLE_POOL_SIZE, &quant_table_next);
+      claim->load_quant |= 1 << table_id;
+    }
+  }
+  for (int ac_table = 0; ac_table < 2; ac_table++) {
+    for (int table_id = 0; table_id < MAX_HUFFMAN_TABLES; table_id++) {
+      uint8_t *index = &info->huffman_table_index[ac_table][table_id];
+      if (*index == LOAD_TABLE) {
+        *index = take_free_entry(huffman_table_users, huffman_table_generation, HUFFMAN_TABLE_POOL_SIZE,
+                                 &huffman_table_next);
+        claim->load_huffman |= 1 << (ac_table * MAX_HUFFMAN_TABLES + table_id);
+      }
+    }
+  }
+  return JPEG_VALID;
+}
+
+// Page 39: Section B.2.4.1
+static void load_quant_table(JpegDecompressor *d, int table_id) {
+  JpegInfo *info = d->info;
+  QuantizationTable *q_table = &quant_tables[info->quant_table_index[table_id]];
+
+  q_table->shift = 0;
+  q_table->scale_rows = 0;
+  seek_file_index(d, info->quant_table_offset[table_id]);
+  for (int i = 0; i < 64; i++) {
+    q_table->table[ZIGZAG_ORDER[i]] = read_quant_value(d, table_id);
+  }
+
+  if (info->scale_shift == 0) {
+    // Large 16 bit values may not fit once prescaled, then decode_mcu applies the ANN scale of the rows instead
+    for (int k = 1; k < 64; k++) {
+      if (q_table->table[k] * AAN_ROW_SCALE[k >> 3] > UINT16_MAX) {
+        q_table->scale_rows = 1;
+      }
+    }
+    if (!q_table->scale_rows) {
+      for (int k = 1; k < 64; k++) {
+        q_table->table[k] *= AAN_ROW_SCALE[k >> 3];
+      }
+      q_table->shift = AAN_ROW_SCALE_BITS;
+    }
+  }
+}
+
+static int generate_lookup(HuffmanTable *h_table);
+static void use_standard_table(HuffmanTable *h_table, uint8_t ac_table);
+static void use_cached_table(HuffmanTable *h_table);
+
+// Page 40: Section B.2.4.2
+static int load_huffman_table(JpegDecompressor *d, int ac_table, int table_id) {
+  JpegInfo *info = d->info;
+  HuffmanTable *h_table = &huffman_tables[info->huffman_table_index[ac_table][table_id]];
+
+  seek_file_index(d, info->huffman_table_offset[ac_table][table_id]);
+  h_table->valoffset[0] = 0;
+  for (int i = 1; i <= 16; i++) {
+    h_table->valoffset[i] = h_table->valoffset[i - 1] + read_byte(d); // Li
+  }
+  for (int i = 0; i < h_table->valoffset[16]; i++) {
+    h_table->huffval[i] = read_byte(d); // Vij
+  }
+
+  h_table->built = 0;
+  use_standard_table(h_table, ac_table);
+  if (!h_table->built) {
+    use_cached_table(h_table);
+  }
+  if (!h_table->built) {
+    return generate_lookup(h_table);
+  }
+  return JPEG_VALID;
+}
+
+// Read and build the tables the file took entries for, which no other file looks at until they are published
+static int load_tables(JpegDecompressor *d, TableClaim *claim) {
+  for (int table_id = 0; table_id < 4; table_id++) {
+    if (claim->load_quant & (1 << table_id)) {
+      load_quant_table(d, table_id);
+    }
+  }
+  for (int ac_table = 0; ac_table < 2; ac_table++) {
+    for (int table_id = 0; table_id < MAX_HUFFMAN_TABLES; table_id++) {
+      if (claim->load_huffman & (1 << (ac_table * MAX_HUFFMAN_TABLES + table_id))) {
+        int error = load_huffman_table(d, ac_table, table_id);
+        if (error) {
+          return error;
+        }
+      }
+    }
+  }
+  return JPEG_VALID;
+}
+
+// Let other files share the tables the file loaded, with an even generation. Requires table_lock
+static void publish_tables(JpegInfo *info, TableClaim *claim) {
+  for (int table_id = 0; table_id < 4; table_id++) {
+    if (claim->load_quant & (1 << table_id)) {
+      int entry = info->quant_table_index[table_id];
+      quant_tables[entry].exists = 1;
+      quant_table_generation[entry]++;
+    }
+  }
+  for (int ac_table = 0; ac_table < 2; ac_table++) {
+    for (int table_id = 0; table_id < MAX_HUFFMAN_TABLES; table_id++) {
+      if (claim->load_huffman & (1 << (ac_table * MAX_HUFFMAN_TABLES + table_id))) {
+        int entry = info->huffman_table_index[ac_table][table_id];
+        huffman_tables[entry].exists = 1;
+        huffman_table_generation[entry]++;
+      }
+    }
+  }
+}
+
+// Requires table_lock
+static void give_back_tables(JpegInfo *info) {
+  for (int table_id = 0; table_id < 4; table_id++) {
+    uint8_t *index = &info->quant_table_index[table_id];
+    if (*index < QUANT_TABLE_POOL_SIZE) {
+      quant_table_users[*index]--;
+    }
+    *index = NO_TABLE;
+  }
+  for (int ac_table = 0; ac_table < 2; ac_table++) {
+    for (int table_id = 0; table_id < MAX_HUFFMAN_TABLES; table_id++) {
+      uint8_t *index = &info->huffman_table_index[ac_table][table_id];
+      if (*index < HUFFMAN_TABLE_POOL_SIZE) {
+        huffman_table_users[*index]--;
+      }
+      *index = NO_TABLE;
+    }
+  }
+}
+
+static void cache_huffman_table(HuffmanTable *h_table);
+
+static int generate_lookup(HuffmanTable *h_table) {
+  memset(h_table->lookup, 0, sizeof(h_table->lookup));
+
+  uint32_t code = 0;
+  for (int length = 1; length <= 16; length++) {
+    int first = h_table->valoffset[length - 1];
+    int last = h_table->valoffset[length];
+    // Codes made of 1 bits only are not allowed, which also keeps the end of the codes within 16 bits
+    if (code + (last - first) >= (1U << length)) {
+      printf("Error: Invalid DHT - too many codes of length %d\n", length);
+      return JPEG_INVALID_ERROR_CODE;
+    }
+
+    h_table->valptr[length] = first - code;
+    for (int j = first; j < last; j++) {
+      if (length <= HUFF_LOOKAHEAD) {
+        // Every bit pattern starting with this code resolves to the same value
+        int shift = HUFF_LOOKAHEAD - length;
+        for (int k = 0; k < (1 << shift); k++) {
+          h_table->lookup[(code << shift) | k] = (length << 8) | h_table->huffval[j];
+        }
+      }
+      code++;
+    }
+    h_table->code_end[length] = code;
+    code <<= 1;
+  }
+  h_table->built = 1;
+  cache_huffman_table(h_table);
+
+  return JPEG_VALID;
+}
+
+// The start of a table, up to its derived decoding tables, in whole MRAM words
+#define TABLE_PREFIX_SIZE ((offsetof(HuffmanTable, code_end) + 7) & ~7)
+
+/**
+ * Replace a table by a built table from MRAM if both have the same code counts and values
+ * The start of the other table is read into the lookup table to compare them, which is about to be replaced or
+ * rebuilt anyway
+ */
+static int use_same_table(HuffmanTable *h_table, __mram_ptr HuffmanTable *other) {
+  uint8_t *prefix = (uint8_t *) h_table->lookup;
+  mram_read(other, prefix, TABLE_PREFIX_SIZE);
+  if (memcmp(&prefix[offsetof(HuffmanTable, valoffset)], h_table->valoffset, 17) != 0 ||
+      memcmp(&prefix[offsetof(HuffmanTable, huffval)], h_table->huffval, h_table->valoffset[16]) != 0) {
+    return 0;
+  }
+
+  mram_read(other, h_table, sizeof(HuffmanTable));
+  return 1;
+}
+
+// Replace a table by the prebuilt copy of the standard table of the same class it is byte-identical to, if any
+static void use_standard_table(HuffmanTable *h_table, uint8_t ac_table) {
+#ifdef NUM_STANDARD_HUFFMAN_TABLES
+  for (int i = ac_table ? 1 : 0; i < NUM_STANDARD_HUFFMAN_TABLES; i += 2) {
+    if (use_same_table(h_table, &standard_huffman_tables[i])) {
+      return;
+    }
+  }
+#endif
+}
+
+// Replace a table by the same table built for a previous image, if it is still cached
+static void use_cached_table(HuffmanTable *h_table) {
+  uint32_t fingerprint = huffman_fingerprint(h_table);
+
+  mutex_lock(huffman_cache_lock);
+  for (int i = 0; i < HUFFMAN_CACHE_ENTRIES; i++) {
+    if (huffman_cache_keys[i] == fingerprint && use_same_table(h_table, &huffman_cache[i])) {
+      mutex_unlock(huffman_cache_lock);
+      return;
+    }
+  }
+  mutex_unlock(huffman_cache_lock);
+  h_table->fingerprint = fingerprint;
+}
+
+/**
+ * Keep a table that was just built for the next images, in place of the oldest cached table
+ * Only called for tables that were not found in the cache
+ */
+static void cache_huffman_table(HuffmanTable *h_table) {
+  mutex_lock(huffman_cache_lock);
+  int entry = huffman_cache_next;
+
+  mram_write(h_table, &huffman_cache[entry], sizeof(HuffmanTable));
+  huffman_cache_keys[entry] = h_table->fingerprint;
+  huffman_cache_next = entry + 1 < HUFFMAN_CACHE_ENTRIES ? entry + 1 : 0;
+  mutex_unlock(huffman_cache_lock);
+}
@@ -10,143 +10,161 @@
 #define CLOCK_CYCLES_PER_MS (800000 / 3) /* 800MHz / 3 */
 
 __host dpu_inputs_t input;
-__host dpu_output_t output;
+dpu_output_t output[NR_FILE_TASKLETS]; // record of the file each file tasklet decodes
+__mram_noinit dpu_output_t outputs[MAX_FILES_PER_DPU]; // one record for each entry of the file table
+static int decode_file; // whether the current file got past start_file, only written by tasklet 0
+static int host_split;  // whether the host found the split points of the current file, only written by tasklet 0
 extern short MCU_buffer[NR_TASKLETS][MAX_DECODED_DATA_SIZE / 2 / NR_TASKLETS];
 
-JpegInfo jpegInfo;
+// The first one is shared by all the tasklets, unless they decode files of their own
+JpegInfo jpegInfos[NR_FILE_TASKLETS];
 JpegInfoDpu jpegInfoDpu;
 
+_Static_assert(WRAM_DATA_SIZE + NR_TASKLETS * STACK_SIZE_DEFAULT <= WRAM_SIZE,
+               "The WRAM buffers and the tasklet stacks do not fit in WRAM, see make wram-budget");
+
+BARRIER_INIT(tables_barrier, NR_TASKLETS);
 BARRIER_INIT(init_barrier, NR_TASKLETS);
 BARRIER_INIT(idct_barrier, NR_TASKLETS);
 BARRIER_INIT(prep0_barrier, NR_TASKLETS);
+BARRIER_INIT(restart_barrier, NR_TASKLETS);
+BARRIER_INIT(sync_barrier, NR_TASKLETS);
 
 #if DEBUG
-static void print_jpeg_decompressor() {
+static void print_jpeg_decompressor(JpegInfo *info) {
   printf("\n********** DQT **********\n");
   for (int i = 0; i < 4; i++) {
-    if (jpegInfo.quant_tables[i].exists) {
+    if (info->quant_table_index[i] != NO_TABLE) {
+      QuantizationTable *q_table = &quant_tables[info->quant_table_index[i]];
       printf("Table ID: %d", i);
       for (int j = 0; j < 64; j++) {
         if (j % 8 == 0) {
           printf("\n");
         }
-        printf("%d ", jpegInfo.quant_tables[i].table[j]);
+        printf("%d ", q_table->table[j]);
       }
       printf("\n\n");
     }
   }
 
   printf("********** DRI **********\n");
-  printf("Restart Interval: %d\n", jpegInfo.restart_interval);
+  printf("Restart Interval: %d\n", info->restart_interval);
 
   printf("\n********** SOF **********\n");
-  printf("Width: %d\n", jpegInfo.image_width);
-  printf("Height: %d\n", jpegInfo.image_height);
-  printf("Number of color components: %d\n\n", jpegInfo.num_color_components);
-  for (int i = 0; i < jpegInfo.num_color_components; i++) {
-    printf("Component ID: %d\n", jpegInfo.color_components[i].component_id);
-    printf("H-samp factor: %d\n", jpegInfo.color_components[i].h_samp_factor);
-    printf("V-samp factor: %d\n", jpegInfo.color_components[i].v_samp_factor);
-    printf("Quantization table ID: %d\n\n", jpegInfo.color_components[i].quant_table_id);
+  printf("Width: %d\n", info->image_width);
+  printf("Height: %d\n", info->image_height);
+  printf("Number of color components: %d\n\n", info->num_color_components);
+  for (int i = 0; i < info->num_color_components; i++) {
+    printf("Component ID: %d\n", info->color_components[i].component_id);
+    printf("H-samp factor: %d\n", info->color_components[i].h_samp_factor);
+    printf("V-samp factor: %d\n", info->color_components[i].v_samp_factor);
+    printf("Quantization table ID: %d\n\n", info->color_components[i].quant_table_id);
   }
 
   printf("\n********** DHT **********\n");
-  for (int i = 0; i < MAX_HUFFMAN_TABLES; i++) {
-    if (jpegInfo.dc_huffman_tables[i].exists) {
-      printf("DC Table ID: %d\n", i);
-      for (int j = 0; j < 16; j++) {
-        printf("%d: ", j + 1);
-        for (int k = jpegInfo.dc_huffman_tables[i].valoffset[j]; k < jpegInfo.dc_huffman_tables[i].valoffset[j + 1];
-             k++) {
-          printf("%d ", jpegInfo.dc_huffman_tables[i].huffval[k]);
-        }
-        printf("\n");
-      }
-      printf("\n");
-    }
-  }
-  for (int i = 0; i < MAX_HUFFMAN_TABLES; i++) {
-    if (jpegInfo.ac_huffman_tables[i].exists) {
-      printf("AC Table ID: %d\n", i);
-      for (int j = 0; j < 16; j++) {
-        printf("%d: ", j + 1);
-        for (int k = jpegInfo.ac_huffman_tables[i].valoffset[j]; k < jpegInfo.ac_huffman_tables[i].valoffset[j + 1];
-             k++) {
-          printf("%d ", jpegInfo.ac_huffman_tables[i].huffval[k]);
+  for (int ac_table = 0; ac_table < 2; ac_table++) {
+    for (int i = 0; i < MAX_HUFFMAN_TABLES; i++) {
+      if (info->huffman_table_index[ac_table][i] != NO_TABLE) {
+        HuffmanTable *h_table = &huffman_tables[info->huffman_table_index[ac_table][i]];
+        printf("%s Table ID: %d\n", ac_table ? "AC" : "DC", i);
+        for (int j = 0; j < 16; j++) {
+          printf("%d: ", j + 1);
+          for (int k = h_table->valoffset[j]; k < h_table->valoffset[j + 1]; k++) {
+            printf("%d ", h_table->huffval[k]);
+          }
+          printf("\n");
         }
         printf("\n");
       }
-      printf("\n");
     }
   }
 
   printf("\n********** SOS **********\n");
-  for (int i = 0; i < jpegInfo.num_color_components; i++) {
-    printf("Component ID: %d\n", jpegInfo.color_components[i].component_id);
-    printf("DC table ID: %d\n", jpegInfo.color_components[i].dc_huffman_table_id);
-    printf("AC table ID: %d\n\n", jpegInfo.color_components[i].ac_huffman_table_id);
+  for (int i = 0; i < info->num_color_components; i++) {
+    printf("Component ID: %d\n", info->color_components[i].component_id);
+    printf("DC table ID: %d\n", info->color_components[i].dc_huffman_table_id);
+    printf("AC table ID: %d\n\n", info->color_components[i].ac_huffman_table_id);
   }
-  printf("Start of selection: %d\n", jpegInfo.ss);
-  printf("End of selection: %d\n", jpegInfo.se);
-  printf("Successive approximation high: %d\n", jpegInfo.Ah);
-  printf("Successive approximation low: %d\n\n", jpegInfo.Al);
+  printf("Start of selection: %d\n", info->ss);
+  printf("End of selection: %d\n", info->se);
+  printf("Successive approximation high: %d\n", info->Ah);
+  printf("Successive approximation low: %d\n\n", info->Al);
 
   printf("\n********** BMP **********\n");
-  printf("MCU width: %d\n", jpegInfo.mcu_width);
-  printf("MCU height: %d\n", jpegInfo.mcu_height);
-  printf("BMP padding: %d\n", jpegInfo.padding);
+  printf("MCU width: %d\n", info->mcu_width);
+  printf("MCU height: %d\n", info->mcu_height);
+  printf("BMP padding: %d\n", info->padding);
 }
 #endif
 
-static void init_jpeg_info() {
-  jpegInfo.valid = 1;
+static void init_jpeg_info(JpegInfo *info) {
+  info->valid = 1;
 
   for (int i = 0; i < 4; i++) {
-    jpegInfo.quant_tables[i].exists = 0;
-
-    if (i < 2) {
-      jpegInfo.color_components[i].exists = 0;
-      jpegInfo.dc_huffman_tables[i].exists = 0;
-      jpegInfo.ac_huffman_tables[i].exists = 0;
-
-    } else if (i < 3) {
-      jpegInfo.color_components[i].exists = 0;
+    info->quant_table_offset[i] = 0;
+    info->quant_table_index[i] = NO_TABLE;
+
+    if (i < MAX_HUFFMAN_TABLES) {
+      info->huffman_table_offset[0][i] = 0;
+      info->huffman_table_offset[1][i] = 0;
+      info->huffman_table_index[0][i] = NO_TABLE;
+      info->huffman_table_index[1][i] = NO_TABLE;
+    }
+    if (i < 3) {
+      info->color_components[i].exists = 0;
     }
   }
 
-  jpegInfo.restart_interval = 0;
-  jpegInfo.image_height = 0;
-  jpegInfo.image_width = 0;
-  jpegInfo.num_color_components = 0;
-  jpegInfo.ss = 0;
-  jpegInfo.se = 0;
-  jpegInfo.Ah = 0;
-  jpegInfo.Al = 0;
-
-  jpegInfo.mcu_width = 0;
-  jpegInfo.mcu_height = 0;
-  jpegInfo.padding = 0;
+  info->restart_interval = 0;
+  info->image_height = 0;
+  info->image_width = 0;
+  info->num_color_components = 0;
+  info->ss = 0;
+  info->se = 0;
+  info->Ah = 0;
+  info->Al = 0;
+
+  info->mcu_width = 0;
+  info->mcu_height = 0;
+  info->padding = 0;
+  info->scale_shift = 0;
+  info->num_planes = 0;
+}
 
+// State shared by the tasklets that decode the same file
+static void init_jpeg_info_dpu() {
   for (int i = 0; i < NR_TASKLETS; i++) {
     jpegInfoDpu.mcu_end_index[i] = 0;
     jpegInfoDpu.mcu_start_index[i] = 0;
+
+    // Until the tasklets synchronise, the image is all in MCU_buffer[0]
+    jpegInfoDpu.segment_first[i] = 0;
+    jpegInfoDpu.segment_dest[i] = i == 0 ? 0 : UINT32_MAX;
+    jpegInfoDpu.segment_dc_offset[i][0] = 0;
+    jpegInfoDpu.segment_dc_offset[i][1] = 0;
+    jpegInfoDpu.segment_dc_offset[i][2] = 0;
     if (i < NR_TASKLETS - 1) {
       jpegInfoDpu.dc_offset[i][0] = 0;
       jpegInfoDpu.dc_offset[i][1] = 0;
       jpegInfoDpu.dc_offset[i][2] = 0;
     }
-  }
 
-  for (int i = 0; i < 3; i++) {
-    jpegInfoDpu.sum_rgb[i] = 0;
+    // Until a decoding tasklet of the pipelined kernel says otherwise, none of the image is decoded
+    jpegInfoDpu.decode_first[i] = 0;
+    jpegInfoDpu.decode_end[i] = i < PIPELINE_DECODE_TASKLETS ? UINT32_MAX : 0;
+    jpegInfoDpu.decoded_mcu[i] = 0;
   }
+
+  // None of the MCU rows is claimed yet
+  jpegInfoDpu.next_row = 0;
 }
 
-static int read_all_markers(JpegDecompressor *d) {
+static int read_all_markers(JpegDecompressor *d, uint32_t file) {
+  JpegInfo *info = d->info;
   int result = 1;
 
-  init_file_reader_index(d);
-  init_jpeg_info();
+  init_jpeg_info(info);
+  select_file(d, file);
 
   int not_jpeg = check_start_of_image(d);
   if (not_jpeg) {
@@ -154,126 +172,289 @@ static int read_all_markers(JpegDecompressor *d) {
   }
 
   // Continuously read all markers until we reach Huffman coded bitstream
-  while (jpegInfo.valid && result) {
+  while (info->valid && result) {
     result = read_next_marker(d);
   }
 
-  if (!jpegInfo.valid) {
+  if (!info->valid) {
     return 1;
   }
 
-  jpegInfo.image_data_start = d->file_index + d->cache_index;
-  jpegInfo.size_per_tasklet = (jpegInfo.length - jpegInfo.image_data_start + (NR_TASKLETS - 1)) / NR_TASKLETS;
-
-  output.width = jpegInfo.image_width;
-  output.height = jpegInfo.image_height;
-  output.padding = jpegInfo.padding;
-  output.mcu_width_real = jpegInfo.mcu_width_real;
-
-	int color_index = jpegInfo.num_color_components - 1;
-	output.length = sizeof(short) *
-	(((jpegInfo.mcu_height + jpegInfo.color_components[color_index].v_samp_factor) * jpegInfo.mcu_width_real + (jpegInfo.mcu_width + jpegInfo.color_components[color_index].h_samp_factor)) * jpegInfo.num_color_components) << 6;
+  info->image_data_start = d->file_index + d->cache_index;
+  info->size_per_tasklet = (info->length - info->image_data_start + (NR_TASKLETS - 1)) / NR_TASKLETS;
+  info->scale_shift = select_scale_shift(info->image_width, input.scale_width);
+  info->num_planes =
+      (info->num_color_components == 1 || (input.flags & (1 << OPTION_FLAG_LUMA_ONLY))) ? 1 : 3;
+  if (acquire_tables(d) != JPEG_VALID) {
+    info->valid = 0;
+    return 1;
+  }
 
 #if DEBUG
-  //print_jpeg_decompressor();
+  //print_jpeg_decompressor(info);
 #endif
 
   return 0;
 }
 
-static int round_down_to_nearest_multiple(int to_align, int multiple) {
-  while (multiple < to_align && (multiple << 1) <= to_align) {
-    multiple <<= 1;
+// Block positions of the decoded image, including those only used as padding by the colour conversion
+static uint32_t block_positions(JpegInfo *info) {
+  int color_index = info->num_color_components - 1;
+  return (info->mcu_height + info->color_components[color_index].v_samp_factor) * info->mcu_width_real +
+         (info->mcu_width + info->color_components[color_index].h_samp_factor);
+}
+
+// Bytes taken by the decoded image in MCU_buffer
+static uint32_t image_length(JpegInfo *info) {
+  if (input.flags & (1 << OPTION_FLAG_RASTER_OUTPUT)) {
+    return RASTER_ROW_STRIDE(SCALED_SIZE(info->image_width, info->scale_shift), info->num_planes) *
+           SCALED_SIZE(info->image_height, info->scale_shift);
   }
-  return multiple;
+  // Every block position holds num_planes colour components of a byte once converted
+  return block_positions(info) * BLOCK_POSITION_SIZE(8 >> info->scale_shift, info->num_planes);
+}
+
+// Bytes taken by the full size coefficients of the image in MCU_buffer, while it is being decoded
+static uint32_t coefficient_length(JpegInfo *info) {
+  return sizeof(short) * block_positions(info) * BLOCK_POSITION_SIZE(8, info->num_planes);
+}
+
+/**
+ * The coefficients are decoded after the space kept for the image, which is smaller than they are, so that writing
+ * converted blocks cannot overwrite coefficients that are still to be converted
+ */
+static void place_coefficients(JpegInfo *info) {
+  info->coefficient_offset = info->image_offset + ALIGN(image_length(info), 8) / sizeof(short);
 }
 
-static void crop_and_scale(JpegDecompressor *d) {
-  uint16_t aligned_width = round_down_to_nearest_multiple(jpegInfo.image_width, input.scale_width);
-  uint16_t aligned_height = round_down_to_nearest_multiple(jpegInfo.image_height, input.scale_width);
+/**
+ * Read the markers of the next file and make room for its image after the images decoded so far
+ * Leaves info->valid cleared if the file cannot be decoded
+ */
+static void start_file(JpegDecompressor *d, uint32_t file) {
+	JpegInfo *info = d->info;
+	memset(file_record(info), 0, sizeof(dpu_output_t));
+	init_jpeg_info_dpu();
+
+	dbg_printf("[:%u] reading markers of file %u\n", d->tasklet_id, file);
+	int error = read_all_markers(d, file);
+#ifdef STATISTICS
+	file_record(info)->cycles_read_markers = perfcounter_get();
+	printf("read markers in %u cycles\n", file_record(info)->cycles_read_markers);
+#endif // STATISTICS
+
+	if (error)
+	{
+		info->valid = 0;
+		return;
+	}
 
-  uint16_t new_width = aligned_height < aligned_width ? aligned_height : aligned_width;
+	// Split points found by the host spare the tasklets from finding where to start decoding
+	host_split = (input.flags & (1 << OPTION_FLAG_HOST_SPLIT)) && read_host_splits(file);
 
-  int start_x = (jpegInfo.image_width - new_width) >> 1;
-  int start_y = (jpegInfo.image_height - new_width) >> 1;
-  start_x = ALIGN(start_x, 8);
-  start_y = ALIGN(start_y, 8);
+	place_coefficients(info);
+	uint32_t used_space = info->coefficient_offset * sizeof(short);
+	uint32_t free_space = used_space < sizeof(MCU_buffer) ? sizeof(MCU_buffer) - used_space : 0;
+	if (coefficient_length(info) > free_space)
+	{
+		printf("Decoded image would be too large (%u vs %u)\n", coefficient_length(info), free_space);
+		info->valid = 0;
+		return;
+	}
 
-  crop(d, start_x, start_y, new_width, new_width);
+	// Keep every tasklet's share 8 byte aligned for DMA
+	info->tasklet_buffer_size = (free_space / sizeof(short) / NR_TASKLETS) & ~3;
 
-  int scale_factor = new_width / input.scale_width;
-  if (scale_factor != 1) {
-    jpeg_scale(d, scale_factor, scale_factor);
-  }
+	// Without restart intervals or split points from the host every tasklet may write the whole image to its share.
+	// The first file is attempted anyway, later ones are skipped rather than overrun the end of MCU_buffer
+	if (file > 0 && info->restart_interval == 0 && !host_split &&
+		coefficient_length(info) > info->tasklet_buffer_size * sizeof(short))
+	{
+		printf("Not enough space left to decode file %u\n", file);
+		info->valid = 0;
+	}
+}
+
+/**
+ * Publish the record of a decoded file and keep its image where it is
+ */
+static void finish_file(JpegInfo *info, uint32_t file) {
+	dpu_output_t *record = file_record(info);
+	record->width = SCALED_SIZE(info->image_width, info->scale_shift);
+	record->height = SCALED_SIZE(info->image_height, info->scale_shift);
+	record->padding = RASTER_ROW_STRIDE(record->width, info->num_planes) - record->width * info->num_planes;
+	record->mcu_width_real = info->mcu_width_real;
+	record->block_size = 8 >> info->scale_shift;
+	record->num_planes = info->num_planes;
+	record->row_stride =
+		(input.flags & (1 << OPTION_FLAG_RASTER_OUTPUT)) ? RASTER_ROW_STRIDE(record->width, info->num_planes) : 0;
+	record->bottom_up = (input.flags & (1 << OPTION_FLAG_BOTTOM_UP)) != 0;
+	record->length = info->valid ? image_length(info) : 0;
+	record->offset = info->image_offset * sizeof(short);
+	mram_write(record, &outputs[file], sizeof(dpu_output_t));
+
+	info->image_offset += ALIGN(record->length, 8) / sizeof(short);
+	release_tables(info);
+}
+
+/**
+ * Decode files me(), me() + NR_FILE_TASKLETS, ... one after the other, without help from the other tasklets
+ * Their images are packed into this tasklet's own part of MCU_buffer
+ */
+static void decode_own_files(JpegDecompressor *d) {
+	uint32_t region_size = FILE_TASKLET_REGION_SIZE / sizeof(short);
+	uint32_t region_end = region_size * (me() + 1);
+	JpegInfo *info = &jpegInfos[me()];
+	info->image_offset = region_size * me();
+	info->tasklet_buffer_size = 0;
+
+	for (uint32_t file = me(); file < input.file_count; file += NR_FILE_TASKLETS)
+	{
+		memset(file_record(info), 0, sizeof(dpu_output_t));
+		memset(d, 0, sizeof(JpegDecompressor));
+		d->tasklet_id = me();
+		d->info = info;
+#ifdef STATISTICS
+		// The files of a tasklet follow one another, so their cycles are counted from when each one starts
+		uint32_t start = perfcounter_get();
+#endif // STATISTICS
 
-  output.width = jpegInfo.image_width;
-  output.height = jpegInfo.image_height;
-  output.mcu_width_real = jpegInfo.mcu_width_real;
+		int error = read_all_markers(d, file);
+#ifdef STATISTICS
+		file_record(info)->cycles_read_markers = perfcounter_get() - start;
+#endif // STATISTICS
+
+		if (error)
+		{
+			info->valid = 0;
+		}
+		else
+		{
+			place_coefficients(info);
+			if (info->coefficient_offset > region_end ||
+				coefficient_length(info) > (region_end - info->coefficient_offset) * sizeof(short))
+			{
+				printf("Not enough space left to decode file %u\n", file);
+				info->valid = 0;
+			}
+		}
+
+		if (info->valid)
+			decode_whole_file(d);
+
+#ifdef STATISTICS
+		file_record(info)->cycles_total = perfcounter_get() - start;
+#endif // STATISTICS
+		finish_file(info, file);
+	}
 }
 
 int main()
 {
 	JpegDecompressor decompressor;
+	JpegInfo *info = &jpegInfos[0];
 
 #ifdef STATISTICS
 	// start the performance counter
 	perfcounter_config(COUNT_CYCLES, true);
 #endif // STATISTICS
 
-	memset(&decompressor, 0, sizeof(JpegDecompressor));
-	jpegInfo.length = decompressor.length = input.file_length;
-	decompressor.tasklet_id = me();
+	// Every tasklet fills its share of the colour conversion tables, before any of them converts a pixel
+	fill_color_tables(&color_tables, me(), NR_TASKLETS);
+	barrier_wait(&tables_barrier);
 
-	dbg_printf("[:%u] Got input file length: %u\n", decompressor.tasklet_id, input.file_length);
-
-	if (decompressor.tasklet_id == 0)
-	{
-		dbg_printf("[:%u] reading markers\n", decompressor.tasklet_id);
-		int error = read_all_markers(&decompressor);
-#ifdef STATISTICS
-		output.cycles_read_markers = perfcounter_get();
-		printf("read markers in %u cycles\n", output.cycles_read_markers);
-#endif // STATISTICS
-	
-		if (error)
-			return error;
-	}
-
-	if (output.length > sizeof(MCU_buffer))
+	if (input.flags & (1 << OPTION_FLAG_FILE_PER_TASKLET))
 	{
-		printf("Decoded image would be too large (%u vs %u)\n", output.length, sizeof(MCU_buffer));
-		return -2;
+		// Small files are decoded one per tasklet, without any barriers or synchronisation between tasklets
+		if (me() < NR_FILE_TASKLETS)
+			decode_own_files(&decompressor);
+		return 0;
 	}
 
-  // All tasklets should wait until tasklet 0 has finished reading all JPEG markers
-  barrier_wait(&init_barrier);
+	if (me() == 0)
+		info->image_offset = 0;
 
-  init_jpeg_decompressor(&decompressor);
+	dbg_printf("[:%u] Got %u input files\n", me(), input.file_count);
 
-  // Process Huffman coded bitstream, perform inverse DCT, and convert YCbCr to RGB
-  decode_bitstream(&decompressor);
-  if (!jpegInfo.valid) {
-    return 1;
-  }
+	for (uint32_t file = 0; file < input.file_count; file++)
+	{
+		memset(&decompressor, 0, sizeof(JpegDecompressor));
+		decompressor.tasklet_id = me();
+		decompressor.info = info;
+
+		if (decompressor.tasklet_id == 0)
+		{
+			start_file(&decompressor, file);
+			decode_file = info->valid;
+		}
+
+		// All tasklets should wait until tasklet 0 has finished reading all JPEG markers
+		barrier_wait(&init_barrier);
+
+		// info->valid may be cleared by any tasklet while decoding, which must not make the
+		// others skip the barriers below
+		if (decode_file)
+		{
+			if ((input.flags & (1 << OPTION_FLAG_PIPELINE)) && (host_split || info->restart_interval != 0))
+			{
+				// MCUs that are decoded exactly once can be converted while the rest of the image is still being
+				// decoded, so decoding and conversion overlap and are counted together in cycles_convert_total
+#ifdef STATISTICS
+				file_record(info)->cycles_decode_total = perfcounter_get();
+#endif // STATISTICS
 
-  // All tasklets should wait until tasklet 0 has finished adjusting the DC coefficients
-  barrier_wait(&idct_barrier);
+				if (!host_split) {
+					index_restart_markers(&decompressor);
+					barrier_wait(&restart_barrier);
+				}
+				decode_pipelined(&decompressor, host_split);
+			}
+			else
+			{
+				// Process Huffman coded bitstream, perform inverse DCT, and convert YCbCr to RGB
+				if (host_split) {
+					decode_host_split(&decompressor);
+				} else if (info->restart_interval != 0) {
+					// Restart intervals can be decoded independently once every tasklet knows where they start
+					index_restart_markers(&decompressor);
+					barrier_wait(&restart_barrier);
+					decode_restart_intervals(&decompressor);
+				} else {
+					init_jpeg_decompressor(&decompressor);
+					decode_bitstream(&decompressor);
+
+					// Segments can only be joined once every tasklet knows where it synchronised with the next one
+					barrier_wait(&sync_barrier);
+					concat_adjust_mcus(&decompressor);
+				}
+
+				// All tasklets should wait until tasklet 0 has finished adjusting the DC coefficients
+				// Every tasklet sees the same info->valid after this point
+				barrier_wait(&idct_barrier);
 
 #ifdef STATISTICS
-		output.cycles_decode_total = perfcounter_get();
+				file_record(info)->cycles_decode_total = perfcounter_get();
 #endif // STATISTICS
 
-  inverse_dct_convert(&decompressor);
+				if (info->valid)
+					inverse_dct_convert(&decompressor);
+			}
 
-  barrier_wait(&prep0_barrier);
+			barrier_wait(&prep0_barrier);
 
 #ifdef STATISTICS
-	if (decompressor.tasklet_id == 0)
-	{
-		output.cycles_convert_total = perfcounter_get() - output.cycles_decode_total;
-		output.cycles_total = perfcounter_get();
-	}
+			if (decompressor.tasklet_id == 0)
+			{
+				file_record(info)->cycles_convert_total = perfcounter_get() - file_record(info)->cycles_decode_total;
+				file_record(info)->cycles_total = perfcounter_get();
+			}
 #endif // STATISTICS
+		}
+
+		// The other tasklets wait for the next file at init_barrier, so tasklet 0 can finish this one alone
+		if (decompressor.tasklet_id == 0)
+			finish_file(info, file);
+	}
 
 	return 0;
 }
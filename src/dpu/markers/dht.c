@@ -25,30 +25,32 @@ int process_DHT(JpegDecompressor *d) {
 }
 
 static int read_DHT(JpegDecompressor *d, int *length) {
+  JpegInfo *info = d->info;
   uint8_t ht_info = read_byte(d);
   *length -= 1;
 
   uint8_t table_id = ht_info & 0x0F;        // Th
   uint8_t ac_table = (ht_info >> 4) & 0x0F; // Tc
-  if (table_id > 3) {
+  if (table_id >= MAX_HUFFMAN_TABLES) {
     printf("Error: Invalid DHT - Huffman Table ID: %d\n", table_id);
     return JPEG_INVALID_ERROR_CODE;
   }
 
-  HuffmanTable *h_table = ac_table ? &jpegInfo.ac_huffman_tables[table_id] : &jpegInfo.dc_huffman_tables[table_id];
-  h_table->exists = 1;
+  // The values are only read by acquire_tables, for the tables used by the scan
+  info->huffman_table_offset[ac_table ? 1 : 0][table_id] = d->file_index + d->cache_index;
 
-  h_table->valoffset[0] = 0;
   int total = 0;
   for (int i = 1; i <= 16; i++) {
     total += read_byte(d); // Li
-    h_table->valoffset[i] = total;
   }
   *length -= 16;
 
-  for (int i = 0; i < total; i++) {
-    h_table->huffval[i] = read_byte(d); // Vij
+  // The end of HUFFVAL is kept in a byte
+  if (total > 255) {
+    printf("Error: Invalid DHT - %d codes in Huffman table %d\n", total, table_id);
+    return JPEG_INVALID_ERROR_CODE;
   }
+  skip_bytes(d, total); // Vij
   *length -= total;
 
   return JPEG_VALID;
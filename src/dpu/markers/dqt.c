@@ -2,9 +2,7 @@
 
 #include "dpu-jpeg.h"
 
-static int read_and_form_DQT(JpegDecompressor *d, int *length);
-static void form_low_precision_DQT(JpegDecompressor *d, int *length, uint8_t table_id);
-static void form_high_precision_DQT(JpegDecompressor *d, int *length, uint8_t table_id);
+static int read_DQT(JpegDecompressor *d, int *length);
 
 // Page 39: Section B.2.4.1
 int process_DQT(JpegDecompressor *d) {
@@ -12,7 +10,7 @@ int process_DQT(JpegDecompressor *d) {
   length -= 2;
 
   while (length > 0) {
-    int error = read_and_form_DQT(d, &length);
+    int error = read_DQT(d, &length);
     if (error) {
       return error;
     }
@@ -25,7 +23,9 @@ int process_DQT(JpegDecompressor *d) {
   return JPEG_VALID;
 }
 
-static int read_and_form_DQT(JpegDecompressor *d, int *length) {
+// The values are only read by acquire_tables, once it is known whether the image is scaled and which tables it uses
+static int read_DQT(JpegDecompressor *d, int *length) {
+  JpegInfo *info = d->info;
   uint8_t qt_info = read_byte(d);
   *length -= 1;
 
@@ -34,28 +34,14 @@ static int read_and_form_DQT(JpegDecompressor *d, int *length) {
     printf("Error: Invalid DQT - got quantization table ID: %d, ID should be between 0 and 3\n", table_id);
     return JPEG_INVALID_ERROR_CODE;
   }
-  jpegInfo.quant_tables[table_id].exists = 1;
 
   uint8_t precision = (qt_info >> 4) & 0x0F; // Pq
-  if (precision == 0) {
-    form_low_precision_DQT(d, length, table_id);
-  } else {
-    form_high_precision_DQT(d, length, table_id);
-  }
-
-  return JPEG_VALID;
-}
+  info->quant_table_offset[table_id] = d->file_index + d->cache_index;
+  info->quant_table_precision[table_id] = precision;
 
-static void form_low_precision_DQT(JpegDecompressor *d, int *length, uint8_t table_id) {
-  for (int i = 0; i < 64; i++) {
-    jpegInfo.quant_tables[table_id].table[ZIGZAG_ORDER[i]] = read_byte(d); // Qk
-  }
-  *length -= 64;
-}
+  int size = precision == 0 ? 64 : 128;
+  skip_bytes(d, size);
+  *length -= size;
 
-static void form_high_precision_DQT(JpegDecompressor *d, int *length, uint8_t table_id) {
-  for (int i = 0; i < 64; i++) {
-    jpegInfo.quant_tables[table_id].table[ZIGZAG_ORDER[i]] = read_short(d); // Qk
-  }
-  *length -= 128;
+  return JPEG_VALID;
 }
@@ -3,6 +3,7 @@
 #include "dpu-jpeg.h"
 
 int process_DRI(JpegDecompressor *d) {
+  JpegInfo *info = d->info;
   int length = read_short(d); // Lr
 
   if (length != 4) {
@@ -10,6 +11,6 @@ int process_DRI(JpegDecompressor *d) {
     return JPEG_INVALID_ERROR_CODE;
   }
 
-  jpegInfo.restart_interval = read_short(d); // Ri
+  info->restart_interval = read_short(d); // Ri
   return JPEG_VALID;
 }
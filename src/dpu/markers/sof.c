@@ -4,11 +4,12 @@
 
 static int read_SOF_metadata(JpegDecompressor *d);
 static int read_SOF_color_component_info(JpegDecompressor *d);
-static void initialize_MCU_height_width();
+static void initialize_MCU_height_width(JpegInfo *info);
 
 // Page 35: Section B.2.2
 int process_SOFn(JpegDecompressor *d) {
-  if (jpegInfo.num_color_components != 0) {
+  JpegInfo *info = d->info;
+  if (info->num_color_components != 0) {
     printf("Error: Invalid SOF - multiple SOFs encountered\n");
     return JPEG_INVALID_ERROR_CODE;
   }
@@ -20,16 +21,16 @@ int process_SOFn(JpegDecompressor *d) {
     return error;
   }
 
-  for (int i = 0; i < jpegInfo.num_color_components; i++) {
+  for (int i = 0; i < info->num_color_components; i++) {
     error = read_SOF_color_component_info(d);
     if (error) {
       return error;
     }
   }
 
-  initialize_MCU_height_width();
+  initialize_MCU_height_width(info);
 
-  if (length - 8 - (3 * jpegInfo.num_color_components) != 0) {
+  if (length - 8 - (3 * info->num_color_components) != 0) {
     printf("Error: Invalid SOF - length incorrect\n");
     return JPEG_INVALID_ERROR_CODE;
   }
@@ -38,22 +39,23 @@ int process_SOFn(JpegDecompressor *d) {
 }
 
 static int read_SOF_metadata(JpegDecompressor *d) {
+  JpegInfo *info = d->info;
   uint8_t precision = read_byte(d); // P
   if (precision != 8) {
     printf("Error: Invalid SOF - precision is %d, should be 8\n", precision);
     return JPEG_INVALID_ERROR_CODE;
   }
 
-  jpegInfo.image_height = read_short(d); // Y
-  jpegInfo.image_width = read_short(d);  // X
-  if (jpegInfo.image_height == 0 || jpegInfo.image_width == 0) {
-    printf("Error: Invalid SOF - dimensions: %d x %d\n", jpegInfo.image_width, jpegInfo.image_height);
+  info->image_height = read_short(d); // Y
+  info->image_width = read_short(d);  // X
+  if (info->image_height == 0 || info->image_width == 0) {
+    printf("Error: Invalid SOF - dimensions: %d x %d\n", info->image_width, info->image_height);
     return JPEG_INVALID_ERROR_CODE;
   }
 
-  jpegInfo.num_color_components = read_byte(d); // Nf
-  if (jpegInfo.num_color_components == 0 || jpegInfo.num_color_components > 3) {
-    printf("Error: Invalid SOF - number of color components: %d\n", jpegInfo.num_color_components);
+  info->num_color_components = read_byte(d); // Nf
+  if (info->num_color_components == 0 || info->num_color_components > 3) {
+    printf("Error: Invalid SOF - number of color components: %d\n", info->num_color_components);
     return JPEG_INVALID_ERROR_CODE;
   }
 
@@ -61,13 +63,14 @@ static int read_SOF_metadata(JpegDecompressor *d) {
 }
 
 static int read_SOF_color_component_info(JpegDecompressor *d) {
+  JpegInfo *info = d->info;
   uint8_t component_id = read_byte(d); // Ci
   if (component_id == 0 || component_id > 3) {
     printf("Error: Invalid SOF - component ID: %d\n", component_id);
     return JPEG_INVALID_ERROR_CODE;
   }
 
-  ColorComponentInfo *component = &jpegInfo.color_components[component_id - 1];
+  ColorComponentInfo *component = &info->color_components[component_id - 1];
   component->exists = 1;
   component->component_id = component_id;
 
@@ -83,8 +86,8 @@ static int read_SOF_color_component_info(JpegDecompressor *d) {
       return JPEG_INVALID_ERROR_CODE;
     }
 
-    jpegInfo.max_h_samp_factor = component->h_samp_factor;
-    jpegInfo.max_v_samp_factor = component->v_samp_factor;
+    info->max_h_samp_factor = component->h_samp_factor;
+    info->max_v_samp_factor = component->v_samp_factor;
   } else if (component->h_samp_factor != 1 || component->v_samp_factor != 1) {
     printf("Error: Invalid SOF - horizontal and vertical sampling factor for Cr and Cb not 1");
     return JPEG_INVALID_ERROR_CODE;
@@ -95,17 +98,16 @@ static int read_SOF_color_component_info(JpegDecompressor *d) {
   return JPEG_VALID;
 }
 
-static void initialize_MCU_height_width() {
-  jpegInfo.mcu_height = (jpegInfo.image_height + 7) / 8;
-  jpegInfo.mcu_width = (jpegInfo.image_width + 7) / 8;
-  jpegInfo.padding = jpegInfo.image_width % 4;
-  jpegInfo.mcu_height_real = jpegInfo.mcu_height;
-  jpegInfo.mcu_width_real = jpegInfo.mcu_width;
-  if (jpegInfo.max_v_samp_factor == 2 && jpegInfo.mcu_height_real % 2 == 1) {
-    jpegInfo.mcu_height_real++;
+static void initialize_MCU_height_width(JpegInfo *info) {
+  info->mcu_height = (info->image_height + 7) / 8;
+  info->mcu_width = (info->image_width + 7) / 8;
+  info->padding = info->image_width % 4;
+  info->mcu_height_real = info->mcu_height;
+  info->mcu_width_real = info->mcu_width;
+  if (info->max_v_samp_factor == 2 && info->mcu_height_real % 2 == 1) {
+    info->mcu_height_real++;
   }
-  if (jpegInfo.max_h_samp_factor == 2 && jpegInfo.mcu_width_real % 2 == 1) {
-    jpegInfo.mcu_width_real++;
+  if (info->max_h_samp_factor == 2 && info->mcu_width_real % 2 == 1) {
+    info->mcu_width_real++;
   }
-  jpegInfoDpu.rows_per_tasklet = jpegInfo.mcu_height_real / NR_TASKLETS;
 }
@@ -0,0 +1,46 @@
+/**
+ * Report of where the WRAM of a DPU goes, built for the host with the same options as the DPU program by
+ * `make wram-budget`. The stacks of the tasklets take STACK_SIZE_DEFAULT each out of what is left
+ */
+#include <stdio.h>
+
+#include "jpeg-common.h"
+#include "dpu-jpeg.h"
+
+static long total = 0;
+
+static void report(const char *name, long count, long size) {
+  if (count == 1) {
+    printf("  %-22s %6ld\n", name, size);
+  } else {
+    printf("  %-22s %6ld  (%ld x %ld)\n", name, count * size, count, size);
+  }
+  total += count * size;
+}
+
+int main() {
+  printf("WRAM budget with %d tasklets, %d file tasklets, HUFF_LOOKAHEAD %d\n", NR_TASKLETS, NR_FILE_TASKLETS,
+         HUFF_LOOKAHEAD);
+
+  report("jpegInfos", NR_FILE_TASKLETS, sizeof(JpegInfo));
+  report("quant_tables", QUANT_TABLE_POOL_SIZE, sizeof(QuantizationTable));
+  report("huffman_tables", HUFFMAN_TABLE_POOL_SIZE, sizeof(HuffmanTable));
+  report("huffman_cache_keys", 1, HUFFMAN_CACHE_ENTRIES * sizeof(uint32_t));
+  report("jpegInfoDpu", 1, sizeof(JpegInfoDpu));
+  report("input", 1, sizeof(dpu_inputs_t));
+  report("host_splits", NR_TASKLETS, sizeof(dpu_split_t));
+  report("output", NR_FILE_TASKLETS, sizeof(dpu_output_t));
+  report("color_tables", 1, sizeof(ColorTables));
+  report("file_buffer_cache", NR_TASKLETS, PREFETCH_SIZE);
+  report("MCU_buffer_cache", NR_TASKLETS, PREWRITE_SIZE * sizeof(short));
+  report("extent_cache", NR_TASKLETS, EXTENT_CACHE_SIZE);
+  report("raster_cache", NR_TASKLETS, RASTER_CACHE_SIZE);
+
+  report("stacks", NR_TASKLETS, STACK_SIZE_DEFAULT);
+
+  long left = WRAM_SIZE - total;
+  printf("  %-22s %6ld of %d\n", "total", total, WRAM_SIZE);
+  printf("  %-22s %6ld  (less the runtime, barriers and mutexes)\n", "left", left);
+
+  return left < 0;
+}
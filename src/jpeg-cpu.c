@@ -9,6 +9,9 @@
 #include "bmp.h"
 #include "jpeg-common.h"
 
+#define STANDARD_HUFFMAN_STORAGE static const
+#include "jpeg-huffman-tables.h"
+
 #define TIME 0      // If set to 1, times how long it takes to do specific parts of the JPEG decoding process
 #define USE_FLOAT 0 // If set to 1, uses the most accurate method of computing inverse DCT by using floats
 
@@ -33,8 +36,24 @@
 #define S6 0.19134171618254488586 // 12 >> 6 or 49 >> 8
 #define S7 0.09754516100806413392 // 6 >> 6  or 25 >> 8
 
+// Fixed point constants of the reduced inverse DCTs, scaled by 1 << IDCT_CONST_BITS
+#define IDCT_CONST_BITS 13
+#define IDCT_PASS1_BITS 2    // extra precision kept between the two passes
+#define FIX_0_353553391 2896 // cos(pi / 4) / 2
+#define FIX_0_461939766 3784 // cos(pi / 8) / 2
+#define FIX_0_191341716 1567 // cos(3 * pi / 8) / 2
+
+// Coefficients (in zigzag order) needed for the top left (8 >> scale_shift) x (8 >> scale_shift) of a block
+static const uint8_t SCALED_COEFFICIENTS[MAX_SCALE_SHIFT + 1] = {64, 25, 5, 1};
+static ColorTables color_tables;
+
 JpegInfo jpegInfo;
 
+// from DQT and DHT
+static QuantizationTable quant_tables[4];
+static HuffmanTable dc_huffman_tables[MAX_HUFFMAN_TABLES];
+static HuffmanTable ac_huffman_tables[MAX_HUFFMAN_TABLES];
+
 /* We want to emulate the behaviour of 'tjbench <jpg> -scale 1/8'
         That calls 'process_data_simple_main' and 'decompress_onepass' in
 turbojpeg On my laptop, I see:
@@ -145,14 +164,14 @@ static void check_start_of_image(JpegDecompressor *d) {
 
 static void form_low_precision_DQT(JpegDecompressor *d, int *length, uint8_t table_id) {
   for (int i = 0; i < 64; i++) {
-    jpegInfo.quant_tables[table_id].table[ZIGZAG_ORDER[i]] = read_byte(d); // Qk
+    quant_tables[table_id].table[ZIGZAG_ORDER[i]] = read_byte(d); // Qk
   }
   *length -= 64;
 }
 
 static void form_high_precision_DQT(JpegDecompressor *d, int *length, uint8_t table_id) {
   for (int i = 0; i < 64; i++) {
-    jpegInfo.quant_tables[table_id].table[ZIGZAG_ORDER[i]] = read_short(d); // Qk
+    quant_tables[table_id].table[ZIGZAG_ORDER[i]] = read_short(d); // Qk
   }
   *length -= 128;
 }
@@ -167,7 +186,9 @@ static int read_and_form_DQT(JpegDecompressor *d, int *length) {
     fprintf(stderr, "Error: Invalid DQT - got quantization table ID: %d, ID should be between 0 and 3\n", table_id);
     return 1;
   }
-  jpegInfo.quant_tables[table_id].exists = 1;
+  quant_tables[table_id].exists = 1;
+  quant_tables[table_id].shift = 0;
+  quant_tables[table_id].scale_rows = 0;
 
   uint8_t precision = (qt_info >> 4) & 0x0F; // Pq
   if (precision == 0) {
@@ -197,6 +218,41 @@ static void process_DQT(JpegDecompressor *d) {
   }
 }
 
+/**
+ * Fold the ANN scale of the first pass of the inverse DCT into the quantization tables, once the scale of the image is
+ * known, so that decode_mcu dequantizes and scales a coefficient with a single multiplication
+ * Only full size blocks go through the ANN inverse DCT, and the DC coefficient is left as it is, like on the DPU. A
+ * table with large 16 bit values that would not fit once scaled is left as it is, and decode_mcu scales its
+ * coefficients with a second multiplication
+ */
+static void prescale_DQT() {
+  if (USE_FLOAT || jpegInfo.scale_shift != 0) {
+    return;
+  }
+
+  for (int i = 0; i < 4; i++) {
+    QuantizationTable *q_table = &quant_tables[i];
+    if (!q_table->exists) {
+      continue;
+    }
+
+    q_table->scale_rows = 0;
+    for (int k = 1; k < 64; k++) {
+      if (q_table->table[k] * AAN_ROW_SCALE[k >> 3] > UINT16_MAX) {
+        q_table->scale_rows = 1;
+      }
+    }
+    if (q_table->scale_rows) {
+      continue;
+    }
+
+    for (int k = 1; k < 64; k++) {
+      q_table->table[k] *= AAN_ROW_SCALE[k >> 3];
+    }
+    q_table->shift = AAN_ROW_SCALE_BITS;
+  }
+}
+
 static void process_DRI(JpegDecompressor *d) {
   int length = read_short(d);
   if (length != 4) {
@@ -316,6 +372,50 @@ static void process_SOFn(JpegDecompressor *d) {
   }
 }
 
+// Built tables of the previous images, an entry is empty while its fingerprint is 0
+static HuffmanTable huffman_cache[HUFFMAN_CACHE_ENTRIES];
+static int huffman_cache_next; // entry replaced by the next table cached
+
+// Replace a table by another built table if both have the same code counts and values
+static int use_same_table(HuffmanTable *h_table, const HuffmanTable *other) {
+  if (memcmp(other->valoffset, h_table->valoffset, 17) != 0 ||
+      memcmp(other->huffval, h_table->huffval, h_table->valoffset[16]) != 0) {
+    return 0;
+  }
+
+  *h_table = *other;
+  return 1;
+}
+
+// Replace a table by the prebuilt copy of the standard table of the same class it is byte-identical to, if any
+static void use_standard_table(HuffmanTable *h_table, uint8_t ac_table) {
+#ifdef NUM_STANDARD_HUFFMAN_TABLES
+  for (int i = ac_table ? 1 : 0; i < NUM_STANDARD_HUFFMAN_TABLES; i += 2) {
+    if (use_same_table(h_table, &standard_huffman_tables[i])) {
+      return;
+    }
+  }
+#endif
+}
+
+// Replace a table by the same table built for a previous image, if it is still cached
+static void use_cached_table(HuffmanTable *h_table) {
+  uint32_t fingerprint = huffman_fingerprint(h_table);
+
+  for (int i = 0; i < HUFFMAN_CACHE_ENTRIES; i++) {
+    if (huffman_cache[i].fingerprint == fingerprint && use_same_table(h_table, &huffman_cache[i])) {
+      return;
+    }
+  }
+  h_table->fingerprint = fingerprint;
+}
+
+// Keep a table that was just built for the next images, in place of the oldest cached table
+static void cache_huffman_table(HuffmanTable *h_table) {
+  huffman_cache[huffman_cache_next] = *h_table;
+  huffman_cache_next = (huffman_cache_next + 1) % HUFFMAN_CACHE_ENTRIES;
+}
+
 static int read_DHT(JpegDecompressor *d, int *length) {
   uint8_t ht_info = read_byte(d);
   *length -= 1;
@@ -328,7 +428,7 @@ static int read_DHT(JpegDecompressor *d, int *length) {
     return 1;
   }
 
-  HuffmanTable *h_table = ac_table ? &jpegInfo.ac_huffman_tables[table_id] : &jpegInfo.dc_huffman_tables[table_id];
+  HuffmanTable *h_table = ac_table ? &ac_huffman_tables[table_id] : &dc_huffman_tables[table_id];
   h_table->exists = 1;
 
   h_table->valoffset[0] = 0;
@@ -344,6 +444,12 @@ static int read_DHT(JpegDecompressor *d, int *length) {
   }
   *length -= total;
 
+  h_table->built = 0;
+  use_standard_table(h_table, ac_table);
+  if (!h_table->built) {
+    use_cached_table(h_table);
+  }
+
   return 0;
 }
 
@@ -366,24 +472,48 @@ static void process_DHT(JpegDecompressor *d) {
   }
 }
 
-static void generate_codes(HuffmanTable *h_table) {
+static int generate_lookup(HuffmanTable *h_table) {
+  memset(h_table->lookup, 0, sizeof(h_table->lookup));
+
   uint32_t code = 0;
-  for (int i = 0; i < 16; i++) {
-    for (int j = h_table->valoffset[i]; j < h_table->valoffset[i + 1]; j++) {
-      h_table->codes[j] = code;
+  for (int length = 1; length <= 16; length++) {
+    int first = h_table->valoffset[length - 1];
+    int last = h_table->valoffset[length];
+    // Codes made of 1 bits only are not allowed, which also keeps the end of the codes within 16 bits
+    if (code + (last - first) >= (1U << length)) {
+      jpegInfo.valid = 0;
+      fprintf(stderr, "Error: Invalid DHT - too many codes of length %d\n", length);
+      return 1;
+    }
+
+    h_table->valptr[length] = first - code;
+    for (int j = first; j < last; j++) {
+      if (length <= HUFF_LOOKAHEAD) {
+        // Every bit pattern starting with this code resolves to the same value
+        int shift = HUFF_LOOKAHEAD - length;
+        for (int k = 0; k < (1 << shift); k++) {
+          h_table->lookup[(code << shift) | k] = (length << 8) | h_table->huffval[j];
+        }
+      }
       code++;
     }
+    h_table->code_end[length] = code;
     code <<= 1;
   }
+  h_table->built = 1;
+  cache_huffman_table(h_table);
+  return 0;
 }
 
 static void build_huffman_tables() {
   for (int i = 0; i < MAX_HUFFMAN_TABLES; i++) {
-    if (jpegInfo.dc_huffman_tables[i].exists) {
-      generate_codes(&jpegInfo.dc_huffman_tables[i]);
+    if (dc_huffman_tables[i].exists && !dc_huffman_tables[i].built &&
+        generate_lookup(&dc_huffman_tables[i])) {
+      return;
     }
-    if (jpegInfo.ac_huffman_tables[i].exists) {
-      generate_codes(&jpegInfo.ac_huffman_tables[i]);
+    if (ac_huffman_tables[i].exists && !ac_huffman_tables[i].built &&
+        generate_lookup(&ac_huffman_tables[i])) {
+      return;
     }
   }
 }
@@ -457,67 +587,135 @@ static void process_SOS(JpegDecompressor *d) {
   build_huffman_tables();
 }
 
-static int get_num_bits(JpegDecompressor *d, uint32_t num_bits) {
-  int bits = 0;
-  if (num_bits == 0) {
-    return bits;
+// Non-zero if any of the bytes in x is 0xFF
+#define HAS_FF_BYTE(x) ((~(x) - 0x0101010101010101ULL) & (x) & 0x8080808080808080ULL)
+
+// Longest Huffman code plus the longest coefficient that follows it, so a single refill covers a whole symbol
+#define MAX_SYMBOL_BITS (16 + 11)
+
+static void fill_bit_buffer(JpegDecompressor *d) {
+  uint32_t num_bytes = (64 - d->bits_left) >> 3;
+  if (num_bytes == 0) {
+    return;
   }
 
+  // Fast path: load every byte that fits into the buffer at once, unless one of them needs unstuffing
+  if (d->ptr + 8 <= d->data + d->length) {
+    uint64_t word = 0;
+    for (int i = 0; i < 8; i++) {
+      word = (word << 8) | (uint8_t) d->ptr[i];
+    }
+    word >>= (8 - num_bytes) << 3;
+
+    if (!HAS_FF_BYTE(word)) {
+      d->bit_buffer |= word << (64 - (num_bytes << 3) - d->bits_left);
+      d->bits_left += num_bytes << 3;
+      d->ptr += num_bytes;
+      return;
+    }
+  }
+
+  // Slow path: 0xFF in the refill window (stuffed byte or marker), or close to the end of the data
   uint8_t temp_byte;
-  uint32_t actual_byte;
-  while (d->bits_left < num_bits) {
-    // Read a byte and decode it, if it is 0xFF
-    temp_byte = read_byte(d);
-    actual_byte = temp_byte;
-
-    while (temp_byte == 0xFF) {
-      // FF may be padded with FFs, read as many FFs as necessary
+  uint64_t actual_byte;
+  while (d->bits_left <= 64 - 8) {
+    if (is_eof(d)) {
+      // Lookahead may run past the end of the scan, pad with zeroes instead of reading past the buffer
+      // ptr keeps counting the padding so that bitstream_offset can tell it apart from file data
+      actual_byte = 0;
+      d->ptr++;
+    } else {
+      // Read a byte and decode it, if it is 0xFF
       temp_byte = read_byte(d);
-      if (temp_byte == 0) {
-        // Got FF which is not a marker, save it to buffer
-        actual_byte = 0xFF;
-      } else if (temp_byte >= M_RST_FIRST && temp_byte <= M_RST_LAST) {
-        // Got restart markers, ignore and read new byte
+      actual_byte = temp_byte;
+
+      while (temp_byte == 0xFF) {
+        // FF may be padded with FFs, read as many FFs as necessary
         temp_byte = read_byte(d);
-        actual_byte = temp_byte;
-      } else {
-        actual_byte = temp_byte;
+        if (temp_byte == 0) {
+          // Got FF which is not a marker, save it to buffer
+          actual_byte = 0xFF;
+        } else if (temp_byte >= M_RST_FIRST && temp_byte <= M_RST_LAST) {
+          // Got restart markers, ignore and read new byte
+          temp_byte = read_byte(d);
+          actual_byte = temp_byte;
+        } else {
+          actual_byte = temp_byte;
+        }
       }
     }
 
     // Add the new bits to the buffer (MSB aligned)
-    d->bit_buffer |= actual_byte << (32 - 8 - d->bits_left);
+    d->bit_buffer |= actual_byte << (64 - 8 - d->bits_left);
     d->bits_left += 8;
   }
+}
 
-  bits = d->bit_buffer >> (32 - num_bits);
+// The caller must make sure that the bit buffer holds at least num_bits (between 1 and 32)
+static inline uint32_t peek_bits(JpegDecompressor *d, uint32_t num_bits) {
+  return d->bit_buffer >> (64 - num_bits);
+}
+
+static inline void consume_bits(JpegDecompressor *d, uint32_t num_bits) {
   d->bit_buffer <<= num_bits;
   d->bits_left -= num_bits;
-  return bits;
 }
 
+// Read a coefficient of num_bits from the bit buffer and convert it to a signed value
+static int receive_extend(JpegDecompressor *d, uint32_t num_bits) {
+  if (num_bits == 0) {
+    return 0;
+  }
+
+  int coeff = peek_bits(d, num_bits);
+  consume_bits(d, num_bits);
+  if (coeff < (1 << (num_bits - 1))) {
+    // Convert to negative coefficient
+    coeff -= (1 << num_bits) - 1;
+  }
+  return coeff;
+}
+
+// The caller must make sure that the bit buffer holds at least 16 bits
 static uint8_t huff_decode(JpegDecompressor *d, HuffmanTable *h_table) {
-  uint32_t code = 0;
+  // Fast path: peek HUFF_LOOKAHEAD bits and resolve short codes with one lookup
+  uint16_t entry = h_table->lookup[peek_bits(d, HUFF_LOOKAHEAD)];
+  if (entry != 0) {
+    consume_bits(d, entry >> 8);
+    return entry & 0xFF;
+  }
 
-  for (int i = 0; i < 16; i++) {
-    int bit = get_num_bits(d, 1);
-    code = (code << 1) | bit;
-    for (int j = h_table->valoffset[i]; j < h_table->valoffset[i + 1]; j++) {
-      if (code == h_table->codes[j]) {
-        return h_table->huffval[j];
-      }
+  // Slow path: walk the canonical code lengths beyond the lookahead window
+  uint32_t length = HUFF_LOOKAHEAD + 1;
+  uint32_t code = peek_bits(d, length);
+  while (code >= h_table->code_end[length]) {
+    if (length == 16) {
+      // No valid code, skip the 16 bits searched like a bit-by-bit decoder would
+      consume_bits(d, 16);
+      return -1;
     }
+    length++;
+    code = peek_bits(d, length);
   }
 
-  return -1;
+  consume_bits(d, length);
+  return h_table->huffval[(uint16_t) (h_table->valptr[length] + code)];
 }
 
-static int decode_mcu(JpegDecompressor *d, int component_index, short *buffer, short *previous_dc) {
-  QuantizationTable *q_table = &jpegInfo.quant_tables[jpegInfo.color_components[component_index].quant_table_id];
-  HuffmanTable *dc_table = &jpegInfo.dc_huffman_tables[jpegInfo.color_components[component_index].dc_huffman_table_id];
-  HuffmanTable *ac_table = &jpegInfo.ac_huffman_tables[jpegInfo.color_components[component_index].ac_huffman_table_id];
+/**
+ * Decode a block, only dequantizing and storing its first num_coeffs coefficients in zigzag order
+ * The others are decoded to find where the next block starts, and left out of buffer
+ * Returns the zigzag index of the last nonzero coefficient stored, or -1 if the block is invalid
+ */
+static int decode_mcu(JpegDecompressor *d, int component_index, short *buffer, short *previous_dc, int num_coeffs) {
+  QuantizationTable *q_table = &quant_tables[jpegInfo.color_components[component_index].quant_table_id];
+  HuffmanTable *dc_table = &dc_huffman_tables[jpegInfo.color_components[component_index].dc_huffman_table_id];
+  HuffmanTable *ac_table = &ac_huffman_tables[jpegInfo.color_components[component_index].ac_huffman_table_id];
 
   // Get DC value for this MCU block
+  if (d->bits_left < MAX_SYMBOL_BITS) {
+    fill_bit_buffer(d);
+  }
   uint8_t dc_length = huff_decode(d, dc_table);
   if (dc_length == (uint8_t) -1) {
     fprintf(stderr, "Error: Invalid DC code\n");
@@ -528,19 +726,19 @@ static int decode_mcu(JpegDecompressor *d, int component_index, short *buffer, s
     return -1;
   }
 
-  int coeff = get_num_bits(d, dc_length);
-  if (dc_length != 0 && coeff < (1 << (dc_length - 1))) {
-    // Convert to negative coefficient
-    coeff -= (1 << dc_length) - 1;
-  }
+  int coeff = receive_extend(d, dc_length);
   buffer[0] = coeff + *previous_dc;
   *previous_dc = buffer[0];
   // Dequantization
   buffer[0] *= q_table->table[0];
 
   // Get the AC values for this MCU block
+  int last = 0;
   int i = 1;
   while (i < 64) {
+    if (d->bits_left < MAX_SYMBOL_BITS) {
+      fill_bit_buffer(d);
+    }
     uint8_t ac_length = huff_decode(d, ac_table);
     if (ac_length == (uint8_t) -1) {
       fprintf(stderr, "Error: Invalid AC code\n");
@@ -549,7 +747,7 @@ static int decode_mcu(JpegDecompressor *d, int component_index, short *buffer, s
 
     // Got 0x00, fill remaining MCU block with 0s
     if (ac_length == 0x00) {
-      while (i < 64) {
+      while (i < num_coeffs) {
         buffer[ZIGZAG_ORDER[i++]] = 0;
       }
       break;
@@ -569,8 +767,10 @@ static int decode_mcu(JpegDecompressor *d, int component_index, short *buffer, s
       fprintf(stderr, "Error: Invalid AC code - zeros exceeded MCU length %d >= 64\n", i + num_zeroes);
       return -1;
     }
-    for (int j = 0; j < num_zeroes; j++) {
-      buffer[ZIGZAG_ORDER[i++]] = 0;
+    for (int j = 0; j < num_zeroes; j++, i++) {
+      if (i < num_coeffs) {
+        buffer[ZIGZAG_ORDER[i]] = 0;
+      }
     }
 
     if (coeff_length > 10) {
@@ -578,18 +778,24 @@ static int decode_mcu(JpegDecompressor *d, int component_index, short *buffer, s
       return -1;
     }
     if (coeff_length != 0) {
-      coeff = get_num_bits(d, coeff_length);
-      if (coeff < (1 << (coeff_length - 1))) {
-        // Convert to negative coefficient
-        coeff -= (1 << coeff_length) - 1;
+      if (i < num_coeffs) {
+        coeff = receive_extend(d, coeff_length);
+        // Write coefficient to buffer as well as perform dequantization, along with the ANN scale of its row
+        if (q_table->scale_rows) {
+          int64_t value = coeff * q_table->table[ZIGZAG_ORDER[i]];
+          buffer[ZIGZAG_ORDER[i]] = (value * AAN_ROW_SCALE[ZIGZAG_ORDER[i] >> 3]) >> AAN_ROW_SCALE_BITS;
+        } else {
+          buffer[ZIGZAG_ORDER[i]] = (coeff * q_table->table[ZIGZAG_ORDER[i]]) >> q_table->shift;
+        }
+        last = i;
+      } else {
+        consume_bits(d, coeff_length);
       }
-      // Write coefficient to buffer as well as perform dequantization
-      buffer[ZIGZAG_ORDER[i]] = coeff * q_table->table[ZIGZAG_ORDER[i]];
       i++;
     }
   }
 
-  return 0;
+  return last;
 }
 
 #if USE_FLOAT
@@ -700,183 +906,287 @@ static void inverse_dct_component_float(short *buffer) {
   }
 }
 #else
-static void inverse_dct_component(short *buffer) {
-  // ANN algorithm, intermediate values are bit shifted to the left to preserve precision
-  // and then bit shifted to the right at the end
-  for (int i = 0; i < 8; i++) {
-    // Higher accuracy
-    int g0 = (buffer[0 * 8 + i] * 181) >> 5;
-    int g1 = (buffer[4 * 8 + i] * 181) >> 5;
-    int g2 = (buffer[2 * 8 + i] * 59) >> 3;
-    int g3 = (buffer[6 * 8 + i] * 49) >> 4;
-    int g4 = (buffer[5 * 8 + i] * 71) >> 4;
-    int g5 = (buffer[1 * 8 + i] * 251) >> 5;
-    int g6 = (buffer[7 * 8 + i] * 25) >> 4;
-    int g7 = (buffer[3 * 8 + i] * 213) >> 5;
-
-    // Lower accuracy
-    // int g0 = (buffer[0 * 8 + i] * 22) >> 2;
-    // int g1 = (buffer[4 * 8 + i] * 22) >> 2;
-    // int g2 = (buffer[2 * 8 + i] * 30) >> 2;
-    // int g3 = (buffer[6 * 8 + i] * 12) >> 2;
-    // int g4 = (buffer[5 * 8 + i] * 18) >> 2;
-    // int g5 = (buffer[1 * 8 + i] * 31) >> 2;
-    // int g6 = (buffer[7 * 8 + i] * 6) >> 2;
-    // int g7 = (buffer[3 * 8 + i] * 27) >> 2;
-
-    int f4 = g4 - g7;
-    int f5 = g5 + g6;
-    int f6 = g5 - g6;
-    int f7 = g4 + g7;
-
-    int e2 = g2 - g3;
-    int e3 = g2 + g3;
-    int e5 = f5 - f7;
-    int e7 = f5 + f7;
-    int e8 = f4 + f6;
-
-    // Higher accuracy
-    int d2 = (e2 * 181) >> 7;
-    int d4 = (f4 * 277) >> 8;
-    int d5 = (e5 * 181) >> 7;
-    int d6 = (f6 * 669) >> 8;
-    int d8 = (e8 * 49) >> 6;
-
-    // Lower accuracy
-    // int d2 = (e2 * 90) >> 6;
-    // int d4 = (f4 * 69) >> 6;
-    // int d5 = (e5 * 90) >> 6;
-    // int d6 = (f6 * 167) >> 6;
-    // int d8 = (e8 * 49) >> 6;
-
-    int c0 = g0 + g1;
-    int c1 = g0 - g1;
-    int c2 = d2 - e3;
-    int c4 = d4 + d8;
-    int c5 = d5 + e7;
-    int c6 = d6 - d8;
-    int c8 = c5 - c6;
-
-    int b0 = c0 + e3;
-    int b1 = c1 + c2;
-    int b2 = c1 - c2;
-    int b3 = c0 - e3;
-    int b4 = c4 - c8;
-    int b6 = c6 - e7;
-
-    buffer[0 * 8 + i] = (b0 + e7) >> 4;
-    buffer[1 * 8 + i] = (b1 + b6) >> 4;
-    buffer[2 * 8 + i] = (b2 + c8) >> 4;
-    buffer[3 * 8 + i] = (b3 + b4) >> 4;
-    buffer[4 * 8 + i] = (b3 - b4) >> 4;
-    buffer[5 * 8 + i] = (b2 - c8) >> 4;
-    buffer[6 * 8 + i] = (b1 - b6) >> 4;
-    buffer[7 * 8 + i] = (b0 - e7) >> 4;
+/**
+ * Butterflies of one pass of the ANN inverse DCT, from its 8 scaled inputs g0 to g7 to values[0], values[stride], ...,
+ * values[7 * stride]
+ * Intermediate values are bit shifted to the left to preserve precision and then bit shifted to the right at the end
+ */
+static inline void inverse_dct_butterflies(short *values, int stride, int g0, int g1, int g2, int g3, int g4, int g5,
+                                           int g6, int g7) {
+  int f4 = g4 - g7;
+  int f5 = g5 + g6;
+  int f6 = g5 - g6;
+  int f7 = g4 + g7;
+
+  int e2 = g2 - g3;
+  int e3 = g2 + g3;
+  int e5 = f5 - f7;
+  int e7 = f5 + f7;
+  int e8 = f4 + f6;
+
+  // Higher accuracy
+  int d2 = (e2 * 181) >> 7;
+  int d4 = (f4 * 277) >> 8;
+  int d5 = (e5 * 181) >> 7;
+  int d6 = (f6 * 669) >> 8;
+  int d8 = (e8 * 49) >> 6;
+
+  // Lower accuracy
+  // int d2 = (e2 * 90) >> 6;
+  // int d4 = (f4 * 69) >> 6;
+  // int d5 = (e5 * 90) >> 6;
+  // int d6 = (f6 * 167) >> 6;
+  // int d8 = (e8 * 49) >> 6;
+
+  int c0 = g0 + g1;
+  int c1 = g0 - g1;
+  int c2 = d2 - e3;
+  int c4 = d4 + d8;
+  int c5 = d5 + e7;
+  int c6 = d6 - d8;
+  int c8 = c5 - c6;
+
+  int b0 = c0 + e3;
+  int b1 = c1 + c2;
+  int b2 = c1 - c2;
+  int b3 = c0 - e3;
+  int b4 = c4 - c8;
+  int b6 = c6 - e7;
+
+  values[0 * stride] = (b0 + e7) >> 4;
+  values[1 * stride] = (b1 + b6) >> 4;
+  values[2 * stride] = (b2 + c8) >> 4;
+  values[3 * stride] = (b3 + b4) >> 4;
+  values[4 * stride] = (b3 - b4) >> 4;
+  values[5 * stride] = (b2 - c8) >> 4;
+  values[6 * stride] = (b1 - b6) >> 4;
+  values[7 * stride] = (b0 - e7) >> 4;
+}
+
+// inverse_dct_butterflies when only g0, g2, g5 and g7 can be nonzero, the terms of the others drop out
+static inline void inverse_dct_butterflies_low(short *values, int stride, int g0, int g2, int g5, int g7) {
+  int e5 = g5 - g7;
+  int e7 = g5 + g7;
+
+  int d2 = (g2 * 181) >> 7;
+  int d4 = (-g7 * 277) >> 8;
+  int d5 = (e5 * 181) >> 7;
+  int d6 = (g5 * 669) >> 8;
+  int d8 = (e5 * 49) >> 6;
+
+  int c2 = d2 - g2;
+  int c4 = d4 + d8;
+  int c6 = d6 - d8;
+  int c8 = d5 + e7 - c6;
+
+  int b0 = g0 + g2;
+  int b1 = g0 + c2;
+  int b2 = g0 - c2;
+  int b3 = g0 - g2;
+  int b4 = c4 - c8;
+  int b6 = c6 - e7;
+
+  values[0 * stride] = (b0 + e7) >> 4;
+  values[1 * stride] = (b1 + b6) >> 4;
+  values[2 * stride] = (b2 + c8) >> 4;
+  values[3 * stride] = (b3 + b4) >> 4;
+  values[4 * stride] = (b3 - b4) >> 4;
+  values[5 * stride] = (b2 - c8) >> 4;
+  values[6 * stride] = (b1 - b6) >> 4;
+  values[7 * stride] = (b0 - e7) >> 4;
+}
+
+// One pass of the ANN inverse DCT over values[0], values[stride], ..., values[7 * stride] in place, scaling them first
+static void inverse_dct_8(short *values, int stride) {
+  // Higher accuracy
+  int g0 = (values[0 * stride] * 181) >> 5;
+  int g1 = (values[4 * stride] * 181) >> 5;
+  int g2 = (values[2 * stride] * 59) >> 3;
+  int g3 = (values[6 * stride] * 49) >> 4;
+  int g4 = (values[5 * stride] * 71) >> 4;
+  int g5 = (values[1 * stride] * 251) >> 5;
+  int g6 = (values[7 * stride] * 25) >> 4;
+  int g7 = (values[3 * stride] * 213) >> 5;
+
+  // Lower accuracy
+  // int g0 = (values[0 * stride] * 22) >> 2;
+  // int g1 = (values[4 * stride] * 22) >> 2;
+  // int g2 = (values[2 * stride] * 30) >> 2;
+  // int g3 = (values[6 * stride] * 12) >> 2;
+  // int g4 = (values[5 * stride] * 18) >> 2;
+  // int g5 = (values[1 * stride] * 31) >> 2;
+  // int g6 = (values[7 * stride] * 6) >> 2;
+  // int g7 = (values[3 * stride] * 27) >> 2;
+
+  inverse_dct_butterflies(values, stride, g0, g1, g2, g3, g4, g5, g6, g7);
+}
+
+// inverse_dct_8 when only the first 4 values can be nonzero
+static void inverse_dct_8_low(short *values, int stride) {
+  int g0 = (values[0 * stride] * 181) >> 5;
+  int g2 = (values[2 * stride] * 59) >> 3;
+  int g5 = (values[1 * stride] * 251) >> 5;
+  int g7 = (values[3 * stride] * 213) >> 5;
+
+  inverse_dct_butterflies_low(values, stride, g0, g2, g5, g7);
+}
+
+/**
+ * Inverse DCT of a full size block in place, last is the zigzag index of its last nonzero coefficient
+ * decode_mcu already scaled the AC coefficients for the column pass while dequantizing them, see prescale_DQT
+ * A block with only its DC coefficient is flat, and the coefficients of a block ending before zigzag index 10 all lie
+ * in its top left 4x4, so that only 4 columns need transforming and the rows take the cheaper inverse_dct_8_low.
+ * Columns without AC coefficients transform to their scaled DC. All of these give the same pixels as the full transform
+ */
+static void inverse_dct_component(short *buffer, int last) {
+  buffer[0] = (buffer[0] * 181) >> 5;
+  if (last == 0) {
+    short column = buffer[0] >> 4;
+    short pixel = ((column * 181) >> 5) >> 4;
+    for (int i = 0; i < 64; i++) {
+      buffer[i] = pixel;
+    }
+    return;
+  }
+
+  int low = last < 10;
+  int columns = low ? 4 : 8;
+  for (int i = 0; i < columns; i++) {
+    int ac = buffer[1 * 8 + i] | buffer[2 * 8 + i] | buffer[3 * 8 + i];
+    if (!low) {
+      ac |= buffer[4 * 8 + i] | buffer[5 * 8 + i] | buffer[6 * 8 + i] | buffer[7 * 8 + i];
+    }
+
+    if (ac == 0) {
+      short column = buffer[i] >> 4;
+      for (int j = 0; j < 8; j++) {
+        buffer[j * 8 + i] = column;
+      }
+    } else if (low) {
+      inverse_dct_butterflies_low(&buffer[i], 8, buffer[0 * 8 + i], buffer[2 * 8 + i], buffer[1 * 8 + i],
+                                  buffer[3 * 8 + i]);
+    } else {
+      inverse_dct_butterflies(&buffer[i], 8, buffer[0 * 8 + i], buffer[4 * 8 + i], buffer[2 * 8 + i], buffer[6 * 8 + i],
+                              buffer[5 * 8 + i], buffer[1 * 8 + i], buffer[7 * 8 + i], buffer[3 * 8 + i]);
+    }
   }
 
   for (int i = 0; i < 8; i++) {
-    // Higher accuracy
-    int g0 = (buffer[i * 8 + 0] * 181) >> 5;
-    int g1 = (buffer[i * 8 + 4] * 181) >> 5;
-    int g2 = (buffer[i * 8 + 2] * 59) >> 3;
-    int g3 = (buffer[i * 8 + 6] * 49) >> 4;
-    int g4 = (buffer[i * 8 + 5] * 71) >> 4;
-    int g5 = (buffer[i * 8 + 1] * 251) >> 5;
-    int g6 = (buffer[i * 8 + 7] * 25) >> 4;
-    int g7 = (buffer[i * 8 + 3] * 213) >> 5;
-
-    // Lower accuracy
-    // int g0 = (buffer[i * 8 + 0] * 22) >> 2;
-    // int g1 = (buffer[i * 8 + 4] * 22) >> 2;
-    // int g2 = (buffer[i * 8 + 2] * 30) >> 2;
-    // int g3 = (buffer[i * 8 + 6] * 12) >> 2;
-    // int g4 = (buffer[i * 8 + 5] * 18) >> 2;
-    // int g5 = (buffer[i * 8 + 1] * 31) >> 2;
-    // int g6 = (buffer[i * 8 + 7] * 6) >> 2;
-    // int g7 = (buffer[i * 8 + 3] * 27) >> 2;
-
-    int f4 = g4 - g7;
-    int f5 = g5 + g6;
-    int f6 = g5 - g6;
-    int f7 = g4 + g7;
-
-    int e2 = g2 - g3;
-    int e3 = g2 + g3;
-    int e5 = f5 - f7;
-    int e7 = f5 + f7;
-    int e8 = f4 + f6;
-
-    // Higher accuracy
-    int d2 = (e2 * 181) >> 7;
-    int d4 = (f4 * 277) >> 8;
-    int d5 = (e5 * 181) >> 7;
-    int d6 = (f6 * 669) >> 8;
-    int d8 = (e8 * 49) >> 6;
-
-    // Lower accuracy
-    // int d2 = (e2 * 90) >> 6;
-    // int d4 = (f4 * 69) >> 6;
-    // int d5 = (e5 * 90) >> 6;
-    // int d6 = (f6 * 167) >> 6;
-    // int d8 = (e8 * 49) >> 6;
-
-    int c0 = g0 + g1;
-    int c1 = g0 - g1;
-    int c2 = d2 - e3;
-    int c4 = d4 + d8;
-    int c5 = d5 + e7;
-    int c6 = d6 - d8;
-    int c8 = c5 - c6;
-
-    int b0 = c0 + e3;
-    int b1 = c1 + c2;
-    int b2 = c1 - c2;
-    int b3 = c0 - e3;
-    int b4 = c4 - c8;
-    int b6 = c6 - e7;
-
-    buffer[i * 8 + 0] = (b0 + e7) >> 4;
-    buffer[i * 8 + 1] = (b1 + b6) >> 4;
-    buffer[i * 8 + 2] = (b2 + c8) >> 4;
-    buffer[i * 8 + 3] = (b3 + b4) >> 4;
-    buffer[i * 8 + 4] = (b3 - b4) >> 4;
-    buffer[i * 8 + 5] = (b2 - c8) >> 4;
-    buffer[i * 8 + 6] = (b1 - b6) >> 4;
-    buffer[i * 8 + 7] = (b0 - e7) >> 4;
+    if (low) {
+      inverse_dct_8_low(&buffer[i * 8], 1);
+    } else {
+      inverse_dct_8(&buffer[i * 8], 1);
+    }
+  }
+}
+#endif
+
+/**
+ * Inverse DCT of the coefficients of a block to 4x4 pixels, 4 to a row in out
+ * Only the low frequency coefficients are used, evaluated at the centre of each 2x2 group of pixels
+ */
+static void inverse_dct_component_4x4(short *buffer, short *out, int last) {
+  if (last == 0) {
+    // Only the DC coefficient, every pixel gets the same value
+    int column = (buffer[0] * FIX_0_353553391) >> (IDCT_CONST_BITS - IDCT_PASS1_BITS);
+    short pixel = (column * FIX_0_353553391 + (1 << (IDCT_CONST_BITS + IDCT_PASS1_BITS - 1))) >>
+                  (IDCT_CONST_BITS + IDCT_PASS1_BITS);
+    for (int i = 0; i < 16; i++) {
+      out[i] = pixel;
+    }
+    return;
+  }
+
+  // Columns, the results stay where the coefficients were
+  for (int i = 0; i < 4; i++) {
+    int e0 = (buffer[0 * 8 + i] + buffer[2 * 8 + i]) * FIX_0_353553391;
+    int e1 = (buffer[0 * 8 + i] - buffer[2 * 8 + i]) * FIX_0_353553391;
+    int o0 = buffer[1 * 8 + i] * FIX_0_461939766 + buffer[3 * 8 + i] * FIX_0_191341716;
+    int o1 = buffer[1 * 8 + i] * FIX_0_191341716 - buffer[3 * 8 + i] * FIX_0_461939766;
+
+    buffer[0 * 8 + i] = (e0 + o0) >> (IDCT_CONST_BITS - IDCT_PASS1_BITS);
+    buffer[1 * 8 + i] = (e1 + o1) >> (IDCT_CONST_BITS - IDCT_PASS1_BITS);
+    buffer[2 * 8 + i] = (e1 - o1) >> (IDCT_CONST_BITS - IDCT_PASS1_BITS);
+    buffer[3 * 8 + i] = (e0 - o0) >> (IDCT_CONST_BITS - IDCT_PASS1_BITS);
+  }
+
+  // Rows
+  int round = 1 << (IDCT_CONST_BITS + IDCT_PASS1_BITS - 1);
+  for (int i = 0; i < 4; i++) {
+    int e0 = (buffer[i * 8 + 0] + buffer[i * 8 + 2]) * FIX_0_353553391 + round;
+    int e1 = (buffer[i * 8 + 0] - buffer[i * 8 + 2]) * FIX_0_353553391 + round;
+    int o0 = buffer[i * 8 + 1] * FIX_0_461939766 + buffer[i * 8 + 3] * FIX_0_191341716;
+    int o1 = buffer[i * 8 + 1] * FIX_0_191341716 - buffer[i * 8 + 3] * FIX_0_461939766;
+
+    out[i * 4 + 0] = (e0 + o0) >> (IDCT_CONST_BITS + IDCT_PASS1_BITS);
+    out[i * 4 + 1] = (e1 + o1) >> (IDCT_CONST_BITS + IDCT_PASS1_BITS);
+    out[i * 4 + 2] = (e1 - o1) >> (IDCT_CONST_BITS + IDCT_PASS1_BITS);
+    out[i * 4 + 3] = (e0 - o0) >> (IDCT_CONST_BITS + IDCT_PASS1_BITS);
   }
 }
+
+// Inverse DCT of the coefficients of a block to 2x2 pixels. (cos(pi / 4) / 2)^2 is exactly 1 / 8
+static void inverse_dct_component_2x2(short *buffer, short *out) {
+  int c00 = buffer[0];
+  int c01 = buffer[1];
+  int c10 = buffer[8];
+  int c11 = buffer[9];
+
+  out[0] = (c00 + c01 + c10 + c11 + 4) >> 3;
+  out[1] = (c00 - c01 + c10 - c11 + 4) >> 3;
+  out[2] = (c00 + c01 - c10 - c11 + 4) >> 3;
+  out[3] = (c00 - c01 - c10 + c11 + 4) >> 3;
+}
+
+/**
+ * Inverse DCT of the coefficients in buffer to (8 >> scale_shift) x (8 >> scale_shift) pixels in out
+ * Full size blocks are transformed in place, buffer and out must then be the same. last is the zigzag index of the last
+ * nonzero coefficient, as returned by decode_mcu
+ */
+static void inverse_dct_block(short *buffer, short *out, int last) {
+  switch (jpegInfo.scale_shift) {
+    case 0:
+      // Compute inverse DCT with ANN algorithm
+#if USE_FLOAT
+      inverse_dct_component_float(buffer);
+#else
+      inverse_dct_component(buffer, last);
 #endif
+      break;
+    case 1:
+      inverse_dct_component_4x4(buffer, out, last);
+      break;
+    case 2:
+      inverse_dct_component_2x2(buffer, out);
+      break;
+    default:
+      // Only the DC coefficient is left, it is 8 times the average of the block
+      out[0] = (buffer[0] + 4) >> 3;
+      break;
+  }
+}
 
 // https://en.wikipedia.org/wiki/YUV Y'UV444 to RGB888 conversion
 static void ycbcr_to_rgb_pixel(short *buffer, short *cbcr, int v, int h) {
   int max_v = jpegInfo.max_v_samp_factor;
   int max_h = jpegInfo.max_h_samp_factor;
+  int shift = 3 - jpegInfo.scale_shift;
+  int block_size = 1 << shift;
+  int block_pixels = block_size * block_size;
 
   // Iterating from bottom right to top leftbecause otherwise the pixel data will get overwritten
-  for (int y = 7; y >= 0; y--) {
-    for (int x = 7; x >= 0; x--) {
-      uint32_t pixel = (y << 3) + x;
-      uint32_t cbcr_pixel_row = y / max_v + 4 * v;
-      uint32_t cbcr_pixel_col = x / max_h + 4 * h;
-      uint32_t cbcr_pixel = (cbcr_pixel_row << 3) + cbcr_pixel_col + 64;
+  for (int y = block_size - 1; y >= 0; y--) {
+    for (int x = block_size - 1; x >= 0; x--) {
+      uint32_t pixel = (y << shift) + x;
+      uint32_t cbcr_pixel_row = (y + (v << shift)) / max_v;
+      uint32_t cbcr_pixel_col = (x + (h << shift)) / max_h;
+      uint32_t cbcr_pixel = (cbcr_pixel_row << shift) + cbcr_pixel_col + block_pixels;
 
 #if USE_FLOAT
       // Floating point version, most accurate, but floating point calculations in DPUs are emulated, so very slow
       short r = buffer[0][pixel] + 1.402 * cbcr[2][cbcr_pixel] + 128;
       short g = buffer[0][pixel] - 0.344 * cbcr[1][cbcr_pixel] - 0.714 * cbcr[2][cbcr_pixel] + 128;
       short b = buffer[0][pixel] + 1.772 * cbcr[1][cbcr_pixel] + 128;
-#else
-      // TODO: if multiplication is too slow, use bit shifting. However, bit shifting is less accurate from what I can
-      // see int r = buffer[0][i] + buffer[2][i] + (buffer[2][i] >> 2) + (buffer[2][i] >> 3) + (buffer[2][i] >> 5) +
-      // 128; int g = buffer[0][i] - ((buffer[1][i] >> 2) + (buffer[1][i] >> 4) + (buffer[1][i] >> 5)) -
-      //         ((buffer[2][i] >> 1) + (buffer[2][i] >> 3) + (buffer[2][i] >> 4) + (buffer[2][i] >> 5)) + 128;
-      // int b = buffer[0][i] + buffer[1][i] + (buffer[1][i] >> 1) + (buffer[1][i] >> 2) + (buffer[1][i] >> 6) + 128;
-
-      // Integer only, quite accurate but may be less performant than only using bit shifting
-      short r = buffer[pixel] + ((45 * cbcr[64 + cbcr_pixel]) >> 5) + 128;
-      short g = buffer[pixel] - ((11 * cbcr[cbcr_pixel] + 23 * cbcr[64 + cbcr_pixel]) >> 5) + 128;
-      short b = buffer[pixel] + ((113 * cbcr[cbcr_pixel]) >> 6) + 128;
-#endif
 
       if (r < 0)
         r = 0;
@@ -890,17 +1200,143 @@ static void ycbcr_to_rgb_pixel(short *buffer, short *cbcr, int v, int h) {
         b = 0;
       if (b > 255)
         b = 255;
+#else
+      // TODO: if multiplication is too slow, use bit shifting. However, bit shifting is less accurate from what I can
+      // see int r = buffer[0][i] + buffer[2][i] + (buffer[2][i] >> 2) + (buffer[2][i] >> 3) + (buffer[2][i] >> 5) +
+      // 128; int g = buffer[0][i] - ((buffer[1][i] >> 2) + (buffer[1][i] >> 4) + (buffer[1][i] >> 5)) -
+      //         ((buffer[2][i] >> 1) + (buffer[2][i] >> 3) + (buffer[2][i] >> 4) + (buffer[2][i] >> 5)) + 128;
+      // int b = buffer[0][i] + buffer[1][i] + (buffer[1][i] >> 1) + (buffer[1][i] >> 2) + (buffer[1][i] >> 6) + 128;
+
+      // Integer only, the multiplications and clamping looked up in the colour conversion tables
+      int luma = buffer[pixel];
+      int cb = CHROMA_INDEX(cbcr[cbcr_pixel]);
+      int cr = CHROMA_INDEX(cbcr[block_pixels + cbcr_pixel]);
+      uint8_t r = color_tables.clamp[(luma + color_tables.cr_r[cr]) & CLAMP_TABLE_MASK];
+      uint8_t g =
+          color_tables.clamp[(luma - ((color_tables.cb_g[cb] + color_tables.cr_g[cr]) >> 5)) & CLAMP_TABLE_MASK];
+      uint8_t b = color_tables.clamp[(luma + color_tables.cb_b[cb]) & CLAMP_TABLE_MASK];
+#endif
 
       buffer[pixel] = r;
-      buffer[64 + pixel] = g;
-      buffer[128 + pixel] = b;
+      buffer[block_pixels + pixel] = g;
+      buffer[2 * block_pixels + pixel] = b;
     }
   }
 }
 
+/**
+ * Whether the chroma is subsampled 2x2 (h2v2) or 2x1 (h2v1) and each chroma sample covers at least one whole group of
+ * luma pixels, so that upsampling can be merged into the colour conversion
+ */
+static int merged_upsample() {
+  uint32_t max_v = jpegInfo.max_v_samp_factor;
+
+  return !USE_FLOAT && jpegInfo.num_planes == 3 && jpegInfo.scale_shift < 3 && jpegInfo.max_h_samp_factor == 2 &&
+         max_v <= 2 && jpegInfo.color_components[0].h_samp_factor == 2 &&
+         jpegInfo.color_components[0].v_samp_factor == max_v && jpegInfo.color_components[1].h_samp_factor == 1 &&
+         jpegInfo.color_components[1].v_samp_factor == 1 && jpegInfo.color_components[2].h_samp_factor == 1 &&
+         jpegInfo.color_components[2].v_samp_factor == 1;
+}
+
+// Add the contributions of its chroma to a luma pixel and write the clamped RGB components in its place
+static inline void merge_rgb_pixel(short *pixel, int block_pixels, int r_offset, int g_offset, int b_offset) {
+  int luma = pixel[0];
+
+  pixel[0] = color_tables.clamp[(luma + r_offset) & CLAMP_TABLE_MASK];
+  pixel[block_pixels] = color_tables.clamp[(luma + g_offset) & CLAMP_TABLE_MASK];
+  pixel[2 * block_pixels] = color_tables.clamp[(luma + b_offset) & CLAMP_TABLE_MASK];
+}
+
+/**
+ * Colour conversion of an h2v2 MCU, whose top left block position starts at mcu and holds the chroma of the MCU
+ * Every chroma sample is converted once and added to the 2x2 luma pixels it covers. The first block overwrites the
+ * chroma with its green and blue, so it goes last and from bottom right to top left, like ycbcr_to_rgb_pixel
+ */
+static void ycbcr_to_rgb_h2v2(short *mcu, int position_size, int row_size) {
+  int shift = 3 - jpegInfo.scale_shift;
+  int block_size = 1 << shift;
+  int block_pixels = block_size * block_size;
+  int half = block_size >> 1;
+  short *cb = &mcu[block_pixels];
+  short *cr = &mcu[2 * block_pixels];
+
+  for (int v = 1; v >= 0; v--) {
+    for (int h = 1; h >= 0; h--) {
+      short *luma = &mcu[v * row_size + h * position_size];
+      for (int y = half - 1; y >= 0; y--) {
+        int cbcr_row = ((y + v * half) << shift) + h * half;
+        short *top = &luma[(y << 1) << shift];
+        short *bottom = top + block_size;
+        for (int x = half - 1; x >= 0; x--) {
+          int cb_value = CHROMA_INDEX(cb[cbcr_row + x]);
+          int cr_value = CHROMA_INDEX(cr[cbcr_row + x]);
+          int r_offset = color_tables.cr_r[cr_value];
+          int g_offset = -((color_tables.cb_g[cb_value] + color_tables.cr_g[cr_value]) >> 5);
+          int b_offset = color_tables.cb_b[cb_value];
+
+          merge_rgb_pixel(&bottom[(x << 1) + 1], block_pixels, r_offset, g_offset, b_offset);
+          merge_rgb_pixel(&bottom[x << 1], block_pixels, r_offset, g_offset, b_offset);
+          merge_rgb_pixel(&top[(x << 1) + 1], block_pixels, r_offset, g_offset, b_offset);
+          merge_rgb_pixel(&top[x << 1], block_pixels, r_offset, g_offset, b_offset);
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Colour conversion of an h2v1 MCU, whose left block position starts at mcu and holds the chroma of the MCU
+ * Every chroma sample is converted once and added to the 2 luma pixels it covers
+ */
+static void ycbcr_to_rgb_h2v1(short *mcu, int position_size) {
+  int shift = 3 - jpegInfo.scale_shift;
+  int block_size = 1 << shift;
+  int block_pixels = block_size * block_size;
+  int half = block_size >> 1;
+  short *cb = &mcu[block_pixels];
+  short *cr = &mcu[2 * block_pixels];
+
+  for (int h = 1; h >= 0; h--) {
+    short *luma = &mcu[h * position_size];
+    for (int y = block_size - 1; y >= 0; y--) {
+      int cbcr_row = (y << shift) + h * half;
+      short *row = &luma[y << shift];
+      for (int x = half - 1; x >= 0; x--) {
+        int cb_value = CHROMA_INDEX(cb[cbcr_row + x]);
+        int cr_value = CHROMA_INDEX(cr[cbcr_row + x]);
+        int r_offset = color_tables.cr_r[cr_value];
+        int g_offset = -((color_tables.cb_g[cb_value] + color_tables.cr_g[cr_value]) >> 5);
+        int b_offset = color_tables.cb_b[cb_value];
+
+        merge_rgb_pixel(&row[(x << 1) + 1], block_pixels, r_offset, g_offset, b_offset);
+        merge_rgb_pixel(&row[x << 1], block_pixels, r_offset, g_offset, b_offset);
+      }
+    }
+  }
+}
+
+// A gray pixel is its luma, level shifted and clamped like the colour components of an RGB pixel
+static void luma_to_gray_pixel(short *buffer) {
+  int block_pixels = 64 >> (2 * jpegInfo.scale_shift);
+
+  for (int i = 0; i < block_pixels; i++) {
+    buffer[i] = color_tables.clamp[buffer[i] & CLAMP_TABLE_MASK];
+  }
+}
+
+/**
+ * Decode the image into block positions of BLOCK_POSITION_SIZE(8 >> scale_shift, num_planes) shorts, each holding the
+ * num_planes colour components of (8 >> scale_shift) x (8 >> scale_shift) pixels one after the other
+ * Components beyond num_planes are decoded to keep the bitstream going, but neither kept nor transformed
+ */
 static short *decompress_scanline(JpegDecompressor *d) {
-  short *mcus = (short *) malloc((jpegInfo.mcu_height_real * jpegInfo.mcu_width_real) * (3 * 64) * sizeof(short));
+  int block_pixels = 64 >> (2 * jpegInfo.scale_shift);
+  int position_size = BLOCK_POSITION_SIZE(8 >> jpegInfo.scale_shift, jpegInfo.num_planes);
+  int num_coeffs = SCALED_COEFFICIENTS[jpegInfo.scale_shift];
+  short *mcus = (short *) malloc(jpegInfo.mcu_height_real * jpegInfo.mcu_width_real * position_size * sizeof(short));
   short previous_dcs[3] = {0};
+  short coeffs[64];
+  int merged = merged_upsample();
   uint32_t restart_interval = jpegInfo.restart_interval * jpegInfo.max_h_samp_factor * jpegInfo.max_v_samp_factor;
 
   for (uint32_t row = 0; row < jpegInfo.mcu_height; row += jpegInfo.max_v_samp_factor) {
@@ -921,34 +1357,53 @@ static short *decompress_scanline(JpegDecompressor *d) {
       for (uint32_t color_index = 0; color_index < jpegInfo.num_color_components; color_index++) {
         for (uint32_t y = 0; y < jpegInfo.color_components[color_index].v_samp_factor; y++) {
           for (uint32_t x = 0; x < jpegInfo.color_components[color_index].h_samp_factor; x++) {
+            if (color_index >= jpegInfo.num_planes) {
+              // Only the DC coefficient is needed, to predict the next one
+              if (decode_mcu(d, color_index, coeffs, &previous_dcs[color_index], 1) < 0) {
+                jpegInfo.valid = 0;
+                fprintf(stderr, "Error: Invalid MCU\n");
+                free(mcus);
+                return NULL;
+              }
+              continue;
+            }
+
             // MCU to index is (current row + vertical sampling) * total number of MCUs in a row of the JPEG
             // + (current col + horizontal sampling)
-            short *buffer = &mcus[(((row + y) * jpegInfo.mcu_width_real + (col + x)) * 3 + color_index) << 6];
+            short *buffer = &mcus[((row + y) * jpegInfo.mcu_width_real + (col + x)) * position_size +
+                                  color_index * block_pixels];
 
-            // Decode Huffman coded bitstream
-            if (decode_mcu(d, color_index, buffer, &previous_dcs[color_index]) != 0) {
+            // Decode Huffman coded bitstream, reduced blocks are decoded aside since their pixels take less space
+            short *block = jpegInfo.scale_shift == 0 ? buffer : coeffs;
+            int last = decode_mcu(d, color_index, block, &previous_dcs[color_index], num_coeffs);
+            if (last < 0) {
               jpegInfo.valid = 0;
               fprintf(stderr, "Error: Invalid MCU\n");
               free(mcus);
               return NULL;
             }
 
-            // Compute inverse DCT with ANN algorithm
-#if USE_FLOAT
-            inverse_dct_component_float(buffer);
-#else
-            inverse_dct_component(buffer);
-#endif
+            inverse_dct_block(block, buffer, last);
           }
         }
       }
 
-      // Convert from YCbCr to RGB
-      short *cbcr = &mcus[((row * jpegInfo.mcu_width_real + col) * 3) << 6];
-      for (int y = jpegInfo.max_v_samp_factor - 1; y >= 0; y--) {
-        for (int x = jpegInfo.max_h_samp_factor - 1; x >= 0; x--) {
-          short *buffer = &mcus[(((row + y) * jpegInfo.mcu_width_real + (col + x)) * 3) << 6];
-          ycbcr_to_rgb_pixel(buffer, cbcr, y, x);
+      // Convert from YCbCr to RGB, or only level shift the luma of a single plane image
+      short *cbcr = &mcus[(row * jpegInfo.mcu_width_real + col) * position_size];
+      if (merged && jpegInfo.max_v_samp_factor == 2) {
+        ycbcr_to_rgb_h2v2(cbcr, position_size, jpegInfo.mcu_width_real * position_size);
+      } else if (merged) {
+        ycbcr_to_rgb_h2v1(cbcr, position_size);
+      } else {
+        for (int y = jpegInfo.max_v_samp_factor - 1; y >= 0; y--) {
+          for (int x = jpegInfo.max_h_samp_factor - 1; x >= 0; x--) {
+            short *buffer = &mcus[((row + y) * jpegInfo.mcu_width_real + (col + x)) * position_size];
+            if (jpegInfo.num_planes == 1) {
+              luma_to_gray_pixel(buffer);
+            } else {
+              ycbcr_to_rgb_pixel(buffer, cbcr, y, x);
+            }
+          }
         }
       }
     }
@@ -957,6 +1412,51 @@ static short *decompress_scanline(JpegDecompressor *d) {
   return mcus;
 }
 
+// Forward scan over the entropy coded data that remembers where the most recently scanned bytes start
+typedef struct EntropyScan {
+  char *ptr;
+  char *recent[8];
+  uint32_t count;
+} EntropyScan;
+
+/**
+ * Advance over one byte of entropy coded data, unstuffing it the same way fill_bit_buffer does
+ * Returns the start of the next byte
+ */
+static char *next_entropy_byte(char *p) {
+  uint8_t byte = *p++;
+  while (byte == 0xFF) {
+    byte = *p++;
+    if (byte >= M_RST_FIRST && byte <= M_RST_LAST) {
+      byte = *p++;
+    }
+  }
+  return p;
+}
+
+/**
+ * Find the file offset of the byte that holds the next unconsumed bit, and how many of its bits have been consumed
+ * The bytes sitting in the bit buffer are located by continuing the forward scan up to d->ptr
+ */
+static uint32_t bitstream_offset(JpegDecompressor *d, EntropyScan *scan, uint8_t *consumed_bits) {
+  char *end = d->data + d->length;
+  char *stop = d->ptr < end ? d->ptr : end;
+  while (scan->ptr < stop) {
+    scan->recent[scan->count++ & 7] = scan->ptr;
+    scan->ptr = next_entropy_byte(scan->ptr);
+  }
+
+  // Bytes past the end of the data are zero padding, they have no position in the file
+  uint32_t buffered = (d->bits_left + 7) >> 3;
+  uint32_t padding = d->ptr - stop;
+  *consumed_bits = (8 - (d->bits_left & 7)) & 7;
+  if (buffered <= padding) {
+    *consumed_bits = 0;
+    return scan->ptr - d->data;
+  }
+  return scan->recent[(scan->count - (buffered - padding)) & 7] - d->data;
+}
+
 /**
  * Read JPEG markers
  * Return 0 when the SOS marker is found
@@ -1027,13 +1527,13 @@ static int read_next_marker(JpegDecompressor *d) {
 static void print_jpeg_decompressor(JpegDecompressor *d) {
   printf("\n********** DQT **********\n");
   for (int i = 0; i < 4; i++) {
-    if (jpegInfo.quant_tables[i].exists) {
+    if (quant_tables[i].exists) {
       printf("Table ID: %d", i);
       for (int j = 0; j < 64; j++) {
         if (j % 8 == 0) {
           printf("\n");
         }
-        printf("%d ", jpegInfo.quant_tables[i].table[j]);
+        printf("%d ", quant_tables[i].table[j]);
       }
       printf("\n\n");
     }
@@ -1055,13 +1555,12 @@ static void print_jpeg_decompressor(JpegDecompressor *d) {
 
   printf("\n********** DHT **********\n");
   for (int i = 0; i < MAX_HUFFMAN_TABLES; i++) {
-    if (jpegInfo.dc_huffman_tables[i].exists) {
+    if (dc_huffman_tables[i].exists) {
       printf("DC Table ID: %d\n", i);
       for (int j = 0; j < 16; j++) {
         printf("%d: ", j + 1);
-        for (int k = jpegInfo.dc_huffman_tables[i].valoffset[j]; k < jpegInfo.dc_huffman_tables[i].valoffset[j + 1];
-             k++) {
-          printf("%d ", jpegInfo.dc_huffman_tables[i].huffval[k]);
+        for (int k = dc_huffman_tables[i].valoffset[j]; k < dc_huffman_tables[i].valoffset[j + 1]; k++) {
+          printf("%d ", dc_huffman_tables[i].huffval[k]);
         }
         printf("\n");
       }
@@ -1069,13 +1568,12 @@ static void print_jpeg_decompressor(JpegDecompressor *d) {
     }
   }
   for (int i = 0; i < MAX_HUFFMAN_TABLES; i++) {
-    if (jpegInfo.ac_huffman_tables[i].exists) {
+    if (ac_huffman_tables[i].exists) {
       printf("AC Table ID: %d\n", i);
       for (int j = 0; j < 16; j++) {
         printf("%d: ", j + 1);
-        for (int k = jpegInfo.ac_huffman_tables[i].valoffset[j]; k < jpegInfo.ac_huffman_tables[i].valoffset[j + 1];
-             k++) {
-          printf("%d ", jpegInfo.ac_huffman_tables[i].huffval[k]);
+        for (int k = ac_huffman_tables[i].valoffset[j]; k < ac_huffman_tables[i].valoffset[j + 1]; k++) {
+          printf("%d ", ac_huffman_tables[i].huffval[k]);
         }
         printf("\n");
       }
@@ -1105,12 +1603,12 @@ static void init_jpeg_info() {
   jpegInfo.valid = 1;
 
   for (int i = 0; i < 4; i++) {
-    jpegInfo.quant_tables[i].exists = 0;
+    quant_tables[i].exists = 0;
 
     if (i < 2) {
       jpegInfo.color_components[i].exists = 0;
-      jpegInfo.dc_huffman_tables[i].exists = 0;
-      jpegInfo.ac_huffman_tables[i].exists = 0;
+      dc_huffman_tables[i].exists = 0;
+      ac_huffman_tables[i].exists = 0;
 
     } else if (i < 3) {
       jpegInfo.color_components[i].exists = 0;
@@ -1129,6 +1627,8 @@ static void init_jpeg_info() {
   jpegInfo.mcu_width = 0;
   jpegInfo.mcu_height = 0;
   jpegInfo.padding = 0;
+  jpegInfo.scale_shift = 0;
+  jpegInfo.num_planes = 0;
 }
 
 static void init_jpeg_decompressor(JpegDecompressor *d) {
@@ -1142,8 +1642,10 @@ static void init_jpeg_decompressor(JpegDecompressor *d) {
  * @param file_length The total length of a file in bytes
  * @param filename The filename of the input file
  * @param buffer The buffer containing all file data
+ * @param scale_width Reduce the image by 1/2, 1/4 or 1/8 while keeping it at least this wide (0 for full size)
+ * @param flags OPTION_FLAG_LUMA_ONLY decodes a colour image to grayscale
  */
-void jpeg_cpu_scale(uint64_t file_length, char *filename, char *buffer) {
+void jpeg_cpu_scale(uint64_t file_length, char *filename, char *buffer, uint32_t scale_width, uint32_t flags) {
   JpegDecompressor decompressor;
   decompressor.length = file_length;
   jpegInfo.length = decompressor.length;
@@ -1153,6 +1655,7 @@ void jpeg_cpu_scale(uint64_t file_length, char *filename, char *buffer) {
   decompressor.data = buffer;
   decompressor.ptr = decompressor.data;
 
+  fill_color_tables(&color_tables, 0, 1);
   init_jpeg_info();
   init_jpeg_decompressor(&decompressor);
 
@@ -1172,6 +1675,13 @@ void jpeg_cpu_scale(uint64_t file_length, char *filename, char *buffer) {
   print_jpeg_decompressor(&decompressor);
 #endif
 
+  jpegInfo.scale_shift = select_scale_shift(jpegInfo.image_width, scale_width);
+  jpegInfo.num_planes = (jpegInfo.num_color_components == 1 || (flags & (1 << OPTION_FLAG_LUMA_ONLY))) ? 1 : 3;
+  prescale_DQT();
+  if (!jpegInfo.valid) {
+    return;
+  }
+
   // Process Huffman coded bitstream, perform inverse DCT, and convert YCbCr to RGB
   short *mcus = decompress_scanline(&decompressor);
   if (mcus == NULL || !jpegInfo.valid) {
@@ -1180,8 +1690,85 @@ void jpeg_cpu_scale(uint64_t file_length, char *filename, char *buffer) {
   }
 
   // Now write the decoded data out as BMP
-  write_bmp_cpu(filename, jpegInfo.image_width, jpegInfo.image_height, jpegInfo.padding, jpegInfo.mcu_width_real, mcus);
+  uint32_t width = SCALED_SIZE(jpegInfo.image_width, jpegInfo.scale_shift);
+  uint32_t height = SCALED_SIZE(jpegInfo.image_height, jpegInfo.scale_shift);
+  uint32_t padding = RASTER_ROW_STRIDE(width, jpegInfo.num_planes) - width * jpegInfo.num_planes;
+  write_bmp_cpu(filename, width, height, padding, jpegInfo.mcu_width_real, 8 >> jpegInfo.scale_shift,
+                jpegInfo.num_planes, mcus);
   free(mcus);
 
   return;
 }
+
+/**
+ * Find where each of num_splits tasklets should start decoding the entropy coded data of a JPEG
+ * The Huffman coded bitstream is decoded once without inverse DCT, recording the exact bit position and DC predictors
+ * at evenly spaced MCUs. Images with restart intervals are not split, since the DPU can split those by itself
+ * Returns 0 on success, -1 if the file could not be split
+ *
+ * @param file_length The total length of a file in bytes
+ * @param buffer The buffer containing all file data
+ * @param splits Filled with one split point per tasklet
+ * @param num_splits The number of tasklets to split the image for
+ */
+int jpeg_cpu_split(uint64_t file_length, char *buffer, dpu_split_t *splits, uint32_t num_splits) {
+  JpegDecompressor decompressor;
+  decompressor.length = file_length;
+  jpegInfo.length = decompressor.length;
+
+  int result = 1;
+
+  decompressor.data = buffer;
+  decompressor.ptr = decompressor.data;
+
+  fill_color_tables(&color_tables, 0, 1);
+  init_jpeg_info();
+  init_jpeg_decompressor(&decompressor);
+
+  // Check whether file starts with SOI
+  check_start_of_image(&decompressor);
+
+  // Continuously read all markers until we reach Huffman coded bitstream
+  while (jpegInfo.valid && result) {
+    result = read_next_marker(&decompressor);
+  }
+
+  if (!jpegInfo.valid || jpegInfo.restart_interval != 0) {
+    return -1;
+  }
+
+  uint32_t mcus_per_row = jpegInfo.mcu_width_real / jpegInfo.max_h_samp_factor;
+  uint32_t total_mcus = mcus_per_row * (jpegInfo.mcu_height_real / jpegInfo.max_v_samp_factor);
+  EntropyScan scan = {.ptr = decompressor.ptr, .count = 0};
+  short previous_dcs[3] = {0};
+  short block[64];
+  uint32_t split = 0;
+
+  for (uint32_t mcu = 0; mcu <= total_mcus; mcu++) {
+    // Several tasklets share a split point when there are fewer MCUs than tasklets
+    while (split < num_splits && mcu == (uint64_t) total_mcus * split / num_splits) {
+      splits[split].offset = bitstream_offset(&decompressor, &scan, &splits[split].consumed_bits);
+      splits[split].mcu = mcu;
+      splits[split].dc[0] = previous_dcs[0];
+      splits[split].dc[1] = previous_dcs[1];
+      splits[split].dc[2] = previous_dcs[2];
+      split++;
+    }
+    if (split == num_splits) {
+      break;
+    }
+
+    for (uint32_t color_index = 0; color_index < jpegInfo.num_color_components; color_index++) {
+      uint32_t blocks = jpegInfo.color_components[color_index].h_samp_factor *
+                        jpegInfo.color_components[color_index].v_samp_factor;
+      for (uint32_t i = 0; i < blocks; i++) {
+        // Only the DC predictors are needed, the AC coefficients are skipped
+        if (decode_mcu(&decompressor, color_index, block, &previous_dcs[color_index], 1) < 0) {
+          return -1;
+        }
+      }
+    }
+  }
+
+  return 0;
+}
@@ -30,7 +30,7 @@
 #define CYCLES_PER_NS (800.0 / 3 * 1000 * 1000)
 #define MAX_DPU_PER_RANK 64
 
-const char options[] = "cdm:r:s:w:fS";
+const char options[] = "cdm:r:s:w:fpobgPS";
 static uint32_t rank_count, dpu_count;
 static uint32_t dpus_per_rank;
 static char **input_files = NULL;
@@ -54,6 +54,23 @@ static char *to_bin(uint64_t i, uint8_t length) {
 }
 #endif // DEBUG
 
+/**
+ * Whether the files of a DPU are small enough to give each one to a single tasklet, rather than have all tasklets
+ * work on one file at a time
+ */
+static int small_files_only(struct host_dpu_descriptor *desc)
+{
+	if (NR_FILE_TASKLETS < 2 || desc->file_count < 2)
+		return 0;
+
+	for (uint32_t file = 0; file < desc->file_count; file++)
+	{
+		if (desc->files[file].length > SMALL_FILE_LENGTH)
+			return 0;
+	}
+	return 1;
+}
+
 void scale_rank(struct dpu_set_t dpu_rank, host_rank_context *desc, struct jpeg_options *opts)
 {
 	struct dpu_set_t dpu;
@@ -75,18 +92,37 @@ void scale_rank(struct dpu_set_t dpu_rank, host_rank_context *desc, struct jpeg_
 	{
 		dpu_inputs[dpu_id].flags = 0;
 		dpu_inputs[dpu_id].file_length = input[dpu_id].in_length;
+		dpu_inputs[dpu_id].file_count = input[dpu_id].file_count;
 		dpu_inputs[dpu_id].scale_width = opts->scale_width;
 		if (opts->flags & (1 << OPTION_FLAG_HORIZONTAL_FLIP))
 			dpu_inputs[dpu_id].flags |= (1 << OPTION_FLAG_HORIZONTAL_FLIP);
+		if (opts->flags & (1 << OPTION_FLAG_RASTER_OUTPUT))
+			dpu_inputs[dpu_id].flags |= (1 << OPTION_FLAG_RASTER_OUTPUT);
+		if (opts->flags & (1 << OPTION_FLAG_BOTTOM_UP))
+			dpu_inputs[dpu_id].flags |= (1 << OPTION_FLAG_BOTTOM_UP);
+		if (opts->flags & (1 << OPTION_FLAG_LUMA_ONLY))
+			dpu_inputs[dpu_id].flags |= (1 << OPTION_FLAG_LUMA_ONLY);
+		if (opts->flags & (1 << OPTION_FLAG_PIPELINE))
+			dpu_inputs[dpu_id].flags |= (1 << OPTION_FLAG_PIPELINE);
+		if (small_files_only(&input[dpu_id]))
+			dpu_inputs[dpu_id].flags |= (1 << OPTION_FLAG_FILE_PER_TASKLET);
+		else if (opts->flags & (1 << OPTION_FLAG_HOST_SPLIT))
+			dpu_inputs[dpu_id].flags |= (1 << OPTION_FLAG_HOST_SPLIT);
 
 		DPU_ASSERT(dpu_prepare_xfer(dpu, (void *) &dpu_inputs[dpu_id]));
 	}
 	DPU_ASSERT(dpu_push_xfer(dpu_rank, DPU_XFER_TO_DPU, "input", 0, ALIGN(sizeof(dpu_inputs_t), 8), DPU_XFER_DEFAULT));
 
-	// copy the compressed files to the DPUs
+	// copy the file tables and compressed files to the DPUs
 	uint32_t longest_length = 0;
 	DPU_FOREACH(dpu_rank, dpu, dpu_id)
 	{
+		dpu_file_t *table = (dpu_file_t *) input[dpu_id].in_buffer;
+		for (uint32_t file = 0; file < input[dpu_id].file_count; file++)
+		{
+			table[file].offset = input[dpu_id].files[file].start;
+			table[file].length = input[dpu_id].files[file].length;
+		}
 		DPU_ASSERT(dpu_prepare_xfer(dpu, (void *) input[dpu_id].in_buffer));
 
 		if (input[dpu_id].in_length > longest_length)
@@ -118,68 +154,95 @@ int read_results_dpu_rank(struct dpu_set_t dpu_rank, struct host_rank_context *r
 		TIME_DIFFERENCE(rank_ctx->start_rank, results_start));
 #endif // STATISTICS
 
-	// get image metadata
+	// get image metadata, one record for each file of the DPU
+	uint32_t most_files = 0;
 	DPU_FOREACH(dpu_rank, dpu, dpu_id)
 	{
 		DPU_ASSERT(dpu_prepare_xfer(dpu, (void *) &rank_ctx->dpus[dpu_id].img));
+
+		if (rank_ctx->dpus[dpu_id].file_count > most_files)
+			most_files = rank_ctx->dpus[dpu_id].file_count;
 	}
-	DPU_ASSERT(dpu_push_xfer(dpu_rank, DPU_XFER_FROM_DPU, "output", 0, sizeof(dpu_output_t), DPU_XFER_DEFAULT));
+	if (most_files > 0)
+		DPU_ASSERT(dpu_push_xfer(dpu_rank, DPU_XFER_FROM_DPU, "outputs", 0, most_files * sizeof(dpu_output_t),
+			DPU_XFER_DEFAULT));
 
 #ifdef STATISTICS
 	// print out measurements made by each DPU
 	DPU_FOREACH(dpu_rank, dpu, dpu_id)
 	{
-		if (dpu_id < rank_ctx->dpu_count)
+		for (uint32_t file = 0; dpu_id < rank_ctx->dpu_count && file < rank_ctx->dpus[dpu_id].file_count; file++)
 		{
-		dpu_output_t *output = rank_ctx->dpus[dpu_id].img;
-		printf("[%u] called decode_mcu %u times\n", dpu_id, output->mcu_decode_tries);
-		printf("[%u] read metadata in %2.5f s (%u cycles)\n", dpu_id,
-			(double)output->cycles_read_markers / CYCLES_PER_NS, output->cycles_read_markers);
-		printf("[%u] huffman decoding took %2.5f s (%u cycles)\n", dpu_id,
-			(double)output->cycles_mcu_decode / CYCLES_PER_NS, output->cycles_mcu_decode);
-		printf("[%u] dequantization took %2.5f s (%u cycles)\n", dpu_id,
-			(double)output->cycles_mcu_dequant / CYCLES_PER_NS, output->cycles_mcu_dequant);
-		printf("[%u] decoded mcus+dequantized in %2.5f s (%u cycles)\n", dpu_id,
-			(double)output->cycles_decode_total / CYCLES_PER_NS, output->cycles_decode_total);
-		printf("[%u] idct in %2.5f (%u cycles)\n", dpu_id,
-			(double)output->cycles_idct / CYCLES_PER_NS, output->cycles_idct);
-		printf("[%u] color conversion in %2.5f (%u cycles)\n", dpu_id,
-			(double)output->cycles_cc / CYCLES_PER_NS, output->cycles_cc);
-		printf("[%u] performed idct+color space in %2.5f (%u cycles)\n", dpu_id,
-			(double)output->cycles_convert_total / CYCLES_PER_NS, output->cycles_convert_total);
-		printf("[%u] total %2.5f (%u cycles)\n", dpu_id,
-			(double)output->cycles_total / CYCLES_PER_NS, output->cycles_total);
+			dpu_output_t *output = &rank_ctx->dpus[dpu_id].img[file];
+			printf("[%u] called decode_mcu %u times\n", dpu_id, output->mcu_decode_tries);
+			printf("[%u] read metadata in %2.5f s (%u cycles)\n", dpu_id,
+				(double)output->cycles_read_markers / CYCLES_PER_NS, output->cycles_read_markers);
+			printf("[%u] huffman decoding took %2.5f s (%u cycles)\n", dpu_id,
+				(double)output->cycles_mcu_decode / CYCLES_PER_NS, output->cycles_mcu_decode);
+			printf("[%u] dequantization took %2.5f s (%u cycles)\n", dpu_id,
+				(double)output->cycles_mcu_dequant / CYCLES_PER_NS, output->cycles_mcu_dequant);
+			printf("[%u] decoded mcus+dequantized in %2.5f s (%u cycles)\n", dpu_id,
+				(double)output->cycles_decode_total / CYCLES_PER_NS, output->cycles_decode_total);
+			printf("[%u] idct in %2.5f (%u cycles)\n", dpu_id,
+				(double)output->cycles_idct / CYCLES_PER_NS, output->cycles_idct);
+			printf("[%u] color conversion in %2.5f (%u cycles)\n", dpu_id,
+				(double)output->cycles_cc / CYCLES_PER_NS, output->cycles_cc);
+			printf("[%u] performed idct+color space in %2.5f (%u cycles)\n", dpu_id,
+				(double)output->cycles_convert_total / CYCLES_PER_NS, output->cycles_convert_total);
+			printf("[%u] total %2.5f (%u cycles)\n", dpu_id,
+				(double)output->cycles_total / CYCLES_PER_NS, output->cycles_total);
 		}
 	}
 #endif // STATISTICS
 
-	// get image data
-	uint64_t largest_size = 0;
 	DPU_FOREACH(dpu_rank, dpu, dpu_id)
 	{
-		uint32_t buf_size = rank_ctx->dpus[dpu_id].img[0].length;
-		dbg_printf("Out buffer size: %u\n", buf_size);
-
-		if (buf_size > MAX_DECODED_DATA_SIZE)
+		for (uint32_t file = 0; file < rank_ctx->dpus[dpu_id].file_count; file++)
 		{
-			// set the length to 0 to indicate no image
-			rank_ctx->dpus[dpu_id].img[0].length = 0;
-			printf("File %s on %u too large - skipping\n", rank_ctx->dpus[dpu_id].filename[0], dpu_id);
-			continue;
-		}
+			dpu_output_t *img = &rank_ctx->dpus[dpu_id].img[file];
+			dbg_printf("Out buffer size: %u at %u\n", img->length, img->offset);
 
-		rank_ctx->dpus[dpu_id].out_buffer = (short*)malloc(MAX_DECODED_DATA_SIZE);
-		DPU_ASSERT(dpu_prepare_xfer(dpu, (void *) rank_ctx->dpus[dpu_id].out_buffer));
+			if (img->offset + img->length > MAX_DECODED_DATA_SIZE)
+			{
+				// set the length to 0 to indicate no image
+				img->length = 0;
+				printf("File %s on %u too large - skipping\n", rank_ctx->dpus[dpu_id].filename[file], dpu_id);
+			}
+		}
 
-		if (buf_size > largest_size)
-			largest_size = buf_size;
+		rank_ctx->dpus[dpu_id].out_buffer = (uint8_t*)malloc(MAX_DECODED_DATA_SIZE);
 	}
 
-	// only copy if at least one DPU completed successfully
-	if (largest_size > 0)
+	// get image data; the images of a DPU are stored one after the other, or in one region per tasklet when each
+	// tasklet decoded files of its own. Every region is only copied as far as the images that start in it go
+	for (uint32_t region = 0; region < NR_FILE_TASKLETS; region++)
 	{
-		dbg_printf("Copying %u bytes from DPU\n", ALIGN(largest_size, 8));
-		DPU_ASSERT(dpu_push_xfer(dpu_rank, DPU_XFER_FROM_DPU, "MCU_buffer", 0, ALIGN(largest_size, 8), DPU_XFER_DEFAULT));
+		uint32_t region_start = region * FILE_TASKLET_REGION_SIZE;
+		uint64_t largest_size = 0;
+		DPU_FOREACH(dpu_rank, dpu, dpu_id)
+		{
+			uint32_t region_end = region_start;
+			for (uint32_t file = 0; file < rank_ctx->dpus[dpu_id].file_count; file++)
+			{
+				dpu_output_t *img = &rank_ctx->dpus[dpu_id].img[file];
+				if (img->length > 0 && img->offset >= region_start &&
+					img->offset < region_start + FILE_TASKLET_REGION_SIZE && img->offset + img->length > region_end)
+					region_end = img->offset + img->length;
+			}
+
+			DPU_ASSERT(dpu_prepare_xfer(dpu, (void *) (rank_ctx->dpus[dpu_id].out_buffer + region_start)));
+
+			if (region_end - region_start > largest_size)
+				largest_size = region_end - region_start;
+		}
+
+		// only copy if at least one DPU completed successfully
+		if (largest_size > 0)
+		{
+			dbg_printf("Copying %u bytes at %u from DPU\n", ALIGN(largest_size, 8), region_start);
+			DPU_ASSERT(dpu_push_xfer(dpu_rank, DPU_XFER_FROM_DPU, "MCU_buffer", region_start, ALIGN(largest_size, 8),
+				DPU_XFER_DEFAULT));
+		}
 	}
 
 	DPU_FOREACH(dpu_rank, dpu, dpu_id)
@@ -284,7 +347,13 @@ int check_for_completed_rank(struct dpu_set_t dpus, uint64_t* rank_status, struc
 							TIME_NOW(&start_bmp);
 #endif // STATISTICS
 							dpu_output_t *img = &desc->img[file];
-							write_bmp_dpu(desc->filename[file], img->width, img->height, img->padding, img->mcu_width_real, desc->out_buffer);
+							if (img->row_stride)
+								write_bmp_dpu_rows(desc->filename[file], img->width, img->height, img->padding,
+									img->num_planes, img->bottom_up, desc->out_buffer + img->offset);
+							else
+								write_bmp_dpu(desc->filename[file], img->width, img->height, img->padding,
+									img->mcu_width_real, img->block_size, img->num_planes,
+									desc->out_buffer + img->offset);
 #ifdef STATISTICS
 							TIME_NOW(&stop_bmp);
 							printf("%2.5f - wrote bmp\n", TIME_DIFFERENCE(program_start, stop_bmp));
@@ -428,8 +497,9 @@ static int dpu_main(struct jpeg_options *opts)
 		{
 			DPU_FOREACH(dpu_rank, dpu, dpu_id)
 			{
+				// the file table and the split points of the files come first in the input buffer
 				rank_input[dpu_id].file_count = 0;
-				rank_input[dpu_id].in_length = 0;
+				rank_input[dpu_id].in_length = FILE_TABLE_LENGTH;
 				rank_input[dpu_id].in_buffer = malloc(MAX_INPUT_LENGTH);
 			}
 		}
@@ -480,6 +550,17 @@ static int dpu_main(struct jpeg_options *opts)
 						break;
 					}
 
+					// find where each tasklet should start decoding, so the DPU doesn't have to guess
+					dpu_file_t *entry = &((dpu_file_t *) rank_input[dpu_id].in_buffer)[rank_input[dpu_id].file_count];
+					entry->split_found = 0;
+					if (opts->flags & (1 << OPTION_FLAG_HOST_SPLIT))
+					{
+						dpu_split_t *splits = (dpu_split_t *) (rank_input[dpu_id].in_buffer + FILE_SPLITS_OFFSET);
+						entry->split_found =
+							jpeg_cpu_split(file_length, next, &splits[rank_input[dpu_id].file_count * NR_TASKLETS],
+								NR_TASKLETS) == 0;
+					}
+
 					// if this is the first file for this DPU, mark the DPU as used
 					if (rank_input[dpu_id].file_count == 0)
 					{
@@ -489,8 +570,9 @@ static int dpu_main(struct jpeg_options *opts)
 #endif // STATISTICS
 					}
 
+					// keep every file 8 byte aligned, so the DPU can start reading it with a single DMA
 					rank_input[dpu_id].file_count++;
-					rank_input[dpu_id].in_length += file_length;// if we need alignment, do it here
+					rank_input[dpu_id].in_length += ALIGN(file_length, 8);
  					prepared_file_count++;
 #ifdef STATISTICS
 					rank_in_length += file_length;
@@ -611,7 +693,7 @@ static int cpu_main(struct jpeg_options *opts) {
     total_data_processed += file_length;
 #endif // STATISTICS
 
-    jpeg_cpu_scale(file_length, filename, buffer);
+    jpeg_cpu_scale(file_length, filename, buffer, opts->scale_width, opts->flags);
     TIME_NOW(&end);
     float run_time = TIME_DIFFERENCE(start, end);
 
@@ -631,6 +713,12 @@ static void usage(const char *exe_name) {
   fprintf(stderr, "d: use DPU\n");
   fprintf(stderr, "m: maximum number of files to process\n");
   fprintf(stderr, "r: maximum number of ranks to use\n");
+  fprintf(stderr, "p: find the entropy split points of each image on the host (DPU only)\n");
+  fprintf(stderr, "w: reduce images by 1/2, 1/4 or 1/8 while decoding, keeping them at least this wide\n");
+  fprintf(stderr, "o: have the DPU write images as BMP rows, top row first (DPU only)\n");
+  fprintf(stderr, "b: with -o, write the bottom row first like most BMP files\n");
+  fprintf(stderr, "g: decode colour images to grayscale, skipping their chroma\n");
+  fprintf(stderr, "P: convert rows while the rest of the image is decoded, with restart markers or -p (DPU only)\n");
   fprintf(stderr, "t: term to search for\n");
 }
 
@@ -657,7 +745,7 @@ int main(int argc, char **argv) {
   memset(&opts, 0, sizeof(struct jpeg_options));
   opts.max_files = UINT_MAX; // no effective maximum by default
   opts.max_ranks = UINT_MAX; // no effective maximum by default
-  opts.scale_width = 256;
+  opts.scale_width = 0; // full size unless a thumbnail width is given
   opts.scale_height = 256;
   opts.flags = 0;
 
@@ -685,6 +773,26 @@ int main(int argc, char **argv) {
 
       case 'f':
         opts.flags |= (1 << OPTION_FLAG_HORIZONTAL_FLIP);
+        break;
+
+      case 'p':
+        opts.flags |= (1 << OPTION_FLAG_HOST_SPLIT);
+        break;
+
+      case 'o':
+        opts.flags |= (1 << OPTION_FLAG_RASTER_OUTPUT);
+        break;
+
+      case 'b':
+        opts.flags |= (1 << OPTION_FLAG_BOTTOM_UP);
+        break;
+
+      case 'g':
+        opts.flags |= (1 << OPTION_FLAG_LUMA_ONLY);
+        break;
+
+      case 'P':
+        opts.flags |= (1 << OPTION_FLAG_PIPELINE);
         break;
 
 		case 'S':